@@ -18,6 +18,10 @@
 //
 #define ATTR_UNUSED __attribute__ ((__unused__))
 
+// This is used by functions that must be inlined in each caller, to compile one copy for each caller
+//
+#define ATTR_ALWAYS_INLINE __attribute__((always_inline))
+
 // This is used by library module constructor
 //
 #define ATTR_CONSTRUCTOR __attribute__((constructor))
@@ -0,0 +1,466 @@
+//
+// Copyright (C) 2024 by Vincenzo Capuano
+//
+
+// Runtime settings and statistics
+//
+// Each entry has a name, a type and the functions to read and to change it (0 for the read only statistics).
+// The settings are changed at start up by VGC_MALLOC_CONF, a list of name:value separated by commas with the names
+// without the "opt." prefix, e.g. VGC_MALLOC_CONF="mprotect:false,stacktrace_size:4,mmap_pages:2000"
+// and at any time by vgc_mallctl().
+// Settings that need a feature compiled in (VGC_MALLOC_MPROTECT, VGC_MALLOC_STACKTRACE) can only be switched off without it.
+// Integer settings with a list of names take the name in VGC_MALLOC_CONF, e.g. "path:lean".
+// The start up settings (shared, lock) are only taken from VGC_MALLOC_CONF.
+//
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "vgc_message.h"
+#include "vgc_malloc_private.h"
+#include "vgc_mallctl.h"
+#include "vgc_malloc.h"
+
+
+extern VGC_shared *shared;
+
+static const char *moduleName = "VGC-MALLOC-CTL";
+
+static bool isStartup = false;	// The settings come from vgc_mallctlInit()
+
+
+typedef enum {
+	MALLCTL_BOOL,
+	MALLCTL_INT,
+	MALLCTL_UNSIGNED,
+	MALLCTL_SIZE
+} MallctlType;
+
+typedef union {
+	bool         b;
+	int          i;
+	unsigned int u;
+	size_t       z;
+} MallctlValue;
+
+typedef struct {
+	const char  *name;
+	MallctlType  type;
+	void       (*get)(MallctlValue *value);
+	int        (*set)(const MallctlValue *value);	// 0 for read only entries, returns 0 or an errno value
+	const char *const *names;			// Names of the values 0, 1, ... of an integer setting in VGC_MALLOC_CONF, or 0
+} Mallctl;
+
+
+// updateMmapBlockSizes
+//
+// Sizes of the MMAP blocks from the settings
+// Huge pages fall back to the system pages with mprotect, that works one system page at a time,
+// with huge pages the MMAP blocks are made of whole huge pages
+//
+static void updateMmapBlockSizes(void)
+{
+	size_t hugePageSize = shared->isHugepagesEnabled && !shared->isMprotectEnabled ? VGC_MALLOC_HUGEPAGE_SIZE : 0;
+	size_t minSize = shared->mmapMinPages * shared->pageSize;
+	size_t maxSize = shared->mmapPages * shared->pageSize;
+
+	if (hugePageSize != 0) {
+		minSize = roundup(minSize, hugePageSize);
+		maxSize = roundup(maxSize, hugePageSize);
+	}
+
+	shared->hugePageSize = hugePageSize;
+	shared->mmapBlockMaxSize = maxSize;
+	shared->mmapBlockMinSize = MIN(minSize, maxSize);
+}
+
+
+// isMemoryAllocated
+//
+// The layout of the blocks depends on mprotect, it can't change once there are MMAP blocks
+//
+static inline bool isMemoryAllocated(void)
+{
+	return __atomic_load_n(&shared->mmapBlockCount, __ATOMIC_RELAXED) != 0 || __atomic_load_n(&shared->slabCount, __ATOMIC_RELAXED) != 0 || shared->largeFirst != 0;
+}
+
+
+// Settings
+//
+static void getMmapPages(MallctlValue *value)       { value->z = shared->mmapPages; }
+static void getMmapMinPages(MallctlValue *value)    { value->z = shared->mmapMinPages; }
+static void getMprotect(MallctlValue *value)        { value->b = shared->isMprotectEnabled; }
+static void getHugepages(MallctlValue *value)       { value->b = shared->isHugepagesEnabled; }
+static void getStacktrace(MallctlValue *value)      { value->b = shared->isStacktraceEnabled; }
+static void getStacktraceSize(MallctlValue *value)  { value->i = shared->stacktraceSize; }
+static void getDebugLevel(MallctlValue *value)      { value->i = vgc_messageGetLevel(); }
+static void getPath(MallctlValue *value)            { value->i = shared->path; }
+static void getEngine(MallctlValue *value)          { value->i = shared->engine; }
+static void getLock(MallctlValue *value)            { value->i = shared->mutexType; }
+static void getCheckInterval(MallctlValue *value)   { value->u = shared->checkInterval; }
+static void getScrubber(MallctlValue *value)        { value->b = shared->isScrubberEnabled; }
+static void getScrubberCpu(MallctlValue *value)     { value->u = shared->scrubberCpu; }
+static void getShared(MallctlValue *value)          { value->b = shared->isShared; }
+static void getSlab(MallctlValue *value)            { value->b = shared->isSlabEnabled; }
+static void getRemoteFree(MallctlValue *value)      { value->b = shared->isRemoteFreeEnabled; }
+
+static const char *const pathNames[] = { "lean", "leak", "full", 0 };
+static const char *const engineNames[] = { "fit", "class", "buddy", 0 };
+static const char *const lockNames[] = { "pthread", "futex", 0 };
+
+static int setMmapPages(const MallctlValue *value)
+{
+	if (value->z == 0) return EINVAL;
+	shared->mmapPages = value->z;
+	updateMmapBlockSizes();
+	return 0;
+}
+
+static int setMmapMinPages(const MallctlValue *value)
+{
+	if (value->z == 0) return EINVAL;
+	shared->mmapMinPages = value->z;
+	updateMmapBlockSizes();
+	return 0;
+}
+
+static int setMprotect(const MallctlValue *value)
+{
+#if !defined(VGC_MALLOC_MPROTECT) && !defined(VGC_MALLOC_MPROTECT_PKEY)
+	if (value->b) return ENOTSUP;
+#endif
+	if (value->b == shared->isMprotectEnabled) return 0;
+	if (isMemoryAllocated()) return EBUSY;
+	shared->isMprotectEnabled = value->b;
+	updateMmapBlockSizes();
+	return 0;
+}
+
+static int setHugepages(const MallctlValue *value)
+{
+	shared->isHugepagesEnabled = value->b;
+	updateMmapBlockSizes();
+	return 0;
+}
+
+static int setStacktrace(const MallctlValue *value)
+{
+#ifndef VGC_MALLOC_STACKTRACE
+	if (value->b) return ENOTSUP;
+#endif
+	shared->isStacktraceEnabled = value->b;
+	return 0;
+}
+
+static int setStacktraceSize(const MallctlValue *value)
+{
+#ifdef VGC_MALLOC_STACKTRACE
+	if (value->i < 1 || value->i > VGC_MALLOC_STACKTRACE_SIZE) return EINVAL;
+	shared->stacktraceSize = value->i;
+	return 0;
+#else
+	return ENOTSUP;
+#endif
+}
+
+static int setDebugLevel(const MallctlValue *value)
+{
+	vgc_messageSetLevel(value->i);
+	return 0;
+}
+
+// The paths share the layout of the blocks, the blocks allocated by one can be freed by another
+//
+static int setPath(const MallctlValue *value)
+{
+	if (value->i < 0 || value->i >= VGC_MALLOC_PATH_ALL) return EINVAL;
+	__atomic_store_n(&shared->path, (VGC_mallocPath)value->i, __ATOMIC_RELAXED);
+	return 0;
+}
+
+// The engines lay out the blocks each in their own way, the engine can't change once there are blocks
+//
+static int setEngine(const MallctlValue *value)
+{
+	if (value->i < 0 || value->i >= VGC_MALLOC_ENGINE_ALL) return EINVAL;
+	if (value->i == (int)shared->engine) return 0;
+	if (isMemoryAllocated()) return EBUSY;
+	shared->engine = value->i;
+	return 0;
+}
+
+// The mutexes are initialised at start up with the kind set then (see mutexType in vgc_malloc.c)
+//
+static int setLock(const MallctlValue *value)
+{
+	if (value->i < 0 || value->i >= VGC_MUTEX_ALL) return EINVAL;
+	if (value->i == (int)shared->mutexType) return 0;
+	if (!isStartup) return EBUSY;
+	shared->mutexType = value->i;
+	return 0;
+}
+
+static int setCheckInterval(const MallctlValue *value)
+{
+	__atomic_store_n(&shared->checkInterval, value->u, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int setScrubber(const MallctlValue *value)
+{
+	shared->isScrubberEnabled = value->b;
+	return vgc_mallocScrubberUpdate() ? 0 : EAGAIN;
+}
+
+static int setScrubberCpu(const MallctlValue *value)
+{
+	if (value->u < 1 || value->u > 100) return EINVAL;
+	__atomic_store_n(&shared->scrubberCpu, value->u, __ATOMIC_RELAXED);
+	return 0;
+}
+
+// The data describing the blocks is moved to private memory at start up when they are private (see initializeShared)
+//
+static int setShared(const MallctlValue *value)
+{
+	if (value->b == shared->isShared) return 0;
+	if (!isStartup) return EBUSY;
+	shared->isShared = value->b;
+	return 0;
+}
+
+// The slots already taken are freed to their slabs when the slabs are disabled
+//
+static int setSlab(const MallctlValue *value)
+{
+	__atomic_store_n(&shared->isSlabEnabled, value->b, __ATOMIC_RELAXED);
+	return 0;
+}
+
+// The blocks already in the remote frees are freed anyway by the next allocations in their arena
+//
+static int setRemoteFree(const MallctlValue *value)
+{
+	__atomic_store_n(&shared->isRemoteFreeEnabled, value->b, __ATOMIC_RELAXED);
+	return 0;
+}
+
+
+// Statistics
+//
+static void getArenas(MallctlValue *value)       { value->u = shared->arenaCount; }
+static void getMmapBlocks(MallctlValue *value)   { value->i = __atomic_load_n(&shared->mmapBlockCount, __ATOMIC_RELAXED); }
+static void getPageSize(MallctlValue *value)     { value->z = shared->pageSize; }
+static void getHugepageSize(MallctlValue *value) { value->z = shared->hugePageSize; }
+static void getScrubberPasses(MallctlValue *value) { value->z = __atomic_load_n(&shared->scrubberPasses, __ATOMIC_RELAXED); }
+static void getScrubberErrors(MallctlValue *value) { value->z = __atomic_load_n(&shared->scrubberErrors, __ATOMIC_RELAXED); }
+static void getSlabs(MallctlValue *value)          { value->i = __atomic_load_n(&shared->slabCount, __ATOMIC_RELAXED); }
+
+static void getLargeBlocks(MallctlValue *value)
+{
+	value->i = 0;
+	if (!PTHREAD_mutexLock(&shared->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on shared mutex", 0);
+		return;
+	}
+	for (VGC_mmapHeader *mmapBlock = shared->largeFirst; mmapBlock != 0; mmapBlock = mmapBlock->next) value->i++;
+	if (!PTHREAD_mutexUnlock(&shared->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock shared mutex", 0);
+	}
+}
+
+// Bytes mapped by all the MMAP blocks, large ones and slabs included
+//
+static void getMapped(MallctlValue *value)
+{
+	value->z = 0;
+	for (unsigned int i = 0; i < shared->arenaCount; i++) {
+		VGC_arena *arena = &shared->arenas[i];
+		if (!PTHREAD_mutexLock(&arena->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on arena mutex", 0);
+			return;
+		}
+		for (VGC_mmapHeader *mmapBlock = arena->mmapBlockFirst; mmapBlock != 0; mmapBlock = mmapBlock->next) value->z += mmapBlock->size;
+		for (VGC_mmapHeader *slab = arena->slabFirst; slab != 0; slab = slab->next) value->z += slab->size;
+		if (!PTHREAD_mutexUnlock(&arena->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock arena mutex", 0);
+		}
+	}
+
+	if (!PTHREAD_mutexLock(&shared->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on shared mutex", 0);
+		return;
+	}
+	for (VGC_mmapHeader *mmapBlock = shared->largeFirst; mmapBlock != 0; mmapBlock = mmapBlock->next) value->z += mmapBlock->size;
+	if (!PTHREAD_mutexUnlock(&shared->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock shared mutex", 0);
+	}
+}
+
+
+static const Mallctl mallctls[] = {
+	{ "opt.mmap_pages",        MALLCTL_SIZE,     getMmapPages,      setMmapPages,      0           },
+	{ "opt.mmap_min_pages",    MALLCTL_SIZE,     getMmapMinPages,   setMmapMinPages,   0           },
+	{ "opt.mprotect",          MALLCTL_BOOL,     getMprotect,       setMprotect,       0           },
+	{ "opt.hugepages",         MALLCTL_BOOL,     getHugepages,      setHugepages,      0           },
+	{ "opt.stacktrace",        MALLCTL_BOOL,     getStacktrace,     setStacktrace,     0           },
+	{ "opt.stacktrace_size",   MALLCTL_INT,      getStacktraceSize, setStacktraceSize, 0           },
+	{ "opt.debug_level",       MALLCTL_INT,      getDebugLevel,     setDebugLevel,     0           },
+	{ "opt.path",              MALLCTL_INT,      getPath,           setPath,           pathNames   },
+	{ "opt.engine",            MALLCTL_INT,      getEngine,         setEngine,         engineNames },
+	{ "opt.lock",              MALLCTL_INT,      getLock,           setLock,           lockNames   },
+	{ "opt.check_interval",    MALLCTL_UNSIGNED, getCheckInterval,  setCheckInterval,  0           },
+	{ "opt.scrubber",          MALLCTL_BOOL,     getScrubber,       setScrubber,       0           },
+	{ "opt.scrubber_cpu",      MALLCTL_UNSIGNED, getScrubberCpu,    setScrubberCpu,    0           },
+	{ "opt.shared",            MALLCTL_BOOL,     getShared,         setShared,         0           },
+	{ "opt.slab",              MALLCTL_BOOL,     getSlab,           setSlab,           0           },
+	{ "opt.remote_free",       MALLCTL_BOOL,     getRemoteFree,     setRemoteFree,     0           },
+	{ "stats.arenas",          MALLCTL_UNSIGNED, getArenas,         0,                 0           },
+	{ "stats.mmap_blocks",     MALLCTL_INT,      getMmapBlocks,     0,                 0           },
+	{ "stats.large_blocks",    MALLCTL_INT,      getLargeBlocks,    0,                 0           },
+	{ "stats.slabs",           MALLCTL_INT,      getSlabs,          0,                 0           },
+	{ "stats.mapped",          MALLCTL_SIZE,     getMapped,         0,                 0           },
+	{ "stats.page_size",       MALLCTL_SIZE,     getPageSize,       0,                 0           },
+	{ "stats.hugepage_size",   MALLCTL_SIZE,     getHugepageSize,   0,                 0           },
+	{ "stats.scrubber_passes", MALLCTL_SIZE,     getScrubberPasses, 0,                 0           },
+	{ "stats.scrubber_errors", MALLCTL_SIZE,     getScrubberErrors, 0,                 0           },
+	{ 0,                       0,                0,                 0,                 0         }
+};
+
+
+// findMallctl
+//
+static const Mallctl *findMallctl(const char *name, size_t length)
+{
+	for (const Mallctl *mallctl = mallctls; mallctl->name != 0; mallctl++) {
+		if (strlen(mallctl->name) == length && strncmp(mallctl->name, name, length) == 0) return mallctl;
+	}
+	return 0;
+}
+
+
+// typeSize
+//
+static inline size_t typeSize(MallctlType type)
+{
+	return type == MALLCTL_BOOL ? sizeof(bool) : type == MALLCTL_INT ? sizeof(int) : type == MALLCTL_UNSIGNED ? sizeof(unsigned int) : sizeof(size_t);
+}
+
+
+// parseValue
+//
+// Converts the string of a VGC_MALLOC_CONF setting to the type of the entry
+//
+static bool parseValue(const Mallctl *mallctl, const char *string, size_t length, MallctlValue *value)
+{
+	const MallctlType type = mallctl->type;
+	char buffer[32];
+	if (length == 0 || length >= sizeof(buffer)) return false;
+	memcpy(buffer, string, length);
+	buffer[length] = 0;
+
+	if (type == MALLCTL_BOOL) {
+		if (strcmp(buffer, "true") == 0 || strcmp(buffer, "1") == 0) value->b = true;
+		else if (strcmp(buffer, "false") == 0 || strcmp(buffer, "0") == 0) value->b = false;
+		else return false;
+		return true;
+	}
+
+	for (int i = 0; mallctl->names != 0 && mallctl->names[i] != 0; i++) {
+		if (strcmp(buffer, mallctl->names[i]) == 0) {
+			value->i = i;
+			return true;
+		}
+	}
+
+	char *end;
+	errno = 0;
+	long long int number = strtoll(buffer, &end, 0);
+	if (errno != 0 || *end != 0) return false;
+	if (type != MALLCTL_INT && number < 0) return false;
+
+	if (type == MALLCTL_INT) value->i = number;
+	else if (type == MALLCTL_UNSIGNED) value->u = number;
+	else value->z = number;
+	return true;
+}
+
+
+// vgc_mallctlInit
+//
+// Applies the settings in conf (vgc_mallocConf or VGC_MALLOC_CONF, may be 0) and derives the MMAP block sizes
+// Wrong settings are reported and skipped
+//
+bool vgc_mallctlInit(const char *conf)
+{
+	const char prefix[] = "opt.";
+	char name[64];
+
+	isStartup = true;
+	for (const char *setting = conf; setting != 0 && *setting != 0; ) {
+		const char *end = strchr(setting, ',');
+		if (end == 0) end = setting + strlen(setting);
+
+		const char *colon = memchr(setting, ':', end - setting);
+		size_t nameLength = colon != 0 ? (size_t)(colon - setting) : 0;
+		const Mallctl *mallctl = 0;
+		if (nameLength != 0 && nameLength + sizeof(prefix) <= sizeof(name)) {
+			memcpy(name, prefix, sizeof(prefix) - 1);
+			memcpy(&name[sizeof(prefix) - 1], setting, nameLength);
+			mallctl = findMallctl(name, nameLength + sizeof(prefix) - 1);
+		}
+
+		MallctlValue value;
+		if (mallctl == 0 || mallctl->set == 0) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "VGC_MALLOC_CONF", "Warning", "unknown setting", ": %.*s", (int)(end - setting), setting);
+		}
+		else if (!parseValue(mallctl, colon + 1, end - colon - 1, &value)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "VGC_MALLOC_CONF", "Warning", "wrong value", ": %.*s", (int)(end - setting), setting);
+		}
+		else {
+			int error = mallctl->set(&value);
+			if (error != 0) {
+				vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "VGC_MALLOC_CONF", "Warning", "can't apply", ": %.*s (%s)", (int)(end - setting), setting, strerror(error));
+			}
+		}
+
+		setting = *end == ',' ? end + 1 : end;
+	}
+	isStartup = false;
+
+	updateMmapBlockSizes();
+	return true;
+}
+
+
+// vgc_mallctl
+//
+// Reads the value of "name" in oldp if not 0 and sets it from newp if not 0
+// The values are bool, int, unsigned int or size_t as in the table above
+// Returns 0 on success or: ENOENT for an unknown name, EPERM setting a statistic,
+// EINVAL for a wrong value, ENOTSUP if the feature was not compiled in, EBUSY if it can't change anymore,
+// EAGAIN if the scrubber thread can't be started or stopped
+//
+ATTR_PUBLIC int vgc_mallctl(const char *name, void *oldp, const void *newp)
+{
+	if (name == 0) return EINVAL;
+	const Mallctl *mallctl = findMallctl(name, strlen(name));
+	if (mallctl == 0) return ENOENT;
+
+	if (oldp != 0) {
+		MallctlValue value;
+		mallctl->get(&value);
+		memcpy(oldp, &value, typeSize(mallctl->type));
+	}
+
+	if (newp != 0) {
+		if (mallctl->set == 0) return EPERM;
+
+		MallctlValue value;
+		memcpy(&value, newp, typeSize(mallctl->type));
+		return mallctl->set(&value);
+	}
+	return 0;
+}
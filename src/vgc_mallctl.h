@@ -0,0 +1,11 @@
+//
+// Copyright (C) 2024 by Vincenzo Capuano
+//
+#pragma once
+
+#include "vgc_common.h"
+
+
+// Functions
+//
+bool vgc_mallctlInit(const char *conf);
@@ -4,15 +4,23 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sched.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/param.h>
+#include <sys/random.h>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
 
 #include "vgc_common.h"
 #include "vgc_message.h"
 #include "vgc_stacktrace.h"
 #include "vgc_mprotect.h"
 #include "vgc_mprotect_mp.h"
+#include "vgc_pagemap.h"
+#include "vgc_mallctl.h"
 #include "vgc_malloc_private.h"
 #include "vgc_malloc.h"
 
@@ -21,12 +29,130 @@
 # define VGC_MALLOC_DEBUG_LEVEL 4
 #endif
 
+// The MMAP blocks of an arena start at VGC_MALLOC_MMAP_MIN_PAGES pages and double at each new block up to VGC_MALLOC_MMAP_PAGES pages
+// These are the defaults of the settings mmap_min_pages and mmap_pages (see vgc_mallctl.c)
+//
+#ifndef VGC_MALLOC_MMAP_MIN_PAGES
+# define VGC_MALLOC_MMAP_MIN_PAGES 64
+#endif
+
 #ifndef VGC_MALLOC_MMAP_PAGES
 # define VGC_MALLOC_MMAP_PAGES 8000
 #endif
 
+// Thread cache: number of size bins (VGC_MALLOC_ALIGNMENT bytes, or one page with mprotect, each) and blocks kept per bin
+// Set VGC_MALLOC_TCACHE_COUNT to 0 to disable the thread cache
+//
+#ifndef VGC_MALLOC_TCACHE_BINS
+# define VGC_MALLOC_TCACHE_BINS 128
+#endif
+
+#ifndef VGC_MALLOC_TCACHE_COUNT
+# define VGC_MALLOC_TCACHE_COUNT 8
+#endif
+
+// vgc_calloc() clears memory from this size on with non temporal stores, bypassing the cache
+//
+#ifndef VGC_MALLOC_STREAM_SIZE
+# define VGC_MALLOC_STREAM_SIZE (256 * 1024)
+#endif
+
+// Empty MMAP blocks kept in each arena for the next allocations instead of being unmapped at once
+// After VGC_MALLOC_DECAY_MS their pages are given back to the kernel, after twice that time they are unmapped
+//
+#ifndef VGC_MALLOC_EMPTY_MMAPS
+# define VGC_MALLOC_EMPTY_MMAPS 2
+#endif
+
+#ifndef VGC_MALLOC_DECAY_MS
+# define VGC_MALLOC_DECAY_MS 10000
+#endif
+
+// The pages inside the FREE blocks of at least VGC_MALLOC_PURGE_SIZE bytes are given back to the kernel
+// each time VGC_MALLOC_PURGE_THRESHOLD bytes are freed in an MMAP block
+//
+#ifndef VGC_MALLOC_PURGE_SIZE
+# define VGC_MALLOC_PURGE_SIZE (64 * 1024)
+#endif
+
+#ifndef VGC_MALLOC_PURGE_THRESHOLD
+# define VGC_MALLOC_PURGE_THRESHOLD (4 * 1024 * 1024)
+#endif
+
+// The class engine unifies the FREE blocks of an MMAP block when a request doesn't fit
+// and at least VGC_MALLOC_MERGE_THRESHOLD bytes were freed since the last time
+//
+#ifndef VGC_MALLOC_MERGE_THRESHOLD
+# define VGC_MALLOC_MERGE_THRESHOLD (1024 * 1024)
+#endif
+
+// Allocation path at start, default of the setting path (see vgc_mallctl.c)
+//
+#ifndef VGC_MALLOC_PATH
+# define VGC_MALLOC_PATH VGC_MALLOC_PATH_FULL
+#endif
+
+// Allocation engine of the MMAP blocks, default of the setting engine (see vgc_mallctl.c)
+//
+#ifndef VGC_MALLOC_ENGINE
+# define VGC_MALLOC_ENGINE VGC_MALLOC_ENGINE_FIT
+#endif
+
+// Kind of the mutexes, default of the setting lock (see vgc_mallctl.c and mutexType)
+//
+#ifndef VGC_MALLOC_LOCK
+# define VGC_MALLOC_LOCK VGC_MUTEX_ALL
+#endif
+
+// Each operation checks the headers of its block and of the blocks close to it,
+// the whole MMAP block is checked every VGC_MALLOC_CHECK_INTERVAL operations on it (default of the setting check_interval)
+//
+#ifndef VGC_MALLOC_CHECK_INTERVAL
+# define VGC_MALLOC_CHECK_INTERVAL 1024
+#endif
+
+// The scrubber thread uses up to VGC_MALLOC_SCRUBBER_CPU percent of a CPU (default of the setting scrubber_cpu)
+// and waits VGC_MALLOC_SCRUBBER_PAUSE_MS after checking all the MMAP blocks
+//
+#ifndef VGC_MALLOC_SCRUBBER_CPU
+# define VGC_MALLOC_SCRUBBER_CPU 5
+#endif
+
+#ifndef VGC_MALLOC_SCRUBBER_PAUSE_MS
+# define VGC_MALLOC_SCRUBBER_PAUSE_MS 100
+#endif
+
+// The MMAP blocks are shared with the processes forked after they are created, default of the setting shared (see vgc_mallctl.c)
+// Without it the memory is private as for the C library allocator: a forked process gets a copy
+//
+#ifndef VGC_MALLOC_SHARED
+#define VGC_MALLOC_SHARED true
+#endif
+
+// The blocks up to VGC_MALLOC_SLAB_MAX_SIZE bytes are slab slots, default of the setting slab (see vgc_mallctl.c)
+//
+#ifndef VGC_MALLOC_SLAB
+#define VGC_MALLOC_SLAB true
+#endif
+
+// The blocks freed by the threads of other arenas are given back by the threads of their arena,
+// default of the setting remote_free (see vgc_mallctl.c)
+//
+#ifndef VGC_MALLOC_REMOTE_FREE
+#define VGC_MALLOC_REMOTE_FREE true
+#endif
+
 static void mallocCleanup(void);
 static bool initializeShared(void);
+static bool threadCacheInit(void);
+static void threadCacheFlushAll(void);
+static void freeMallocBlock(void *ptr);
+static void remoteFreeDrain(VGC_arena *arena);
+static void arenaDecay(VGC_arena *arena, bool isForced);
+static void dumpSlab(const char *str, VGC_mmapHeader *slab, const char *desc);
+static void freeBlocksNext(VGC_mallocHeader *mallocBlock);
+static VGC_mallocHeader *freeBlocksPrev(VGC_mallocHeader *mallocBlock);
+static void newFreeBlock(VGC_mmapHeader *mmapBlock, void *at, size_t size, VGC_mallocHeader *prev, VGC_mallocHeader *next);
 
 // All the malloc management data is here
 //
@@ -35,16 +161,51 @@ VGC_shared *shared = 0;
 
 static const char *moduleName = "VGC-MALLOC";
 
+static bool isInitialised = false;	// The arenas are ready, the settings can start threads
+
+__thread bool vgc_isInternal __attribute__((tls_model("initial-exec"))) = false;
+const char   *vgc_mallocConf = 0;
+bool          vgc_isPreloaded = false;
+
+
+// Allocation paths
+//
+// The functions used by vgc_malloc(), vgc_free() and vgc_realloc(), including those of the large blocks, take the path
+// as a constant and are inlined in one function for each path (see mallocPaths), so the compiler drops the code of the
+// checks a path doesn't do. vgc_calloc() and the other functions built on them read the path at run time.
+//
+static inline bool isPathChecked(const VGC_mallocPath path)	// Block markers checked and stack traces saved
+{
+	return path != VGC_MALLOC_PATH_LEAN;
+}
+
+static inline bool isPathDebug(const VGC_mallocPath path)	// Whole MMAP checked at each operation and debug messages
+{
+	return path == VGC_MALLOC_PATH_FULL;
+}
+
+// The lean path saves no stack trace but clears the one in the header, the path can change at run time
+// and the leak report of another path must not read what is left there by the memory used before
+//
+static inline void stacktraceSave(VGC_mallocHeader *mallocBlock, const VGC_mallocPath path)
+{
+	if (isPathChecked(path)) vgc_stacktraceSave(mallocBlock);
+#ifdef VGC_MALLOC_STACKTRACE
+	else mallocBlock->btArraySize = 0;
+#endif
+}
+
 
 // Executed once at library loading
 //
 static void __attribute__ ((constructor)) my_init(void)
 {
 	pid_t master = getpid();
-	printf("Starting.....................: %d\n", master);
+	if (!vgc_isPreloaded) printf("Starting.....................: %d\n", master);
 	vgc_messageInit();
 	if (!vgc_stacktraceInit()) exit(EXIT_FAILURE);	// Used by mprotect
 	if (!initializeShared()) exit(EXIT_FAILURE);
+	if (!threadCacheInit()) exit(EXIT_FAILURE);
 	shared->pid = master;
 }
 
@@ -54,9 +215,11 @@ static void __attribute__ ((destructor)) my_fini(void)
 {
 	// This function is called every time a process using this library ends
 	// we want to close everything only when the library is unloaded
+	// A preloaded library leaves the memory as it is: the destructors of the other libraries can still use it
 	//
 	pid_t master = getpid();
-	if (master == shared->pid) {
+	if (!vgc_isPreloaded && shared != 0 && master == shared->pid) {
+		vgc_isInternal = true;
 		mallocCleanup();
 		printf("Stopping.....................: %d\n", master);
 	}
@@ -67,345 +230,343 @@ static void __attribute__ ((destructor)) my_fini(void)
 //
 static inline VGC_mallocHeader *firstMallocHeaderInMMAP(VGC_mmapHeader *mmapBlock)
 {
-	return (VGC_mallocHeader*)((char*)mmapBlock + sizeof(VGC_mmapHeader));
+	return (VGC_mallocHeader*)((char*)mmapBlock + VGC_MALLOC_MMAP_FIRST);
 }
 
 
-// dumpMmapBlock
+// mallocBlockMemory
 //
-// Must be inside a mutex for the mmapBlock
+// Memory returned to the user for a block allocated for "length" bytes
+// With mprotect the memory ends at the end of the last page of the block, next to the protected page of the following header
 //
-static void dumpMmapBlock(char *response, size_t size, const char *str, VGC_mmapHeader *mmapBlock, const char *desc)
+static inline void *mallocBlockMemory(VGC_mallocHeader *mallocBlock, size_t length)
 {
-	if (mmapBlock == 0 || str == 0 || desc == 0) return;
+	void *memory = (char*)mallocBlock + sizeof(VGC_mallocHeader);
+	if (shared->isMprotectEnabled) {
+		memory += ((unsigned int)shared->pageSize - length % shared->pageSize) % shared->pageSize;
+	}
+	return memory;
+}
 
-	const char *dashes =  "---------------------------------------------------------------------";
 
-	if (response != 0) {
-		snprintf(&response[strlen(response)], mmapBlock->maxSize, "\nMMAP at 0x%.12lx\n", (long unsigned int)mmapBlock);
-		snprintf(&response[strlen(response)], mmapBlock->maxSize, " ID memory         prev           next           status    size\n");
-		snprintf(&response[strlen(response)], mmapBlock->maxSize, "%s\n",dashes);
-	}
-	else {
-		vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, desc, 0, "MMAP at 0x%.12lx", mmapBlock);
-		vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, " ID memory         prev           next           status    size", "", 0);
-		vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, dashes, "", 0);
+// mallocHeaderOf
+//
+// Header of the block containing the memory returned by vgc_malloc()
+//
+static inline VGC_mallocHeader *mallocHeaderOf(void *ptr)
+{
+	if (shared->isMprotectEnabled) {
+		unsigned long int mask = shared->pageSize - 1;
+		ptr = (void*)((unsigned long int)ptr & ~mask);
 	}
+	return (VGC_mallocHeader*)((char*)ptr - sizeof(VGC_mallocHeader));
+}
 
-	int i = 0;
-	size_t busySize = 0;
-	size_t freeSize = 0;
-	size_t headersSize = 0;
-
-	for (VGC_mallocHeader *mallocBlock = firstMallocHeaderInMMAP(mmapBlock); mallocBlock != 0; mallocBlock = mallocBlock->next) {
-		headersSize += sizeof(VGC_mallocHeader);
-		if (mallocBlock->status == VGC_MALLOC_FREE) {
-			freeSize += mallocBlock->size;
-		}
-		else {
-			busySize += mallocBlock->size;
-		}
 
-		if (response != 0) {
-			char buffer[200];
-			snprintf(buffer, 200, "%s%3d%s 0x%.12lx%s 0x%.12lx 0x%.12lx %s%s%s %9d bytes\n",
-					c_blue, i++, c_black,
-					(long unsigned int)((char*)mallocBlock + sizeof(VGC_mallocHeader)), c_red,
-					mallocBlock->prev == 0 ? 0 : (long unsigned int)((char*)mallocBlock->prev + sizeof(VGC_mallocHeader)),
-					mallocBlock->next == 0 ? 0 : (long unsigned int)((char*)mallocBlock->next + sizeof(VGC_mallocHeader)),
-					mallocBlock->status == VGC_MALLOC_FREE ? c_green : c_blue, mallocBlock->status == VGC_MALLOC_FREE ? "FREE" : "BUSY", c_black,
-					(int)mallocBlock->size);
-			int length = strlen(response);
-			if (length + strlen(buffer) >= size) return;
-			strcat(&response[length], buffer);
-		}
-		else {
-			vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "", "", "%s%3d%s 0x%.12lx%s 0x%.12lx 0x%.12lx %s%s%s %9d bytes",
-					c_blue, i++, c_black,
-					(char*)mallocBlock + sizeof(VGC_mallocHeader), c_red,
-					mallocBlock->prev == 0 ? 0 : (char*)mallocBlock->prev + sizeof(VGC_mallocHeader),
-					mallocBlock->next == 0 ? 0 : (char*)mallocBlock->next + sizeof(VGC_mallocHeader),
-					mallocBlock->status == VGC_MALLOC_FREE ? c_green : c_blue, mallocBlock->status == VGC_MALLOC_FREE ? "FREE" : "BUSY", c_black,
-					mallocBlock->size);
-		}
+// usableSize
+//
+// Bytes from ptr, returned by vgc_malloc(), to the end of its block
+//
+static inline size_t usableSize(VGC_mallocHeader *mallocBlock, void *ptr)
+{
+	return (char*)mallocBlock + sizeof(VGC_mallocHeader) + mallocBlock->size - (char*)ptr;
+}
 
-		if (mallocBlock->status == VGC_MALLOC_BUSY) {
-			vgc_stacktraceShow(mallocBlock);
-		}
-	}
 
-	size_t maxSize = shared->mmapBlockSize - sizeof(VGC_mmapHeader) - headersSize;
-	size_t totalSize = busySize + freeSize;
+// mmapBlockOf
+//
+// MMAP block owning the memory returned by vgc_malloc(), or 0 if ptr was not returned by vgc_malloc()
+// It takes no lock, see vgc_pagemap.c
+//
+static inline VGC_mmapHeader *mmapBlockOf(void *ptr)
+{
+	VGC_mmapHeader *mmapBlock = vgc_pagemapGet(ptr);
+	if (mmapBlock == 0) return 0;
+	if (mmapBlock->type == VGC_MMAP_SLAB) return (char*)ptr >= mmapBlock->slots ? mmapBlock : 0;
+	if ((char*)ptr < (char*)firstMallocHeaderInMMAP(mmapBlock) + sizeof(VGC_mallocHeader)) return 0;
+	return mmapBlock;
+}
 
-	if (response != 0) {
-		char buffer[100];
 
-		snprintf(buffer, 100, "%s\n", dashes);
-		int length = strlen(response);
-		if (length + strlen(buffer) >= size) return;
-		strcat(&response[length], buffer);
+// mallocStatusName
+//
+static inline const char *mallocStatusName(VGC_mallocStatus status)
+{
+	return status == VGC_MALLOC_FREE ? "FREE" : status == VGC_MALLOC_CACHED ? "CACHE" : "BUSY";
+}
 
-		snprintf(buffer, 100, "%ssize allocated.: %s%9d bytes\n", c_black, c_blue, (int)shared->mmapBlockSize);
-		length = strlen(response);
-		if (length + strlen(buffer) >= size) return;
-		strcat(&response[length], buffer);
 
-		snprintf(buffer, 100, "%ssize busy......: %s%9d bytes\n", c_black, c_blue, (int)busySize);
-		length = strlen(response);
-		if (length + strlen(buffer) >= size) return;
-		strcat(&response[length], buffer);
+// mmapPagesName
+//
+static inline const char *mmapPagesName(VGC_mmapPages pages)
+{
+	return pages == VGC_MMAP_PAGES_THP ? "huge (THP)" : pages == VGC_MMAP_PAGES_HUGETLB ? "huge (hugetlb)" : "system";
+}
 
-		snprintf(buffer, 100, "%ssize free......: %s%9d bytes\n", c_black, c_blue, (int)freeSize);
-		length = strlen(response);
-		if (length + strlen(buffer) >= size) return;
-		strcat(&response[length], buffer);
 
-		snprintf(buffer, 100, "%ssize total.....: %s%9d bytes *\n", c_black, c_green, (int)totalSize);
-		length = strlen(response);
-		if (length + strlen(buffer) >= size) return;
-		strcat(&response[length], buffer);
+// sizeClass
+//
+// First level of the free lists for a block of "size" bytes: blocks in class n have size in [2^n, 2^(n+1))
+//
+static inline unsigned int sizeClass(size_t size)
+{
+	return sizeof(size_t) * 8 - 1 - __builtin_clzl(size);
+}
 
-		snprintf(buffer, 100, "%ssize max.......: %s%9d bytes *\n", c_black, c_green, (int)maxSize);
-		length = strlen(response);
-		if (length + strlen(buffer) >= size) return;
-		strcat(&response[length], buffer);
 
-		snprintf(buffer, 100, "%s%s\n", c_black, dashes);
-		length = strlen(response);
-		if (length + strlen(buffer) >= size) return;
-		strcat(&response[length], buffer);
-	}
-	else {
-		vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, dashes, "", 0);
-		vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "", "", "size allocated.: %s%9d bytes", c_blue, shared->mmapBlockSize);
-		vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "", "", "size busy......: %s%9d bytes", c_blue, busySize);
-		vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "", "", "size free......: %s%9d bytes", c_blue, freeSize);
-		vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "", "", "size total.....: %s%9d bytes *", c_green, totalSize);
-		vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "", "", "size max.......: %s%9d bytes *", c_green, maxSize);
-		vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, dashes, "", 0);
-	}
+// sizeSubclass
+//
+// Second level of the free lists for a block of "size" bytes in class "class": the linear range of the class it is in
+//
+static inline unsigned int sizeSubclass(size_t size, unsigned int class)
+{
+	const unsigned int shift = VGC_MALLOC_FREE_SUBLISTS_LOG2;
+	size_t sub = class >= shift ? size >> (class - shift) : size << (shift - class);
+	return sub & (VGC_MALLOC_FREE_SUBLISTS - 1);
 }
 
 
-// checkMmapBlock
+// freeListInsert
 //
 // Must be inside a mutex for the mmapBlock
 //
-static bool checkMmapBlock(const char *str, VGC_mmapHeader *mmapBlock)
+static void freeListInsert(VGC_mmapHeader *mmapBlock, VGC_mallocHeader *mallocBlock)
 {
-	size_t busySize = 0;
-	size_t freeSize = 0;
-	size_t headersSize = 0;
-
-	for (register VGC_mallocHeader *mallocBlock = firstMallocHeaderInMMAP(mmapBlock); mallocBlock != 0; mallocBlock = mallocBlock->next) {
-		headersSize += sizeof(VGC_mallocHeader);
-		if (mallocBlock->status == VGC_MALLOC_FREE) {
-			freeSize += mallocBlock->size;
-		}
-		else {
-			busySize += mallocBlock->size;
-		}
-
-		if (mallocBlock->size > mmapBlock->maxSize) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "Found too big memory block", "Error", ": in memory allocated at 0x%.12lx", (char*)mallocBlock + sizeof(VGC_mallocHeader));
-			dumpMmapBlock(0, 0, str, mmapBlock, "memory block wrong size");
-			return false;
-		}
+	unsigned int class = sizeClass(mallocBlock->size);
+	unsigned int sub = sizeSubclass(mallocBlock->size, class);
+
+	mallocBlock->freePrev = 0;
+	mallocBlock->freeNext = mmapBlock->freeLists[class][sub];
+	if (mallocBlock->freeNext != 0) mallocBlock->freeNext->freePrev = mallocBlock;
+	mmapBlock->freeLists[class][sub] = mallocBlock;
+	mmapBlock->freeSublistsMap[class] |= 1 << sub;
+	mmapBlock->freeListsMap |= (uint64_t)1 << class;
+}
 
-		if (mallocBlock < (VGC_mallocHeader *)mmapBlock || mallocBlock > (VGC_mallocHeader *)((char *)mmapBlock + shared->mmapBlockSize)) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "Found wrong memory pointer", "Error", ": in memory allocated at 0x%.12lx points outside the MMAP", (char*)mallocBlock + sizeof(VGC_mallocHeader));
-			dumpMmapBlock(0, 0, str, mmapBlock, "memory block wrong pointer");
-			return false;
-		}
 
-		if (mallocBlock->next == 0) {
-			break;
-		}
+// freeListRemove
+//
+// Must be inside a mutex for the mmapBlock
+// The block size must be the same it had when it was inserted
+//
+static void freeListRemove(VGC_mmapHeader *mmapBlock, VGC_mallocHeader *mallocBlock)
+{
+	unsigned int class = sizeClass(mallocBlock->size);
+	unsigned int sub = sizeSubclass(mallocBlock->size, class);
 
-		if (mallocBlock != mallocBlock->next->prev) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "Found memory overwrite", "Error", ": in memory allocated at 0x%.12lx", (char*)mallocBlock + sizeof(VGC_mallocHeader));
-			dumpMmapBlock(0, 0, str, mmapBlock, "memory block overwrite");
-			return false;
+	if (mallocBlock->freePrev != 0) {
+		mallocBlock->freePrev->freeNext = mallocBlock->freeNext;
+	}
+	else {
+		mmapBlock->freeLists[class][sub] = mallocBlock->freeNext;
+		if (mmapBlock->freeLists[class][sub] == 0) {
+			mmapBlock->freeSublistsMap[class] &= ~(1 << sub);
+			if (mmapBlock->freeSublistsMap[class] == 0) mmapBlock->freeListsMap &= ~((uint64_t)1 << class);
 		}
 	}
+	if (mallocBlock->freeNext != 0) mallocBlock->freeNext->freePrev = mallocBlock->freePrev;
+	mallocBlock->freePrev = 0;
+	mallocBlock->freeNext = 0;
+}
 
-	size_t maxSize = shared->mmapBlockSize - sizeof(VGC_mmapHeader) - headersSize;
-	size_t totalSize = busySize + freeSize;
-
-	if (maxSize != totalSize) {
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "Found inconsistent MMAP", "Error", ": in MMAP allocated at 0x%.12lx", mmapBlock);
-		dumpMmapBlock(0, 0, str, mmapBlock, "MMAP block inconsistent");
-	}
 
-	return true;
+// freeListsClear
+//
+// The MMAP block has no FREE blocks in its lists
+//
+static void freeListsClear(VGC_mmapHeader *mmapBlock)
+{
+	mmapBlock->freeListsMap = 0;
+	memset(mmapBlock->freeSublistsMap, 0, sizeof(mmapBlock->freeSublistsMap));
+	memset(mmapBlock->freeLists, 0, sizeof(mmapBlock->freeLists));
 }
 
 
-// getMmapBlock
+// freeListFind
 //
 // Must be inside a mutex for the mmapBlock
+// Returns a FREE block of at least "length" bytes or 0 if there is none in the MMAP block
+// The request is rounded up to the next second level range, any block from there on fits: two bit scans and no walk.
+// Only the first block of the range of the request is checked too, as the other blocks there may be smaller
 //
-static bool isInMmapBlock(void *ptr)
+static VGC_mallocHeader *freeListFind(VGC_mmapHeader *mmapBlock, size_t length)
 {
-	for (register VGC_mmapHeader *mmapBlock = shared->mmapBlockFirst; mmapBlock != 0; mmapBlock = mmapBlock->next) {
-		if (ptr > (void*)mmapBlock && ptr < (void*)((char *)mmapBlock + shared->mmapBlockSize)) return true;
-	}
+	unsigned int class = sizeClass(length);
+	unsigned int sub = sizeSubclass(length, class);
 
-	return false;
+	VGC_mallocHeader *mallocBlock = mmapBlock->freeLists[class][sub];
+	if (mallocBlock != 0 && mallocBlock->size >= length) return mallocBlock;
+
+	// Next range: the following subclass, or the first one of the next class
+	//
+	if (++sub == VGC_MALLOC_FREE_SUBLISTS) {
+		sub = 0;
+		class++;
+	}
+	if (class >= VGC_MALLOC_FREE_LISTS) return 0;
+
+	unsigned int subMap = mmapBlock->freeSublistsMap[class] & (~0U << sub);
+	if (subMap == 0) {
+		uint64_t map = mmapBlock->freeListsMap & ~(((uint64_t)1 << (class + 1)) - 1);
+		if (map == 0) return 0;
+		class = __builtin_ctzll(map);
+		subMap = mmapBlock->freeSublistsMap[class];
+	}
+	return mmapBlock->freeLists[class][__builtin_ctz(subMap)];
 }
 
 
-// mallocCleanup
+// alignedGap
 //
-// Cleanup vgc_malloc variables
-// It is called at the end of the main process
+// Distance from "block" to the header of a block of "length" bytes whose memory is aligned to "alignment"
+// The space before the aligned header must be 0 or big enough to be a FREE block of its own
 //
-static void mallocCleanup(void)
+static inline size_t alignedGap(VGC_mallocHeader *block, size_t length, size_t alignment)
 {
-	if (shared == 0) return;
+	const size_t minFreeSize = sizeof(VGC_mallocHeader) + (shared->isMprotectEnabled ? shared->pageSize : VGC_MALLOC_ALIGNMENT);
+	uintptr_t memory = (uintptr_t)mallocBlockMemory(block, length);
 
-	if (shared->mmapBlockFirst != 0) {
-		vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mmapBlockFirst", "Block is not empty", 0, "memory leak%s list", shared->mmapBlockFirst->elements > 1 ? "s" : "");
-		dumpMmapBlock(0, 0, __func__, shared->mmapBlockFirst, "Block is not empty");
-	}
+	size_t gap = (alignment - memory % alignment) % alignment;
+	if (gap != 0 && gap < minFreeSize) gap += (minFreeSize - gap + alignment - 1) / alignment * alignment;
+	return gap;
+}
 
-	if (!PTHREAD_mutexattrDestroy(&shared->mutexAttr)) {
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexattrDestroy", "Error", "can't destroy shared mutexAttr", 0);
-	}
 
-	if (!PTHREAD_mutexDestroy(&shared->mutex)) {
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexDestroy", "Error", "can't destroy shared mutexAttr", 0);
+// freeListFindAligned
+//
+// Must be inside a mutex for the mmapBlock
+// Returns a FREE block where "length" bytes aligned to "alignment" fit after the gap before the aligned memory, 0 if none.
+// The blocks are checked one by one from the class of the request up, the gap depends on where each block is
+//
+static VGC_mallocHeader *freeListFindAligned(VGC_mmapHeader *mmapBlock, size_t length, size_t alignment)
+{
+	for (unsigned int class = sizeClass(length); class < VGC_MALLOC_FREE_LISTS; class++) {
+		if ((mmapBlock->freeListsMap & ((uint64_t)1 << class)) == 0) continue;
+		for (unsigned int sub = 0; sub < VGC_MALLOC_FREE_SUBLISTS; sub++) {
+			for (VGC_mallocHeader *mallocBlock = mmapBlock->freeLists[class][sub]; mallocBlock != 0; mallocBlock = mallocBlock->freeNext) {
+				if (mallocBlock->size >= length && alignedGap(mallocBlock, length, alignment) <= mallocBlock->size - length) return mallocBlock;
+			}
+		}
 	}
+	return 0;
+}
 
-#if defined(VGC_MALLOC_MPROTECT_MP)
-	if (shared->isMprotectEnabled) stopMprotect();
-#endif
 
-	if (munmap(shared, sizeof(VGC_shared)) == -1) {
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "munmap", "Error", "unmapping MMAP (shared)", ": %s", strerror(errno));
-	}
+// Engines
+//
+// The engine decides how the malloc blocks of the VGC_MMAP_BLOCKS are laid out: which FREE block a request
+// is taken from, how it is split and when the FREE blocks are unified.
+// All the engines keep the chain of headers in address order and the free lists, so the blocks are walked and checked
+// the same way whatever the engine (dumpMmapBlock, checkMmapBlock, the leak report and the scrubber), with the same stack traces.
+// The engine is chosen with the setting engine before the first allocation, e.g. VGC_MALLOC_CONF="engine:buddy".
+// With mprotect each block ends at a protected page and the engines rounding the sizes up would leave pages
+// between the memory and the protected page, the fit engine is always used
+//
+typedef struct VGC_mallocEngine {
+	bool               isAnySize;								// A FREE block can be cut at any length (batches, aligned requests)
+	size_t             (*length)(size_t length);						// Size of the block taken by a request of "length" bytes
+	size_t             (*capacity)(size_t size);						// Biggest block, header included, in "size" bytes of an empty MMAP
+	void               (*init)(VGC_mmapHeader *mmapBlock);					// Lays out the FREE blocks of a new MMAP
+	VGC_mallocHeader  *(*find)(VGC_mmapHeader *mmapBlock, size_t length, size_t alignment);	// FREE block for the request, or 0
+	VGC_mallocHeader  *(*alloc)(VGC_mmapHeader *mmapBlock, VGC_mallocHeader *mallocBlock, size_t length, size_t alignment);	// Block taken from the one found
+	void               (*free)(VGC_mmapHeader *mmapBlock, VGC_mallocHeader *mallocBlock);	// Gives back a block already marked FREE
+	bool               (*realloc)(VGC_mmapHeader *mmapBlock, VGC_mallocHeader *mallocBlock, size_t length);	// Resizes a BUSY block in place
+	const char        *(*check)(VGC_mmapHeader *mmapBlock, VGC_mallocHeader *mallocBlock);	// Error found in the block, or 0
+} VGC_mallocEngine;
+
+
+// freeListCheck
+//
+// Must be inside a mutex for the mmapBlock
+// A FREE block is linked in its free list
+//
+static const char *freeListCheck(VGC_mmapHeader *mmapBlock, VGC_mallocHeader *mallocBlock)
+{
+	if (mallocBlock->status != VGC_MALLOC_FREE) return 0;
+
+	unsigned int class = sizeClass(mallocBlock->size);
+	unsigned int sub = sizeSubclass(mallocBlock->size, class);
+	VGC_mallocHeader *prev = mallocBlock->freePrev;
+	VGC_mallocHeader *next = mallocBlock->freeNext;
+
+	if (prev == 0 ? mmapBlock->freeLists[class][sub] != mallocBlock : prev->freeNext != mallocBlock) return "FREE block not in its free list";
+	if (next != 0 && next->freePrev != mallocBlock) return "wrong next FREE block";
+	return 0;
 }
 
 
-// VGC_mmapHeader
+// fitLength
 //
-static VGC_mmapHeader *allocMMAP(size_t mmapBlockSize, VGC_mmapHeader *mmapLastBlock)
+static size_t fitLength(size_t length)
 {
-	VGC_mmapHeader *mmapBlock = mmap(0, mmapBlockSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-	if (mmapBlock == MAP_FAILED) {
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mmap", "Error", "no more memory available", ": %s", strerror(errno));
-		return MAP_FAILED;
-	}
-
-	// Initialise locking the MMAP block
-	//
-	if (!PTHREAD_mutexattrInit(&mmapBlock->mutexAttr)) {
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexattrInit", "Error", "mmapBlock mutex attr init failed", 0);
-		if (munmap(mmapBlock, mmapBlock->size) == -1) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "munmap", "Error", "unmapping MMAP", ": %s", strerror(errno));
-		}
-		return MAP_FAILED;
-	}
-	if (!PTHREAD_mutexInit(&mmapBlock->mutex, &mmapBlock->mutexAttr)) {
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexInit", "Error", "can't create mutex on mmapBlock", 0);
-		if (!PTHREAD_mutexattrDestroy(&mmapBlock->mutexAttr)) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexattrDestroy", "Error", "can't destroy mutex on mmapBlock", 0);
-		}
-		if (munmap(mmapBlock, mmapBlock->size) == -1) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "munmap", "Error", "unmapping MMAP", ": %s", strerror(errno));
-		}
-		return MAP_FAILED;
-	}
+	return length;
+}
 
-	if (!PTHREAD_mutexLock(&mmapBlock->mutex)) {
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on mmapBlock", 0);
-		if (munmap(mmapBlock, mmapBlock->size) == -1) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "munmap", "Error", "unmapping MMAP", ": %s", strerror(errno));
-		}
-		return MAP_FAILED;
-	}
 
-	// Initialise the MMAP
-	//
-	mmapBlock->size = mmapBlockSize;
-	mmapBlock->maxSize = mmapBlock->size - sizeof(VGC_mmapHeader) - sizeof(VGC_mallocHeader);
-	mmapBlock->prev = mmapLastBlock;
-	mmapBlock->next = 0;
-	if (mmapLastBlock != 0) mmapLastBlock->next = mmapBlock;
-	mmapBlock->elements = 0;
-	mmapBlock->checkStart = 0xAA;
-	mmapBlock->checkEnd = 0xAA;
+// fitCapacity
+//
+static size_t fitCapacity(size_t size)
+{
+	return size;
+}
 
-	vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, "vgc_malloc", "New MMAP at", "memory address", 0, "0x%lx (size: %dKB)", mmapBlock, mmapBlock->size / 1024);
 
-	// Allocate the first malloc element in the map
-	// The first element is a FREE block that takes all the available memory
-	//
-	VGC_mallocHeader *mallocBlock = (VGC_mallocHeader*)((char*)mmapBlock + sizeof(VGC_mmapHeader));
+// fitInit
+//
+// Must be inside a mutex for the mmapBlock
+// The first block is a FREE block that takes all the available memory
+//
+static void fitInit(VGC_mmapHeader *mmapBlock)
+{
+	VGC_mallocHeader *mallocBlock = firstMallocHeaderInMMAP(mmapBlock);
 	mallocBlock->size = mmapBlock->maxSize;
 	mallocBlock->status = VGC_MALLOC_FREE;
 	mallocBlock->mmapBlock = mmapBlock;
 	mallocBlock->prev = 0;
 	mallocBlock->next = 0;
+	mallocBlock->isZero = true;
 	mallocBlock->checkStart = 0xAA;
 	mallocBlock->checkEnd = 0xAA;
+	freeListInsert(mmapBlock, mallocBlock);
 	VGC_mprotect(mallocBlock);
-
-	if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
-		if (munmap(mmapBlock, mmapBlock->size) == -1) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "munmap", "Error", "unmapping MMAP", ": %s", strerror(errno));
-		}
-		return MAP_FAILED;
-	}
-
-	// Increment MMAP counter
-	//
-	shared->mmapBlockCount++;
-	return mmapBlock;
 }
 
 
-// allocMallocBlock
+// fitFind
+//
+// Must be inside a mutex for the mmapBlock
 //
-static void *allocMallocBlock(VGC_mmapHeader *mmapBlock, size_t length)
+static VGC_mallocHeader *fitFind(VGC_mmapHeader *mmapBlock, size_t length, size_t alignment)
 {
-	// Allocate "length" space
-	//
-	if (!PTHREAD_mutexLock(&mmapBlock->mutex)) {
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on mmapBlock", 0);
-		return 0;
-	}
-	VGC_mallocHeader *mallocBlock = 0;
-	for (mallocBlock = (VGC_mallocHeader*)((char*)mmapBlock + sizeof(VGC_mmapHeader)); mallocBlock != 0; mallocBlock = mallocBlock->next) {
-		if (mallocBlock->status == VGC_MALLOC_FREE && mallocBlock->size >= length) break;
-	}
-
-	if (mallocBlock == 0) {
-		// There is no space for the requested memory length in this MMAP block
-		//
-		if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
-		}
-		return 0;
-	}
+	return alignment == 0 ? freeListFind(mmapBlock, length) : freeListFindAligned(mmapBlock, length, alignment);
+}
 
-	if (!checkMmapBlock("vgc_malloc", mmapBlock)) {
-		// mmapBlock is corrupted
-		//
-		if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
-		}
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "checkMmapBlock", "Error", "The MMAP for vgc_malloc is unstable while allocating memory", 0);
-		return 0;
-	}
 
-	int lengthOrig = length;
-#if defined(VGC_MALLOC_MPROTECT) || defined(VGC_MALLOC_MPROTECT_PKEY)
-	if (shared->isMprotectEnabled) {
-		length = (length % shared->pageSize == 0) ? length : (length / shared->pageSize + 1) * shared->pageSize;
+// fitAlloc
+//
+// Must be inside a mutex for the mmapBlock
+// Takes "length" bytes from the FREE block found, the rest is a FREE block if there is room for a header and at least one byte more.
+// With "alignment" not 0 the space before the aligned memory stays FREE with the header of the block found,
+// the allocated block gets a new header just before the aligned memory
+//
+static VGC_mallocHeader *fitAlloc(VGC_mmapHeader *mmapBlock, VGC_mallocHeader *mallocBlock, size_t length, size_t alignment)
+{
+	freeListRemove(mmapBlock, mallocBlock);
+
+	size_t gap = alignment == 0 ? 0 : alignedGap(mallocBlock, length, alignment);
+	if (gap != 0) {
+		VGC_mallocHeader *aligned = (VGC_mallocHeader*)((char*)mallocBlock + gap);
+		aligned->size = mallocBlock->size - gap;
+		aligned->prev = mallocBlock;
+		aligned->next = mallocBlock->next;
+		aligned->isZero = mallocBlock->isZero;
+		if (aligned->next != 0) aligned->next->prev = aligned;
+		mallocBlock->size = gap - sizeof(VGC_mallocHeader);
+		mallocBlock->next = aligned;
+		freeListInsert(mmapBlock, mallocBlock);
+		mallocBlock = aligned;
+		VGC_mprotect(mallocBlock);
 	}
-#endif
 
 	// Next is the remaining free space
 	// Is there any free space remaining in the block?
@@ -419,8 +580,10 @@ static void *allocMallocBlock(VGC_mmapHeader *mmapBlock, size_t length)
 		next->status = VGC_MALLOC_FREE;
 		next->prev = mallocBlock;
 		next->next = mallocBlock->next;
+		next->isZero = mallocBlock->isZero;
 		next->checkStart = 0xAA;
 		next->checkEnd = 0xAA;
+		freeListInsert(mmapBlock, next);
 		VGC_mprotect(next);
 	}
 	else {
@@ -430,467 +593,3834 @@ static void *allocMallocBlock(VGC_mmapHeader *mmapBlock, size_t length)
 		length = mallocBlock->size;
 	}
 
-	// Allocate the required space and return it
-	//
-	mmapBlock->elements++;
 	mallocBlock->mmapBlock = mmapBlock;
 	mallocBlock->size = length;
-	mallocBlock->status = VGC_MALLOC_BUSY;
 	mallocBlock->next = next;
 	if (next && next->next) next->next->prev = next;
-	mallocBlock->checkStart = 0xAA;
-	mallocBlock->checkEnd = 0xAA;
+	return mallocBlock;
+}
 
-	void *memory = (char*)mallocBlock + sizeof(VGC_mallocHeader);
-	if (shared->isMprotectEnabled) {
-		memory += (unsigned int)shared->pageSize - lengthOrig % shared->pageSize;
-	}
 
-	vgc_stacktraceSave(mallocBlock);
-	if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
-	}
+// fitFree
+//
+// Must be inside a mutex for the mmapBlock
+// The block is unified with the FREE blocks before and after it
+//
+static void fitFree(VGC_mmapHeader *mmapBlock, VGC_mallocHeader *mallocBlock)
+{
+	freeBlocksNext(mallocBlock);
+	freeListInsert(mmapBlock, freeBlocksPrev(mallocBlock));
+}
 
-	vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, "vgc_malloc", "Malloc", "", "", "%d bytes at 0x%lx (#%u)", length, memory, mmapBlock->elements);
 
-	if (shared->isMprotectEnabled) {
-		vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, "vgc_malloc", "Protect", "", "", "protect:0x%lx - malloc:0x%lx-0x%lx (%s) - size:%d - pid:%u", mallocBlock, memory, (char*)memory + mallocBlock->size, mallocBlock->status == VGC_MALLOC_FREE ? "free" : "busy", mallocBlock->size, getpid());
+// fitRealloc
+//
+// Must be inside a mutex for the mmapBlock
+// When growing the following FREE block is absorbed, when shrinking the tail is given back as a FREE block
+//
+static bool fitRealloc(VGC_mmapHeader *mmapBlock, VGC_mallocHeader *mallocBlock, size_t length)
+{
+	VGC_mallocHeader *next = mallocBlock->next;
+	bool isNextFree = next != 0 && next->status == VGC_MALLOC_FREE;
+	size_t available = mallocBlock->size + (isNextFree ? sizeof(VGC_mallocHeader) + next->size : 0);
+
+	if (length > available) return false;
+
+	// Merge the following FREE block, then split again what is not needed
+	//
+	if (isNextFree && (length > mallocBlock->size || available - length > sizeof(VGC_mallocHeader))) {
+		freeListRemove(mmapBlock, next);
+		VGC_munprotect(next);
+		mallocBlock->size = available;
+		mallocBlock->next = next->next;
+		if (next->next != 0) next->next->prev = mallocBlock;
 	}
 
-	return memory;
+	if (mallocBlock->size - length > sizeof(VGC_mallocHeader)) {
+		newFreeBlock(mmapBlock, (char*)mallocBlock + sizeof(VGC_mallocHeader) + length, mallocBlock->size - length - sizeof(VGC_mallocHeader), mallocBlock, mallocBlock->next);
+		mallocBlock->size = length;
+	}
+	return true;
 }
 
 
-// initialiseMutex
+// mergeFreeBlocks
 //
-static bool initialiseMutex(void)
+// Must be inside a mutex for the mmapBlock
+// Unifies each run of FREE blocks of the MMAP in one block, the headers unified are in its memory so it is not zero
+//
+static void mergeFreeBlocks(VGC_mmapHeader *mmapBlock)
 {
-	if (!PTHREAD_mutexattrInit(&shared->mutexAttr)) {
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexattrInit", "Fatal error", "mutex attr init failed", 0);
-		return false;
-	}
-	if (!PTHREAD_mutexInit(&shared->mutex, &shared->mutexAttr)) {
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexInit", "Fatal error", "can't create shared mutex", 0);
-		if (!PTHREAD_mutexattrDestroy(&shared->mutexAttr)) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexattrDestroy", "Fatal error", "can't destroy shared attr mutex", 0);
+	for (VGC_mallocHeader *mallocBlock = firstMallocHeaderInMMAP(mmapBlock); mallocBlock != 0; mallocBlock = mallocBlock->next) {
+		if (mallocBlock->status != VGC_MALLOC_FREE || mallocBlock->next == 0 || mallocBlock->next->status != VGC_MALLOC_FREE) continue;
+
+		freeListRemove(mmapBlock, mallocBlock);
+		while (mallocBlock->next != 0 && mallocBlock->next->status == VGC_MALLOC_FREE) {
+			VGC_mallocHeader *next = mallocBlock->next;
+			freeListRemove(mmapBlock, next);
+			mallocBlock->size += next->size + sizeof(VGC_mallocHeader);
+			mallocBlock->isZero = false;
+			mallocBlock->next = next->next;
+			if (mallocBlock->next != 0) mallocBlock->next->prev = mallocBlock;
 		}
-		return false;
+		freeListInsert(mmapBlock, mallocBlock);
 	}
+	mmapBlock->unmerged = 0;
+}
 
-	return true;
+
+// classLength
+//
+// The request is rounded up to the start of the next second level range of the free lists (see sizeSubclass),
+// so the first block of its list always fits and a FREE block is reused as it is by the requests of its size class.
+// At most 1/8 of the request is lost
+//
+static size_t classLength(size_t length)
+{
+	unsigned int class = sizeClass(length);
+	if (class <= VGC_MALLOC_FREE_SUBLISTS_LOG2) return length;
+	return roundup(length, (size_t)1 << (class - VGC_MALLOC_FREE_SUBLISTS_LOG2));
 }
 
 
-// mmapBlockAllocate
+// classFind
+//
+// Must be inside a mutex for the mmapBlock
+// The FREE blocks are unified only when none of them fits the request and enough was freed since the last time,
+// walking the whole MMAP at each request that doesn't fit would cost more than mapping a new one
 //
-static VGC_mmapHeader *mmapBlockAllocate(size_t mmapBlockSize, VGC_mmapHeader *mmapLastBlock)
+static VGC_mallocHeader *classFind(VGC_mmapHeader *mmapBlock, size_t length, size_t alignment)
 {
-	// Allocate first MMAP block
-	//
-	VGC_mmapHeader *mmapBlock = allocMMAP(mmapBlockSize, mmapLastBlock);
-	if (mmapBlock == MAP_FAILED) {
-		// No more space available in the system
-		// Try allocating a smaller MMAP block of 1/10 of the original request
-		//
-		mmapBlock = allocMMAP(mmapBlockSize / 10, mmapLastBlock);
-		if (mmapBlock == MAP_FAILED) {
-			// Even the request for a smaller MMAP block failed,
-			// there is definitely no more space available for this process in the system
-			//
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "allocMMAP", "Error", "can't get enough memory for MMAP", ": %s", strerror(errno));
-		}
-	}
-	return mmapBlock;
+	VGC_mallocHeader *mallocBlock = fitFind(mmapBlock, length, alignment);
+	if (mallocBlock != 0 || mmapBlock->unmerged < VGC_MALLOC_MERGE_THRESHOLD) return mallocBlock;
+
+	mergeFreeBlocks(mmapBlock);
+	return fitFind(mmapBlock, length, alignment);
 }
 
 
-// createShared
+// classFree
 //
-static VGC_shared *createShared(void)
+// Must be inside a mutex for the mmapBlock
+// The block goes to its free list as it is, for the next request of its size class.
+// The FREE blocks are unified when the MMAP is empty and every VGC_MALLOC_PURGE_THRESHOLD bytes freed, before their pages are purged
+//
+static void classFree(VGC_mmapHeader *mmapBlock, VGC_mallocHeader *mallocBlock)
 {
-	VGC_shared *s = mmap(0, sizeof(VGC_shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-	if (s == 0) {
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mmap", "Fatal error", "can't create shared MMAP memory for VGC_shared", ": %s", strerror(errno));
-		return 0;
-	}
+	freeListInsert(mmapBlock, mallocBlock);
+	mmapBlock->unmerged += mallocBlock->size;
+	if (mmapBlock->elements == 0 || mmapBlock->unmerged >= VGC_MALLOC_PURGE_THRESHOLD) mergeFreeBlocks(mmapBlock);
+}
 
-	// Initialise page size, MMAP block size and MMAP block count
-	//
-	s->pageSize = sysconf(_SC_PAGE_SIZE);
-	s->mmapBlockCount = 0;
-	s->mmapBlockFirst = 0;
-	s->mmapBlockSize = VGC_MALLOC_MMAP_PAGES * s->pageSize;
 
-#if defined(VGC_MALLOC_MPROTECT) || defined(VGC_MALLOC_MPROTECT_PKEY)
-	s->isMprotectEnabled = true;
-#  if defined(VGC_MALLOC_MPROTECT_MP)
-	s->maxProcesses = 0;
-	s->children = 0;
-#  endif
-#else
-	s->isMprotectEnabled = false;
-#endif
-	return s;
+// Buddy blocks
+//
+// A block takes a power of two bytes, header included, at an offset from the first header of the MMAP
+// that is a multiple of its size: its order is the log2 of its size. A FREE block is unified only with its buddy,
+// the other half of the block of the next order it was split from.
+// The memory of an MMAP is not a power of two: it starts cut in blocks of decreasing orders, the last one
+// keeps the bytes too few for a block of their own. It never has a buddy after it and its order is the floor of its log2
+//
+
+// buddyOrder
+//
+static inline unsigned int buddyOrder(VGC_mallocHeader *mallocBlock)
+{
+	return sizeClass(mallocBlock->size + sizeof(VGC_mallocHeader));
 }
 
 
-// initializeShared
+// buddyLength
 //
-static bool initializeShared(void)
+static size_t buddyLength(size_t length)
 {
-	shared = createShared();
-	if (!shared) return false;
-	if (!initialiseMutex()) return false;
+	return ((size_t)1 << (sizeClass(length + sizeof(VGC_mallocHeader) - 1) + 1)) - sizeof(VGC_mallocHeader);
+}
 
-#if defined(VGC_MALLOC_MPROTECT_MP) && (defined(VGC_MALLOC_MPROTECT) || defined(VGC_MALLOC_MPROTECT_PKEY))
-	if (shared->isMprotectEnabled) startMprotect(10);
-#endif
-	return true;
+
+// buddyCapacity
+//
+static size_t buddyCapacity(size_t size)
+{
+	return (size_t)1 << sizeClass(size);
 }
 
 
+// buddyInit
+//
+// Must be inside a mutex for the mmapBlock
+//
+static void buddyInit(VGC_mmapHeader *mmapBlock)
+{
+	const size_t minSize = buddyLength(VGC_MALLOC_ALIGNMENT) + sizeof(VGC_mallocHeader);
+	const size_t size = mmapBlock->maxSize + sizeof(VGC_mallocHeader);
+	char *first = (char*)firstMallocHeaderInMMAP(mmapBlock);
+
+	VGC_mallocHeader *prev = 0;
+	for (size_t offset = 0; offset < size; ) {
+		size_t blockSize = buddyCapacity(size - offset);
+		if (size - offset - blockSize < minSize) blockSize = size - offset;
+
+		VGC_mallocHeader *mallocBlock = (VGC_mallocHeader*)(first + offset);
+		mallocBlock->size = blockSize - sizeof(VGC_mallocHeader);
+		mallocBlock->status = VGC_MALLOC_FREE;
+		mallocBlock->mmapBlock = mmapBlock;
+		mallocBlock->prev = prev;
+		mallocBlock->next = 0;
+		mallocBlock->isZero = true;
+		mallocBlock->checkStart = 0xAA;
+		mallocBlock->checkEnd = 0xAA;
+		if (prev != 0) prev->next = mallocBlock;
+		freeListInsert(mmapBlock, mallocBlock);
+
+		prev = mallocBlock;
+		offset += blockSize;
+	}
+}
 
-// vgc_malloc
+
+// buddyFind
 //
-// The vgc_malloc() function allocates size bytes and returns a pointer to the allocated memory.
-// The memory is not initialized.
-// If size is 0, then vgc_malloc() returns NULL.
+// Must be inside a mutex for the mmapBlock
+// The blocks are aligned to their size up to a page, the length of an aligned request is already big enough (see mallocPath)
+//
+static VGC_mallocHeader *buddyFind(VGC_mmapHeader *mmapBlock, size_t length, ATTR_UNUSED size_t alignment)
+{
+	return freeListFind(mmapBlock, length);
+}
+
+
+// buddySplit
+//
+// Must be inside a mutex for the mmapBlock
+// Halves the block down to "order", the upper halves become FREE blocks
+//
+static void buddySplit(VGC_mmapHeader *mmapBlock, VGC_mallocHeader *mallocBlock, unsigned int order)
+{
+	for (unsigned int blockOrder = buddyOrder(mallocBlock); blockOrder > order; blockOrder--) {
+		size_t half = (size_t)1 << (blockOrder - 1);
+
+		VGC_mallocHeader *upper = (VGC_mallocHeader*)((char*)mallocBlock + half);
+		upper->mmapBlock = mmapBlock;
+		upper->size = mallocBlock->size - half;
+		upper->status = VGC_MALLOC_FREE;
+		upper->prev = mallocBlock;
+		upper->next = mallocBlock->next;
+		upper->isZero = mallocBlock->isZero;
+		upper->checkStart = 0xAA;
+		upper->checkEnd = 0xAA;
+		if (upper->next != 0) upper->next->prev = upper;
+		freeListInsert(mmapBlock, upper);
+
+		mallocBlock->size = half - sizeof(VGC_mallocHeader);
+		mallocBlock->next = upper;
+	}
+}
+
+
+// buddyAlloc
+//
+// Must be inside a mutex for the mmapBlock
+//
+static VGC_mallocHeader *buddyAlloc(VGC_mmapHeader *mmapBlock, VGC_mallocHeader *mallocBlock, size_t length, ATTR_UNUSED size_t alignment)
+{
+	freeListRemove(mmapBlock, mallocBlock);
+	buddySplit(mmapBlock, mallocBlock, sizeClass(length + sizeof(VGC_mallocHeader)));
+	return mallocBlock;
+}
+
+
+// buddyFree
+//
+// Must be inside a mutex for the mmapBlock
+// The block is unified with its buddy as long as the buddy is FREE and whole, the header of the upper one makes it not zero
+//
+static void buddyFree(VGC_mmapHeader *mmapBlock, VGC_mallocHeader *mallocBlock)
+{
+	char *first = (char*)firstMallocHeaderInMMAP(mmapBlock);
+
+	for (;;) {
+		unsigned int order = buddyOrder(mallocBlock);
+		bool isLower = (((char*)mallocBlock - first) & ((size_t)1 << order)) == 0;
+		VGC_mallocHeader *buddy = isLower ? mallocBlock->next : mallocBlock->prev;
+		if (buddy == 0 || buddy->status != VGC_MALLOC_FREE || buddyOrder(buddy) != order) break;
+
+		freeListRemove(mmapBlock, buddy);
+		VGC_mallocHeader *lower = isLower ? mallocBlock : buddy;
+		VGC_mallocHeader *upper = isLower ? buddy : mallocBlock;
+		lower->size += upper->size + sizeof(VGC_mallocHeader);
+		lower->isZero = false;
+		lower->next = upper->next;
+		if (lower->next != 0) lower->next->prev = lower;
+		mallocBlock = lower;
+	}
+	freeListInsert(mmapBlock, mallocBlock);
+}
+
+
+// buddyRealloc
+//
+// Must be inside a mutex for the mmapBlock
+// Shrinking gives back the upper halves, growing takes the buddies of each order up to the one of "length"
+// and only if they are all FREE and whole
+//
+static bool buddyRealloc(VGC_mmapHeader *mmapBlock, VGC_mallocHeader *mallocBlock, size_t length)
+{
+	unsigned int order = sizeClass(length + sizeof(VGC_mallocHeader));
+	unsigned int blockOrder = buddyOrder(mallocBlock);
+
+	if (order <= blockOrder) {
+		mallocBlock->isZero = false;
+		buddySplit(mmapBlock, mallocBlock, order);
+		return true;
+	}
+
+	size_t offset = (char*)mallocBlock - (char*)firstMallocHeaderInMMAP(mmapBlock);
+	VGC_mallocHeader *buddy = mallocBlock->next;
+	for (unsigned int o = blockOrder; o < order; o++, buddy = buddy->next) {
+		if ((offset & ((size_t)1 << o)) != 0 || buddy == 0 || buddy->status != VGC_MALLOC_FREE || buddyOrder(buddy) != o) return false;
+	}
+
+	for (unsigned int o = blockOrder; o < order; o++) {
+		buddy = mallocBlock->next;
+		freeListRemove(mmapBlock, buddy);
+		mallocBlock->size += buddy->size + sizeof(VGC_mallocHeader);
+		mallocBlock->next = buddy->next;
+		if (mallocBlock->next != 0) mallocBlock->next->prev = mallocBlock;
+	}
+	return true;
+}
+
+
+// buddyCheck
+//
+// Must be inside a mutex for the mmapBlock
+//
+static const char *buddyCheck(VGC_mmapHeader *mmapBlock, VGC_mallocHeader *mallocBlock)
+{
+	const char *error = freeListCheck(mmapBlock, mallocBlock);
+	if (error != 0) return error;
+
+	size_t offset = (char*)mallocBlock - (char*)firstMallocHeaderInMMAP(mmapBlock);
+	if ((offset & (((size_t)1 << buddyOrder(mallocBlock)) - 1)) != 0) return "buddy block not aligned to its size";
+	return 0;
+}
+
+
+static const VGC_mallocEngine mallocEngines[VGC_MALLOC_ENGINE_ALL] = {
+	[VGC_MALLOC_ENGINE_FIT]   = { true,  fitLength,   fitCapacity,   fitInit,   fitFind,   fitAlloc,   fitFree,   fitRealloc,   freeListCheck  },
+	[VGC_MALLOC_ENGINE_CLASS] = { true,  classLength, fitCapacity,   fitInit,   classFind, fitAlloc,   classFree, fitRealloc,   freeListCheck  },
+	[VGC_MALLOC_ENGINE_BUDDY] = { false, buddyLength, buddyCapacity, buddyInit, buddyFind, buddyAlloc, buddyFree, buddyRealloc, buddyCheck     }
+};
+
+
+// mallocEngine
+//
+static inline const VGC_mallocEngine *mallocEngine(void)
+{
+	return &mallocEngines[shared->isMprotectEnabled ? VGC_MALLOC_ENGINE_FIT : shared->engine];
+}
+
+
+// dumpMmapBlock
+//
+// Must be inside a mutex for the mmapBlock
+//
+static void dumpMmapBlock(char *response, size_t size, const char *str, VGC_mmapHeader *mmapBlock, const char *desc)
+{
+	if (mmapBlock == 0 || str == 0 || desc == 0) return;
+
+	const char *dashes =  "---------------------------------------------------------------------";
+
+	if (response != 0) {
+		snprintf(&response[strlen(response)], mmapBlock->maxSize, "\nMMAP at 0x%.12lx\n", (long unsigned int)mmapBlock);
+		snprintf(&response[strlen(response)], mmapBlock->maxSize, " ID memory         prev           next           status    size\n");
+		snprintf(&response[strlen(response)], mmapBlock->maxSize, "%s\n",dashes);
+	}
+	else {
+		vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, desc, 0, "MMAP at 0x%.12lx", mmapBlock);
+		vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, " ID memory         prev           next           status    size", "", 0);
+		vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, dashes, "", 0);
+	}
+
+	int i = 0;
+	size_t busySize = 0;
+	size_t freeSize = 0;
+	size_t headersSize = 0;
+
+	for (VGC_mallocHeader *mallocBlock = firstMallocHeaderInMMAP(mmapBlock); mallocBlock != 0; mallocBlock = mallocBlock->next) {
+		headersSize += sizeof(VGC_mallocHeader);
+		if (mallocBlock->status == VGC_MALLOC_FREE) {
+			freeSize += mallocBlock->size;
+		}
+		else {
+			busySize += mallocBlock->size;
+		}
+
+		if (response != 0) {
+			char buffer[200];
+			snprintf(buffer, 200, "%s%3d%s 0x%.12lx%s 0x%.12lx 0x%.12lx %s%s%s %9d bytes\n",
+					c_blue, i++, c_black,
+					(long unsigned int)((char*)mallocBlock + sizeof(VGC_mallocHeader)), c_red,
+					mallocBlock->prev == 0 ? 0 : (long unsigned int)((char*)mallocBlock->prev + sizeof(VGC_mallocHeader)),
+					mallocBlock->next == 0 ? 0 : (long unsigned int)((char*)mallocBlock->next + sizeof(VGC_mallocHeader)),
+					mallocBlock->status == VGC_MALLOC_FREE ? c_green : c_blue, mallocStatusName(mallocBlock->status), c_black,
+					(int)mallocBlock->size);
+			int length = strlen(response);
+			if (length + strlen(buffer) >= size) return;
+			strcat(&response[length], buffer);
+		}
+		else {
+			vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "", "", "%s%3d%s 0x%.12lx%s 0x%.12lx 0x%.12lx %s%s%s %9d bytes",
+					c_blue, i++, c_black,
+					(char*)mallocBlock + sizeof(VGC_mallocHeader), c_red,
+					mallocBlock->prev == 0 ? 0 : (char*)mallocBlock->prev + sizeof(VGC_mallocHeader),
+					mallocBlock->next == 0 ? 0 : (char*)mallocBlock->next + sizeof(VGC_mallocHeader),
+					mallocBlock->status == VGC_MALLOC_FREE ? c_green : c_blue, mallocStatusName(mallocBlock->status), c_black,
+					mallocBlock->size);
+		}
+
+		if (mallocBlock->status == VGC_MALLOC_BUSY) {
+			vgc_stacktraceShow(mallocBlock);
+		}
+	}
+
+	size_t maxSize = mmapBlock->maxSize + sizeof(VGC_mallocHeader) - headersSize;
+	size_t totalSize = busySize + freeSize;
+
+	if (response != 0) {
+		char buffer[100];
+
+		snprintf(buffer, 100, "%s\n", dashes);
+		int length = strlen(response);
+		if (length + strlen(buffer) >= size) return;
+		strcat(&response[length], buffer);
+
+		snprintf(buffer, 100, "%ssize allocated.: %s%9d bytes\n", c_black, c_blue, (int)mmapBlock->size);
+		length = strlen(response);
+		if (length + strlen(buffer) >= size) return;
+		strcat(&response[length], buffer);
+
+		snprintf(buffer, 100, "%ssize busy......: %s%9d bytes\n", c_black, c_blue, (int)busySize);
+		length = strlen(response);
+		if (length + strlen(buffer) >= size) return;
+		strcat(&response[length], buffer);
+
+		snprintf(buffer, 100, "%ssize free......: %s%9d bytes\n", c_black, c_blue, (int)freeSize);
+		length = strlen(response);
+		if (length + strlen(buffer) >= size) return;
+		strcat(&response[length], buffer);
+
+		snprintf(buffer, 100, "%ssize total.....: %s%9d bytes *\n", c_black, c_green, (int)totalSize);
+		length = strlen(response);
+		if (length + strlen(buffer) >= size) return;
+		strcat(&response[length], buffer);
+
+		snprintf(buffer, 100, "%ssize max.......: %s%9d bytes *\n", c_black, c_green, (int)maxSize);
+		length = strlen(response);
+		if (length + strlen(buffer) >= size) return;
+		strcat(&response[length], buffer);
+
+		snprintf(buffer, 100, "%spages.........: %s%s\n", c_black, c_blue, mmapPagesName(mmapBlock->pages));
+		length = strlen(response);
+		if (length + strlen(buffer) >= size) return;
+		strcat(&response[length], buffer);
+
+		snprintf(buffer, 100, "%s%s\n", c_black, dashes);
+		length = strlen(response);
+		if (length + strlen(buffer) >= size) return;
+		strcat(&response[length], buffer);
+	}
+	else {
+		vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, dashes, "", 0);
+		vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "", "", "size allocated.: %s%9d bytes", c_blue, mmapBlock->size);
+		vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "", "", "size busy......: %s%9d bytes", c_blue, busySize);
+		vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "", "", "size free......: %s%9d bytes", c_blue, freeSize);
+		vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "", "", "size total.....: %s%9d bytes *", c_green, totalSize);
+		vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "", "", "size max.......: %s%9d bytes *", c_green, maxSize);
+		vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "", "", "pages.........: %s%s", c_blue, mmapPagesName(mmapBlock->pages));
+		vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, dashes, "", 0);
+	}
+}
+
+
+// checkMmapBlock
+//
+// Must be inside a mutex for the mmapBlock
+//
+static bool checkMmapBlock(const char *str, VGC_mmapHeader *mmapBlock)
+{
+	size_t busySize = 0;
+	size_t freeSize = 0;
+	size_t headersSize = 0;
+
+	for (register VGC_mallocHeader *mallocBlock = firstMallocHeaderInMMAP(mmapBlock); mallocBlock != 0; mallocBlock = mallocBlock->next) {
+		headersSize += sizeof(VGC_mallocHeader);
+		if (mallocBlock->status == VGC_MALLOC_FREE) {
+			freeSize += mallocBlock->size;
+		}
+		else {
+			busySize += mallocBlock->size;
+		}
+
+		if (mallocBlock->size > mmapBlock->maxSize) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "Found too big memory block", "Error", ": in memory allocated at 0x%.12lx", (char*)mallocBlock + sizeof(VGC_mallocHeader));
+			dumpMmapBlock(0, 0, str, mmapBlock, "memory block wrong size");
+			return false;
+		}
+
+		if (mallocBlock < (VGC_mallocHeader *)mmapBlock || mallocBlock > (VGC_mallocHeader *)((char *)mmapBlock + mmapBlock->size)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "Found wrong memory pointer", "Error", ": in memory allocated at 0x%.12lx points outside the MMAP", (char*)mallocBlock + sizeof(VGC_mallocHeader));
+			dumpMmapBlock(0, 0, str, mmapBlock, "memory block wrong pointer");
+			return false;
+		}
+
+		const char *error = mallocEngine()->check(mmapBlock, mallocBlock);
+		if (error != 0) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "Found memory overwrite", "Error", ": %s in memory allocated at 0x%.12lx", error, (char*)mallocBlock + sizeof(VGC_mallocHeader));
+			dumpMmapBlock(0, 0, str, mmapBlock, "memory block overwrite");
+			return false;
+		}
+
+		if (mallocBlock->next == 0) {
+			break;
+		}
+
+		if (mallocBlock != mallocBlock->next->prev) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "Found memory overwrite", "Error", ": in memory allocated at 0x%.12lx", (char*)mallocBlock + sizeof(VGC_mallocHeader));
+			dumpMmapBlock(0, 0, str, mmapBlock, "memory block overwrite");
+			return false;
+		}
+	}
+
+	size_t maxSize = mmapBlock->maxSize + sizeof(VGC_mallocHeader) - headersSize;
+	size_t totalSize = busySize + freeSize;
+
+	if (maxSize != totalSize) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "Found inconsistent MMAP", "Error", ": in MMAP allocated at 0x%.12lx", mmapBlock);
+		dumpMmapBlock(0, 0, str, mmapBlock, "MMAP block inconsistent");
+	}
+
+	return true;
+}
+
+
+// checkMallocHeader
+//
+// The header is inside the MMAP, its markers are right and it belongs to the MMAP
+//
+static inline bool checkMallocHeader(VGC_mmapHeader *mmapBlock, VGC_mallocHeader *mallocBlock)
+{
+	if (mallocBlock < firstMallocHeaderInMMAP(mmapBlock) || (char*)mallocBlock + sizeof(VGC_mallocHeader) > (char*)mmapBlock + mmapBlock->size) return false;
+	return mallocBlock->checkStart == 0xAA && mallocBlock->checkEnd == 0xAA && mallocBlock->mmapBlock == mmapBlock && mallocBlock->size <= mmapBlock->maxSize;
+}
+
+
+// checkMallocBlock
+//
+// Must be inside a mutex for the mmapBlock
+// Checks the block and the links with the blocks before and after it, the memory of a block ends where the next one starts.
+// Every shared->checkInterval calls the whole MMAP is checked with checkMmapBlock(), so that the
+// corruptions far from the blocks in use are found too, without walking the MMAP at each operation
+//
+static bool checkMallocBlock(const char *str, VGC_mmapHeader *mmapBlock, VGC_mallocHeader *mallocBlock)
+{
+	if (shared->checkInterval != 0 && ++mmapBlock->checks >= shared->checkInterval) {
+		mmapBlock->checks = 0;
+		if (!checkMmapBlock(str, mmapBlock)) return false;
+	}
+
+	VGC_mallocHeader *prev = mallocBlock->prev;
+	VGC_mallocHeader *next = mallocBlock->next;
+	const char *error = 0;
+
+	if (!checkMallocHeader(mmapBlock, mallocBlock)) {
+		error = "wrong block header";
+	}
+	else if (prev == 0 ? mallocBlock != firstMallocHeaderInMMAP(mmapBlock) : !checkMallocHeader(mmapBlock, prev) || prev->next != mallocBlock) {
+		error = "wrong previous block";
+	}
+	else if (prev != 0 && (char*)prev + sizeof(VGC_mallocHeader) + prev->size != (char*)mallocBlock) {
+		error = "wrong size of the previous block";
+	}
+	else if (next != 0 && (!checkMallocHeader(mmapBlock, next) || next->prev != mallocBlock)) {
+		error = "wrong next block";
+	}
+	else if (next != 0 && (char*)mallocBlock + sizeof(VGC_mallocHeader) + mallocBlock->size != (char*)next) {
+		error = "wrong size of the block";
+	}
+	else {
+		error = mallocEngine()->check(mmapBlock, mallocBlock);
+	}
+
+	if (error == 0) return true;
+
+	vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "Found memory overwrite", "Error", ": %s in memory allocated at 0x%.12lx", error, (char*)mallocBlock + sizeof(VGC_mallocHeader));
+	dumpMmapBlock(0, 0, str, mmapBlock, "memory block overwrite");
+	return false;
+}
+
+
+// mallocCleanup
+//
+// Cleanup vgc_malloc variables
+// It is called at the end of the main process
+//
+static void mallocCleanup(void)
+{
+	if (shared == 0) return;
+
+	shared->isScrubberEnabled = false;
+	vgc_mallocScrubberUpdate();
+
+	// Blocks kept in the thread caches and in the remote frees are not leaks, give them back before the report
+	//
+	threadCacheFlushAll();
+	for (unsigned int i = 0; i < shared->arenaCount; i++) remoteFreeDrain(&shared->arenas[i]);
+
+	// The lean path doesn't track the blocks, there is no leak report
+	//
+	const bool isLeakReport = shared->path != VGC_MALLOC_PATH_LEAN;
+
+	for (VGC_mmapHeader *mmapBlock = shared->largeFirst; isLeakReport && mmapBlock != 0; mmapBlock = mmapBlock->next) {
+		vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, "largeFirst", "Block is not empty", 0, "memory leak (large block)");
+		dumpMmapBlock(0, 0, __func__, mmapBlock, "Block is not empty");
+	}
+
+	for (unsigned int i = 0; i < shared->arenaCount; i++) {
+		VGC_arena *arena = &shared->arenas[i];
+		for (VGC_mmapHeader *mmapBlock = arena->mmapBlockFirst; isLeakReport && mmapBlock != 0; mmapBlock = mmapBlock->next) {
+			if (mmapBlock->elements == 0) continue;	// Empty MMAP kept by arenaDecay()
+			vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mmapBlockFirst", "Block is not empty", 0, "memory leak%s list (arena %u)", mmapBlock->elements > 1 ? "s" : "", arena->id);
+			dumpMmapBlock(0, 0, __func__, mmapBlock, "Block is not empty");
+		}
+		for (VGC_mmapHeader *slab = arena->slabFirst; isLeakReport && slab != 0; slab = slab->next) {
+			if (slab->elements == 0) continue;
+			vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, "slabFirst", "Slab is not empty", 0, "memory leak%s slab (arena %u)", slab->elements > 1 ? "s" : "", arena->id);
+			dumpSlab(__func__, slab, "Slab is not empty");
+		}
+
+		if (!PTHREAD_mutexattrDestroy(&arena->mutexAttr)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexattrDestroy", "Error", "can't destroy arena mutexAttr", 0);
+		}
+		if (!PTHREAD_mutexDestroy(&arena->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexDestroy", "Error", "can't destroy arena mutex", 0);
+		}
+	}
+
+	if (!PTHREAD_mutexattrDestroy(&shared->mutexAttr)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexattrDestroy", "Error", "can't destroy shared mutexAttr", 0);
+	}
+
+	if (!PTHREAD_mutexDestroy(&shared->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexDestroy", "Error", "can't destroy shared mutexAttr", 0);
+	}
+
+#if defined(VGC_MALLOC_MPROTECT_MP)
+	if (shared->isMprotectEnabled) stopMprotect();
+#endif
+
+	if (munmap(shared, sizeof(VGC_shared)) == -1) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "munmap", "Error", "unmapping MMAP (shared)", ": %s", strerror(errno));
+	}
+	shared = 0;
+}
+
+
+// mmapSharing
+//
+// MAP_SHARED or MAP_PRIVATE for the memory of the blocks, see VGC_MALLOC_SHARED
+//
+static inline int mmapSharing(void)
+{
+	return shared->isShared ? MAP_SHARED : MAP_PRIVATE;
+}
+
+
+// mapMMAP
+//
+// Maps the memory for a VGC_MMAP_BLOCKS block
+// With huge pages enabled it uses the huge pages reserved in the system if there are enough,
+// otherwise the block is aligned to a huge page and marked with MADV_HUGEPAGE so that the kernel can back it with transparent huge pages.
+// Sizes that are not a multiple of the huge page use the system pages.
+//
+static void *mapMMAP(size_t mmapBlockSize, VGC_mmapPages *pages)
+{
+	*pages = VGC_MMAP_PAGES_SYSTEM;
+	if (shared->hugePageSize == 0 || mmapBlockSize % shared->hugePageSize != 0) {
+		return mmap(0, mmapBlockSize, PROT_READ | PROT_WRITE, mmapSharing() | MAP_ANONYMOUS, -1, 0);
+	}
+
+#ifdef MAP_HUGETLB
+	void *memory = mmap(0, mmapBlockSize, PROT_READ | PROT_WRITE, mmapSharing() | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (memory != MAP_FAILED) {
+		*pages = VGC_MMAP_PAGES_HUGETLB;
+		return memory;
+	}
+#endif
+
+	// Map one huge page more and unmap the parts before and after the aligned block
+	//
+	char *start = mmap(0, mmapBlockSize + shared->hugePageSize, PROT_READ | PROT_WRITE, mmapSharing() | MAP_ANONYMOUS, -1, 0);
+	if (start == MAP_FAILED) return MAP_FAILED;
+
+	char *aligned = (char*)(((uintptr_t)start + shared->hugePageSize - 1) & ~(shared->hugePageSize - 1));
+	if (aligned > start && munmap(start, aligned - start) == -1) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "munmap", "Error", "unmapping MMAP head", ": %s", strerror(errno));
+	}
+	if (aligned < start + shared->hugePageSize && munmap(aligned + mmapBlockSize, start + shared->hugePageSize - aligned) == -1) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "munmap", "Error", "unmapping MMAP tail", ": %s", strerror(errno));
+	}
+
+	if (madvise(aligned, mmapBlockSize, MADV_HUGEPAGE) == 0) *pages = VGC_MMAP_PAGES_THP;
+	return aligned;
+}
+
+
+// VGC_mmapHeader
+//
+// Must be inside a mutex for the arena
+//
+static VGC_mmapHeader *allocMMAP(VGC_arena *arena, size_t mmapBlockSize, VGC_mmapHeader *mmapLastBlock)
+{
+	VGC_mmapPages pages;
+	VGC_mmapHeader *mmapBlock = mapMMAP(mmapBlockSize, &pages);
+	if (mmapBlock == MAP_FAILED) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mmap", "Error", "no more memory available", ": %s", strerror(errno));
+		return MAP_FAILED;
+	}
+
+	// Initialise locking the MMAP block
+	//
+	if (!PTHREAD_mutexattrInit(&mmapBlock->mutexAttr)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexattrInit", "Error", "mmapBlock mutex attr init failed", 0);
+		if (munmap(mmapBlock, mmapBlock->size) == -1) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "munmap", "Error", "unmapping MMAP", ": %s", strerror(errno));
+		}
+		return MAP_FAILED;
+	}
+	if (!PTHREAD_mutexInit(&mmapBlock->mutex, &mmapBlock->mutexAttr)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexInit", "Error", "can't create mutex on mmapBlock", 0);
+		if (!PTHREAD_mutexattrDestroy(&mmapBlock->mutexAttr)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexattrDestroy", "Error", "can't destroy mutex on mmapBlock", 0);
+		}
+		if (munmap(mmapBlock, mmapBlock->size) == -1) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "munmap", "Error", "unmapping MMAP", ": %s", strerror(errno));
+		}
+		return MAP_FAILED;
+	}
+
+	if (!PTHREAD_mutexLock(&mmapBlock->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on mmapBlock", 0);
+		if (munmap(mmapBlock, mmapBlock->size) == -1) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "munmap", "Error", "unmapping MMAP", ": %s", strerror(errno));
+		}
+		return MAP_FAILED;
+	}
+
+	// Initialise the MMAP
+	//
+	mmapBlock->type = VGC_MMAP_BLOCKS;
+	mmapBlock->pages = pages;
+	mmapBlock->size = mmapBlockSize;
+	mmapBlock->maxSize = mmapBlock->size - VGC_MALLOC_MMAP_FIRST - sizeof(VGC_mallocHeader);
+	mmapBlock->prev = 0;
+	mmapBlock->next = 0;
+	mmapBlock->arena = arena;
+	mmapBlock->emptySince = 0;
+	mmapBlock->isPurged = false;
+	mmapBlock->dirty = 0;
+	mmapBlock->checks = 0;
+	mmapBlock->unmerged = 0;
+	mmapBlock->elements = 0;
+	freeListsClear(mmapBlock);
+	mmapBlock->checkStart = 0xAA;
+	mmapBlock->checkEnd = 0xAA;
+
+	vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, "vgc_malloc", "New MMAP at", "memory address", 0, "0x%lx (size: %dKB, arena %u, %s pages)", mmapBlock, mmapBlock->size / 1024, arena->id, mmapPagesName(mmapBlock->pages));
+
+	// The FREE blocks of the available memory, as laid out by the engine
+	//
+	mallocEngine()->init(mmapBlock);
+
+	if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
+		if (munmap(mmapBlock, mmapBlock->size) == -1) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "munmap", "Error", "unmapping MMAP", ": %s", strerror(errno));
+		}
+		return MAP_FAILED;
+	}
+
+	// Make the MMAP known to vgc_free() before linking it in the arena
+	//
+	if (!vgc_pagemapSet(mmapBlock, mmapBlock->size, mmapBlock)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "vgc_pagemapSet", "Error", "can't add MMAP to the page map", 0);
+		if (munmap(mmapBlock, mmapBlock->size) == -1) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "munmap", "Error", "unmapping MMAP", ": %s", strerror(errno));
+		}
+		return MAP_FAILED;
+	}
+	mmapBlock->prev = mmapLastBlock;
+	if (mmapLastBlock != 0) mmapLastBlock->next = mmapBlock;
+	else arena->mmapBlockFirst = mmapBlock;
+
+	// Increment MMAP counters
+	//
+	arena->mmapBlockCount++;
+	__atomic_add_fetch(&shared->mmapBlockCount, 1, __ATOMIC_RELAXED);
+	return mmapBlock;
+}
+
+
+// allocMallocBlock
+//
+// With "alignment" not 0 the memory is aligned to it, the space before the aligned block is left as a FREE block (see fitAlloc)
+//
+static ATTR_ALWAYS_INLINE inline void *allocMallocBlock(VGC_mmapHeader *mmapBlock, size_t length, size_t alignment, const VGC_mallocPath path)
+{
+	int lengthOrig = length;
+#if defined(VGC_MALLOC_MPROTECT) || defined(VGC_MALLOC_MPROTECT_PKEY)
+	if (shared->isMprotectEnabled) {
+		length = (length % shared->pageSize == 0) ? length : (length / shared->pageSize + 1) * shared->pageSize;
+	}
+#endif
+
+	// Allocate "length" space
+	//
+	if (!PTHREAD_mutexLock(&mmapBlock->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on mmapBlock", 0);
+		return 0;
+	}
+	const VGC_mallocEngine *engine = mallocEngine();
+	VGC_mallocHeader *mallocBlock = engine->find(mmapBlock, length, alignment);
+	if (mallocBlock == 0) {
+		// There is no space for the requested memory length in this MMAP block
+		//
+		if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
+		}
+		return 0;
+	}
+
+	if (isPathDebug(path) && !checkMallocBlock("vgc_malloc", mmapBlock, mallocBlock)) {
+		// mmapBlock is corrupted
+		//
+		if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
+		}
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "checkMallocBlock", "Error", "The MMAP for vgc_malloc is unstable while allocating memory", 0);
+		return 0;
+	}
+
+	mallocBlock = engine->alloc(mmapBlock, mallocBlock, length, alignment);
+
+	// An empty MMAP kept by arenaDecay() is in use again
+	//
+	if (mmapBlock->emptySince != 0) {
+		mmapBlock->emptySince = 0;
+		mmapBlock->isPurged = false;
+		mmapBlock->arena->emptyCount--;
+	}
+
+	// Allocate the required space and return it
+	//
+	mmapBlock->elements++;
+	mallocBlock->status = VGC_MALLOC_BUSY;
+	mallocBlock->checkStart = 0xAA;
+	mallocBlock->checkEnd = 0xAA;
+
+	void *memory = mallocBlockMemory(mallocBlock, lengthOrig);
+
+	stacktraceSave(mallocBlock, path);
+	if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
+	}
+
+	if (!isPathDebug(path)) return memory;
+
+	vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, "vgc_malloc", "Malloc", "", "", "%d bytes at 0x%lx (#%u)", length, memory, mmapBlock->elements);
+
+	if (shared->isMprotectEnabled) {
+		vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, "vgc_malloc", "Protect", "", "", "protect:0x%lx - malloc:0x%lx-0x%lx (%s) - size:%d - pid:%u", mallocBlock, memory, (char*)memory + mallocBlock->size, mallocBlock->status == VGC_MALLOC_FREE ? "free" : "busy", mallocBlock->size, getpid());
+	}
+
+	return memory;
+}
+
+
+// initialiseMutex
+//
+static bool initialiseMutex(void)
+{
+	if (!PTHREAD_mutexattrInit(&shared->mutexAttr)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexattrInit", "Fatal error", "mutex attr init failed", 0);
+		return false;
+	}
+	if (!PTHREAD_mutexInit(&shared->mutex, &shared->mutexAttr)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexInit", "Fatal error", "can't create shared mutex", 0);
+		if (!PTHREAD_mutexattrDestroy(&shared->mutexAttr)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexattrDestroy", "Fatal error", "can't destroy shared attr mutex", 0);
+		}
+		return false;
+	}
+
+	return true;
+}
+
+
+// initialiseArenas
+//
+static bool initialiseArenas(void)
+{
+	for (unsigned int i = 0; i < shared->arenaCount; i++) {
+		VGC_arena *arena = &shared->arenas[i];
+
+		arena->id = i;
+		arena->mmapBlockFirst = 0;
+		arena->mmapBlockCount = 0;
+		arena->emptyCount = 0;
+		arena->decayNext = 0;
+		arena->mmapBlockSize = shared->mmapBlockMinSize;
+		arena->slabFirst = 0;
+		for (unsigned int class = 0; class < VGC_MALLOC_SLAB_CLASSES; class++) arena->slabFree[class] = 0;
+		arena->remoteFree = 0;
+		if (!PTHREAD_mutexattrInit(&arena->mutexAttr)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexattrInit", "Fatal error", "arena mutex attr init failed", 0);
+			return false;
+		}
+		if (!PTHREAD_mutexInit(&arena->mutex, &arena->mutexAttr)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexInit", "Fatal error", "can't create arena mutex", 0);
+			if (!PTHREAD_mutexattrDestroy(&arena->mutexAttr)) {
+				vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexattrDestroy", "Fatal error", "can't destroy arena attr mutex", 0);
+			}
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+// threadArena
+//
+// Arena for the allocations of the calling thread
+// It is the arena of the CPU running the thread, so that threads running at the same time use different locks.
+// With VGC_MALLOC_ARENA_THREAD_HASH defined, or if the CPU is not known, it is fixed for each thread by a hash of the thread id
+//
+static inline VGC_arena *threadArena(void)
+{
+#ifndef VGC_MALLOC_ARENA_THREAD_HASH
+	int cpu = sched_getcpu();
+	if (cpu >= 0) return &shared->arenas[cpu % shared->arenaCount];
+#endif
+	static __thread VGC_arena *arena = 0;
+	if (arena == 0) {
+		uint64_t hash = (uint64_t)PTHREAD_self() * 0x9E3779B97F4A7C15ULL;
+		arena = &shared->arenas[(hash >> 32) % shared->arenaCount];
+	}
+	return arena;
+}
+
+
+// mmapBlockRound
+//
+// Rounds the size of an MMAP block up to the pages backing it
+//
+static inline size_t mmapBlockRound(size_t size)
+{
+	size_t pageSize = shared->hugePageSize != 0 ? shared->hugePageSize : shared->pageSize;
+	return roundup(size, pageSize);
+}
+
+
+// mmapBlockAllocate
+//
+// Must be inside a mutex for the arena
+// The MMAP blocks of an arena grow geometrically: a small program maps little memory
+// and a big one has few MMAP blocks to walk. The block is anyway big enough for a malloc of "length" bytes.
+//
+static VGC_mmapHeader *mmapBlockAllocate(VGC_arena *arena, size_t length, VGC_mmapHeader *mmapLastBlock)
+{
+	if (shared->isMprotectEnabled) length = roundup(length, shared->pageSize);
+	size_t minSize = mmapBlockRound(length + VGC_MALLOC_MMAP_FIRST + sizeof(VGC_mallocHeader));
+
+	// The limits may have been changed with vgc_mallctl() since the last block
+	//
+	arena->mmapBlockSize = MIN(MAX(arena->mmapBlockSize, shared->mmapBlockMinSize), shared->mmapBlockMaxSize);
+	size_t mmapBlockSize = MAX(mmapBlockRound(arena->mmapBlockSize), minSize);
+
+	// Allocate a new MMAP block in the arena
+	//
+	VGC_mmapHeader *mmapBlock = allocMMAP(arena, mmapBlockSize, mmapLastBlock);
+	if (mmapBlock == MAP_FAILED) {
+		// No more space available in the system
+		// Try allocating a smaller MMAP block of 1/10 of the original request
+		//
+		mmapBlock = allocMMAP(arena, MAX(mmapBlockRound(mmapBlockSize / 10), minSize), mmapLastBlock);
+		if (mmapBlock == MAP_FAILED) {
+			// Even the request for a smaller MMAP block failed,
+			// there is definitely no more space available for this process in the system
+			//
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "allocMMAP", "Error", "can't get enough memory for MMAP", ": %s", strerror(errno));
+		}
+		return mmapBlock;
+	}
+
+	arena->mmapBlockSize = MIN(arena->mmapBlockSize * 2, shared->mmapBlockMaxSize);
+	return mmapBlock;
+}
+
+
+// createShared
+//
+static VGC_shared *createShared(void)
+{
+	VGC_shared *s = mmap(0, sizeof(VGC_shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (s == 0) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mmap", "Fatal error", "can't create shared MMAP memory for VGC_shared", ": %s", strerror(errno));
+		return 0;
+	}
+
+	// Initialise page size, MMAP block size and MMAP block count
+	// The MMAP block sizes are set by vgc_mallctlInit()
+	//
+	s->pageSize = sysconf(_SC_PAGE_SIZE);
+	s->mmapBlockCount = 0;
+	s->largeFirst = 0;
+	s->mmapMinPages = VGC_MALLOC_MMAP_MIN_PAGES;
+	s->mmapPages = VGC_MALLOC_MMAP_PAGES;
+
+	// One arena per CPU
+	//
+	long int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	s->arenaCount = cpus < 1 ? 1 : cpus > VGC_MALLOC_ARENAS ? VGC_MALLOC_ARENAS : cpus;
+
+#if defined(VGC_MALLOC_MPROTECT) || defined(VGC_MALLOC_MPROTECT_PKEY)
+	s->isMprotectEnabled = true;
+#  if defined(VGC_MALLOC_MPROTECT_MP)
+	s->maxProcesses = 0;
+	s->children = 0;
+#  endif
+#else
+	s->isMprotectEnabled = false;
+#endif
+
+#ifdef VGC_MALLOC_HUGEPAGES
+	s->isHugepagesEnabled = true;
+#else
+	s->isHugepagesEnabled = false;
+#endif
+#ifdef VGC_MALLOC_STACKTRACE
+	s->isStacktraceEnabled = true;
+	s->stacktraceSize = VGC_MALLOC_STACKTRACE_SIZE;
+#else
+	s->isStacktraceEnabled = false;
+	s->stacktraceSize = 0;
+#endif
+	s->path = VGC_MALLOC_PATH;
+	s->engine = VGC_MALLOC_ENGINE;
+	s->mutexType = VGC_MALLOC_LOCK;
+	s->checkInterval = VGC_MALLOC_CHECK_INTERVAL;
+	s->isScrubberEnabled = false;
+	s->scrubberCpu = VGC_MALLOC_SCRUBBER_CPU;
+	s->isShared = VGC_MALLOC_SHARED;
+	s->isSlabEnabled = VGC_MALLOC_SLAB;
+	s->slabCount = 0;
+	s->isRemoteFreeEnabled = VGC_MALLOC_REMOTE_FREE;
+	if (getrandom(&s->remoteFreeKey, sizeof(s->remoteFreeKey), GRND_NONBLOCK) != sizeof(s->remoteFreeKey)) {
+		s->remoteFreeKey = (uintptr_t)s * 0x9E3779B97F4A7C15ULL;
+	}
+	return s;
+}
+
+
+// privateShared
+//
+// With private MMAP blocks the data that describes them must be private too, so that a forked process gets a copy of both.
+// It is moved at start up, before its mutexes are initialised
+//
+static bool privateShared(void)
+{
+	VGC_shared *s = mmap(0, sizeof(VGC_shared), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (s == MAP_FAILED) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mmap", "Fatal error", "can't create private memory for VGC_shared", ": %s", strerror(errno));
+		return false;
+	}
+
+	memcpy(s, shared, sizeof(VGC_shared));
+	if (munmap(shared, sizeof(VGC_shared)) == -1) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "munmap", "Error", "unmapping MMAP (shared)", ": %s", strerror(errno));
+	}
+	shared = s;
+	return true;
+}
+
+
+// Fork with private memory
+//
+// The forked process gets a copy of the blocks and of their mutexes: all the mutexes are taken before the fork,
+// so that no thread is changing the blocks while they are copied, and released after it.
+// In the child they are initialised again, the threads that took them don't exist there.
+//
+typedef enum { FORK_LOCK, FORK_UNLOCK, FORK_INIT } ForkAction;
+
+static void forkMutex(VGC_mutex *mutex, pthread_mutexattr_t *mutexAttr, ForkAction action)
+{
+	bool isDone = action == FORK_LOCK ? PTHREAD_mutexLock(mutex) : action == FORK_UNLOCK ? PTHREAD_mutexUnlock(mutex) : PTHREAD_mutexInit(mutex, mutexAttr);
+	if (!isDone) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "fork", "Error", "can't lock, unlock or initialise mutex", ": 0x%lx", mutex);
+	}
+}
+
+// In lock order: each arena and its MMAP blocks, then the shared mutex of the large blocks
+//
+static void forkMutexes(ForkAction action)
+{
+	for (unsigned int i = 0; i < shared->arenaCount; i++) {
+		VGC_arena *arena = &shared->arenas[i];
+		forkMutex(&arena->mutex, &arena->mutexAttr, action);
+		for (VGC_mmapHeader *mmapBlock = arena->mmapBlockFirst; mmapBlock != 0; mmapBlock = mmapBlock->next) {
+			forkMutex(&mmapBlock->mutex, &mmapBlock->mutexAttr, action);
+		}
+	}
+	forkMutex(&shared->mutex, &shared->mutexAttr, action);
+}
+
+static void forkPrepare(void) { forkMutexes(FORK_LOCK); }
+static void forkParent(void)  { forkMutexes(FORK_UNLOCK); }
+static void forkChild(void)   { forkMutexes(FORK_INIT); }
+
+
+// mutexType
+//
+// A process may die holding a mutex of the memory it shares with the others, the robust pthread mutexes are then
+// made consistent by the next owner while a futex mutex would stay locked.
+// The processes of the multi-process mprotect always have the robust mutexes, whatever the setting lock.
+// Without the setting the memory shared with other processes has the robust mutexes, the private memory the futex mutexes
+//
+static VGC_mutexType mutexType(void)
+{
+#if defined(VGC_MALLOC_MPROTECT_MP) && (defined(VGC_MALLOC_MPROTECT) || defined(VGC_MALLOC_MPROTECT_PKEY))
+	if (shared->isMprotectEnabled) return VGC_MUTEX_PTHREAD;
+#endif
+	if (shared->mutexType != VGC_MUTEX_ALL) return shared->mutexType;
+	return shared->isShared ? VGC_MUTEX_PTHREAD : VGC_MUTEX_FUTEX;
+}
+
+
+// initializeShared
+//
+static bool initializeShared(void)
+{
+	shared = createShared();
+	if (!shared) return false;
+	if (!vgc_mallctlInit(vgc_mallocConf)) return false;
+	if (!vgc_mallctlInit(getenv("VGC_MALLOC_CONF"))) return false;
+	if (!shared->isShared && !privateShared()) return false;
+	shared->mutexType = mutexType();
+	PTHREAD_mutexSetType(shared->mutexType, shared->isShared);
+	if (!initialiseMutex()) return false;
+	if (!initialiseArenas()) return false;
+	if (!vgc_pagemapInit(shared->pageSize)) return false;
+	if (!shared->isShared && !PTHREAD_atfork(forkPrepare, forkParent, forkChild)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_atfork", "Fatal error", "can't register fork handlers", 0);
+		return false;
+	}
+
+#if defined(VGC_MALLOC_MPROTECT_MP) && (defined(VGC_MALLOC_MPROTECT) || defined(VGC_MALLOC_MPROTECT_PKEY))
+	if (shared->isMprotectEnabled) startMprotect(10);
+#endif
+	isInitialised = true;
+	return vgc_mallocScrubberUpdate();
+}
+
+
+
+// Thread cache
+//
+// Each thread keeps up to VGC_MALLOC_TCACHE_COUNT blocks it freed for each of the VGC_MALLOC_TCACHE_BINS sizes,
+// a vgc_malloc() of the same size takes them back without touching the shared and the MMAP mutexes.
+// A cached block has status VGC_MALLOC_CACHED and is still counted in the elements of its MMAP,
+// so the MMAP block can't be unmapped while the block is in a cache.
+// The caches are flushed back to the MMAP blocks when the thread exits and before the leak report.
+//
+typedef struct VGC_threadCache {
+	struct VGC_threadCache *prev;
+	struct VGC_threadCache *next;
+	VGC_mutex               mutex;		// Not contended: only the owner thread and threadCacheFlushAll() take it
+	unsigned int            count[VGC_MALLOC_TCACHE_BINS];
+	VGC_mallocHeader       *bins[VGC_MALLOC_TCACHE_BINS][VGC_MALLOC_TCACHE_COUNT];
+} VGC_threadCache;
+
+static __thread VGC_threadCache *threadCache = 0;
+static pthread_key_t             threadCacheKey;
+static VGC_mutex                 threadCacheMutex = VGC_MUTEX_INITIALIZER;	// Protects the list of all the thread caches
+static VGC_threadCache          *threadCacheFirst = 0;
+
+
+// threadCacheBin
+//
+// Returns the bin for blocks of "length" bytes or -1 if the length is not cached
+//
+static inline int threadCacheBin(size_t length)
+{
+	size_t bin = (length - 1) / (shared->isMprotectEnabled ? shared->pageSize : VGC_MALLOC_ALIGNMENT);
+	return bin < VGC_MALLOC_TCACHE_BINS ? (int)bin : -1;
+}
+
+
+// threadCacheFlush
+//
+// Give all the blocks in the cache back to their MMAP blocks
+//
+static void threadCacheFlush(VGC_threadCache *cache)
+{
+	if (!PTHREAD_mutexLock(&cache->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on thread cache", 0);
+		return;
+	}
+
+	for (int bin = 0; bin < VGC_MALLOC_TCACHE_BINS; bin++) {
+		while (cache->count[bin] > 0) {
+			VGC_mallocHeader *mallocBlock = cache->bins[bin][--cache->count[bin]];
+			mallocBlock->status = VGC_MALLOC_BUSY;
+			freeMallocBlock((char*)mallocBlock + sizeof(VGC_mallocHeader));
+		}
+	}
+
+	if (!PTHREAD_mutexUnlock(&cache->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock thread cache", 0);
+	}
+}
+
+
+// threadCacheDestroy
+//
+// Executed at the exit of each thread that has a cache
+//
+static void threadCacheDestroy(void *_cache)
+{
+	VGC_threadCache *cache = _cache;
+
+	threadCacheFlush(cache);
+
+	if (!PTHREAD_mutexLock(&threadCacheMutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on thread cache list", 0);
+		return;
+	}
+	if (cache->prev != 0) cache->prev->next = cache->next;
+	else threadCacheFirst = cache->next;
+	if (cache->next != 0) cache->next->prev = cache->prev;
+	if (!PTHREAD_mutexUnlock(&threadCacheMutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock thread cache list", 0);
+	}
+
+	if (!PTHREAD_mutexDestroy(&cache->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexDestroy", "Error", "can't destroy thread cache mutex", 0);
+	}
+	threadCache = 0;
+	if (munmap(cache, sizeof(VGC_threadCache)) == -1) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "munmap", "Error", "unmapping thread cache", ": %s", strerror(errno));
+	}
+}
+
+
+// threadCacheCreate
+//
+static VGC_threadCache *threadCacheCreate(void)
+{
+	// The cache is private to the process, it holds blocks freed by this thread only
+	//
+	VGC_threadCache *cache = mmap(0, sizeof(VGC_threadCache), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (cache == MAP_FAILED) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mmap", "Error", "can't create thread cache", ": %s", strerror(errno));
+		return 0;
+	}
+
+	if (!PTHREAD_mutexInit(&cache->mutex, 0)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexInit", "Error", "can't create thread cache mutex", 0);
+		if (munmap(cache, sizeof(VGC_threadCache)) == -1) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "munmap", "Error", "unmapping thread cache", ": %s", strerror(errno));
+		}
+		return 0;
+	}
+
+	if (!PTHREAD_mutexLock(&threadCacheMutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on thread cache list", 0);
+		PTHREAD_mutexDestroy(&cache->mutex);
+		munmap(cache, sizeof(VGC_threadCache));
+		return 0;
+	}
+	cache->prev = 0;
+	cache->next = threadCacheFirst;
+	if (threadCacheFirst != 0) threadCacheFirst->prev = cache;
+	threadCacheFirst = cache;
+	if (!PTHREAD_mutexUnlock(&threadCacheMutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock thread cache list", 0);
+	}
+
+	// Register the cache to be flushed at thread exit
+	//
+	threadCache = cache;
+	if (!PTHREAD_setspecific(threadCacheKey, cache)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_setspecific", "Error", "can't register thread cache", 0);
+	}
+
+	return cache;
+}
+
+
+// threadCacheGet
+//
+// Returns memory for "size" bytes from the cache of the current thread, or 0 if there is none
+//
+static ATTR_ALWAYS_INLINE inline void *threadCacheGet(size_t size, const VGC_mallocPath path)
+{
+	VGC_threadCache *cache = threadCache;
+	if (cache == 0) return 0;
+
+	int bin = threadCacheBin(size);
+	if (bin < 0) return 0;
+
+	if (!PTHREAD_mutexLock(&cache->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on thread cache", 0);
+		return 0;
+	}
+	VGC_mallocHeader *mallocBlock = cache->count[bin] == 0 ? 0 : cache->bins[bin][--cache->count[bin]];
+	if (!PTHREAD_mutexUnlock(&cache->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock thread cache", 0);
+	}
+	if (mallocBlock == 0) return 0;
+
+	mallocBlock->status = VGC_MALLOC_BUSY;
+	mallocBlock->isZero = false;
+	stacktraceSave(mallocBlock, path);
+
+	void *memory = mallocBlockMemory(mallocBlock, size);
+	if (isPathDebug(path)) {
+		vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, "vgc_malloc", "Malloc", "", "", "%d bytes at 0x%lx (thread cache)", mallocBlock->size, memory);
+	}
+	return memory;
+}
+
+
+// threadCachePut
+//
+// Keeps the block in the cache of the current thread
+// Returns false if the block must be freed in its MMAP: wrong size, cache full or block that vgc_free() must report
+//
+static ATTR_ALWAYS_INLINE inline bool threadCachePut(VGC_mallocHeader *mallocBlock, const VGC_mallocPath path)
+{
+	if (mallocBlock->status != VGC_MALLOC_BUSY) return false;
+	if (isPathChecked(path) && (mallocBlock->checkStart != 0xAA || mallocBlock->checkEnd != 0xAA)) return false;
+
+	int bin = threadCacheBin(mallocBlock->size);
+	if (bin < 0) return false;
+
+	VGC_threadCache *cache = threadCache != 0 ? threadCache : threadCacheCreate();
+	if (cache == 0) return false;
+
+	if (!PTHREAD_mutexLock(&cache->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on thread cache", 0);
+		return false;
+	}
+	bool isCached = cache->count[bin] < VGC_MALLOC_TCACHE_COUNT;
+	if (isCached) {
+		mallocBlock->status = VGC_MALLOC_CACHED;
+		cache->bins[bin][cache->count[bin]++] = mallocBlock;
+	}
+	if (!PTHREAD_mutexUnlock(&cache->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock thread cache", 0);
+	}
+
+	if (isCached && isPathDebug(path)) {
+		vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, "vgc_free", "Free", "", "", "%d bytes at 0x%lx (thread cache)", mallocBlock->size, (char*)mallocBlock + sizeof(VGC_mallocHeader));
+	}
+	return isCached;
+}
+
+
+// threadCacheFlushAll
+//
+// Flush the caches of all the threads, used before the leak report
+//
+static void threadCacheFlushAll(void)
+{
+	if (!PTHREAD_mutexLock(&threadCacheMutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on thread cache list", 0);
+		return;
+	}
+	for (VGC_threadCache *cache = threadCacheFirst; cache != 0; cache = cache->next) {
+		threadCacheFlush(cache);
+	}
+	if (!PTHREAD_mutexUnlock(&threadCacheMutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock thread cache list", 0);
+	}
+}
+
+
+// threadCacheAtForkChild
+//
+// With shared memory the blocks cached before a fork are still owned by the caches of the parent process,
+// the child process starts with an empty cache so they are not given out twice.
+// With private memory the child has a copy of the blocks, the cache of the thread that called fork() is kept
+//
+static void threadCacheAtForkChild(void)
+{
+	PTHREAD_mutexInit(&threadCacheMutex, 0);
+	threadCacheFirst = threadCache;
+	if (threadCache == 0) return;
+
+	PTHREAD_mutexInit(&threadCache->mutex, 0);
+	threadCache->prev = 0;
+	threadCache->next = 0;
+	if (shared->isShared) memset(threadCache->count, 0, sizeof(threadCache->count));
+}
+
+
+// threadCacheInit
+//
+static bool threadCacheInit(void)
+{
+	if (!PTHREAD_keyCreate(&threadCacheKey, threadCacheDestroy)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_keyCreate", "Fatal error", "can't create thread cache key", 0);
+		return false;
+	}
+	if (!PTHREAD_atfork(0, 0, threadCacheAtForkChild)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_atfork", "Fatal error", "can't register thread cache fork handler", 0);
+		return false;
+	}
+	return true;
+}
+
+
+// Slabs
+//
+// Without mprotect the blocks up to VGC_MALLOC_SLAB_MAX_SIZE bytes are slots of a slab, an MMAP of VGC_MALLOC_SLAB_SIZE bytes
+// carved in equal slots of one class, with no malloc header: a bit for each slot in slabMap says it is FREE.
+// The leak report takes the caller of each BUSY slot from the side table of the slab (vgc_stacktraceCaller), a single address.
+// The slots taken on the checked paths are VGC_MALLOC_SLAB_CANARY_SIZE bytes bigger and end with a canary, a bit in canaryMap
+// tells them apart since the path can change: vgc_free() on the checked paths and the scrubber catch the overruns with it.
+// The slabs of an arena are in arena->slabFirst and the ones with FREE slots in arena->slabFree[class], protected by the arena mutex.
+// An empty slab is unmapped unless it is the only one of its class with FREE slots
+//
+
+// isSlabSize
+//
+// The block of "size" bytes, already rounded to VGC_MALLOC_ALIGNMENT, is a slab slot
+//
+static inline bool isSlabSize(size_t size)
+{
+	return size != 0 && size <= VGC_MALLOC_SLAB_MAX_SIZE && shared->isSlabEnabled && !shared->isMprotectEnabled;
+}
+
+
+// slabClass
+//
+// Class of a slot of "size" bytes: every 16 bytes up to 128, then four classes for each power of two
+//
+static inline unsigned int slabClass(size_t size)
+{
+	if (size <= 128) return (size - 1) / 16;
+
+	unsigned int class = sizeClass(size - 1);
+	return 8 + (class - 7) * 4 + (size - 1 - ((size_t)1 << class)) / ((size_t)1 << (class - 2));
+}
+
+
+// slabClassSize
+//
+static inline size_t slabClassSize(unsigned int class)
+{
+	if (class < 8) return (class + 1) * 16;
+
+	size_t base = (size_t)128 << ((class - 8) / 4);
+	return base + ((class - 8) % 4 + 1) * (base / 4);
+}
+
+
+// slabSlotSize
+//
+// Bytes of the slot for "size" bytes of memory, the canary included on the checked paths
+//
+static inline size_t slabSlotSize(size_t size, const VGC_mallocPath path)
+{
+	return isPathChecked(path) ? size + VGC_MALLOC_SLAB_CANARY_SIZE : size;
+}
+
+
+// slabIsCanary
+//
+static inline bool slabIsCanary(VGC_mmapHeader *slab, long int slot)
+{
+	return (slab->canaryMap[slot / 64] & ((uint64_t)1 << (slot % 64))) != 0;
+}
+
+
+// slabCanarySet
+//
+// Must be inside the mutex of the arena
+// The bytes of the slot after the "size" bytes of memory are 0xAA, but the last 8 that keep the size
+//
+static inline void slabCanarySet(VGC_mmapHeader *slab, void *ptr, size_t size)
+{
+	char *end = (char*)ptr + slab->slotSize - sizeof(uint64_t);
+
+	memset((char*)ptr + size, 0xAA, end - ((char*)ptr + size));
+	*(uint64_t*)end = size ^ 0xAAAAAAAAAAAAAAAAULL;
+}
+
+
+// slabCanarySize
+//
+// Size of the memory of the slot at ptr, that ends with a canary
+// Returns 0 if the canary was overwritten
+//
+static size_t slabCanarySize(VGC_mmapHeader *slab, void *ptr)
+{
+	char  *end = (char*)ptr + slab->slotSize - sizeof(uint64_t);
+	size_t size = *(uint64_t*)end ^ 0xAAAAAAAAAAAAAAAAULL;
+
+	if (size == 0 || size % VGC_MALLOC_ALIGNMENT != 0 || size + VGC_MALLOC_SLAB_CANARY_SIZE > slab->slotSize) return 0;
+	for (char *canary = (char*)ptr + size; canary < end; canary++) {
+		if (*canary != (char)0xAA) return 0;
+	}
+	return size;
+}
+
+
+// slabFreeListInsert
+//
+// Must be inside the mutex of the arena
+//
+static void slabFreeListInsert(VGC_arena *arena, VGC_mmapHeader *slab)
+{
+	VGC_mmapHeader **first = &arena->slabFree[slab->slabClass];
+
+	slab->slabPrev = 0;
+	slab->slabNext = *first;
+	if (*first != 0) (*first)->slabPrev = slab;
+	*first = slab;
+}
+
+
+// slabFreeListRemove
+//
+// Must be inside the mutex of the arena
+//
+static void slabFreeListRemove(VGC_arena *arena, VGC_mmapHeader *slab)
+{
+	if (slab->slabPrev != 0) {
+		slab->slabPrev->slabNext = slab->slabNext;
+	}
+	else {
+		arena->slabFree[slab->slabClass] = slab->slabNext;
+	}
+	if (slab->slabNext != 0) slab->slabNext->slabPrev = slab->slabPrev;
+	slab->slabPrev = 0;
+	slab->slabNext = 0;
+}
+
+
+// slabCreate
+//
+// Must be inside the mutex of the arena
+// Maps a new slab for the class, the side table of the callers is before the slots
+// Returns the slab, already in the lists of the arena, or 0
+//
+static VGC_mmapHeader *slabCreate(VGC_arena *arena, unsigned int class)
+{
+	const size_t slabSize = roundup(VGC_MALLOC_SLAB_SIZE, shared->pageSize);
+	const size_t slotSize = slabClassSize(class);
+#ifdef VGC_MALLOC_STACKTRACE
+	const size_t callerSize = sizeof(void*);
+#else
+	const size_t callerSize = 0;
+#endif
+
+	VGC_mmapHeader *slab = mmap(0, slabSize, PROT_READ | PROT_WRITE, mmapSharing() | MAP_ANONYMOUS, -1, 0);
+	if (slab == MAP_FAILED) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mmap", "Error", "can't map slab", ": %s", strerror(errno));
+		return 0;
+	}
+
+	size_t slots = (slabSize - sizeof(VGC_mmapHeader) - VGC_MALLOC_ALIGNMENT) / (slotSize + callerSize);
+	slots = MIN(slots, VGC_MALLOC_SLAB_MAP_WORDS * 64);
+
+	slab->type = VGC_MMAP_SLAB;
+	slab->pages = VGC_MMAP_PAGES_SYSTEM;
+	slab->size = slabSize;
+	slab->maxSize = slots * slotSize;
+	slab->elements = 0;
+	slab->arena = arena;
+	slab->slabClass = class;
+	slab->slabSlots = slots;
+	slab->slotSize = slotSize;
+	slab->callers = callerSize != 0 ? (void**)((char*)slab + sizeof(VGC_mmapHeader)) : 0;
+	slab->slots = (char*)slab + roundup(sizeof(VGC_mmapHeader) + slots * callerSize, VGC_MALLOC_ALIGNMENT);
+	for (size_t i = 0; i < VGC_MALLOC_SLAB_MAP_WORDS; i++) {
+		slab->slabMap[i] = i < slots / 64 ? ~(uint64_t)0 : i == slots / 64 ? ((uint64_t)1 << (slots % 64)) - 1 : 0;
+		slab->canaryMap[i] = 0;
+	}
+	slab->checkStart = 0xAA;
+	slab->checkEnd = 0xAA;
+
+	if (!vgc_pagemapSet(slab, slabSize, slab)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "vgc_pagemapSet", "Error", "can't add slab to the page map", 0);
+		munmap(slab, slabSize);
+		return 0;
+	}
+
+	slab->prev = 0;
+	slab->next = arena->slabFirst;
+	if (arena->slabFirst != 0) arena->slabFirst->prev = slab;
+	arena->slabFirst = slab;
+	slabFreeListInsert(arena, slab);
+	__atomic_add_fetch(&shared->slabCount, 1, __ATOMIC_RELAXED);
+
+	vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, "vgc_malloc", "New slab at", "memory address", 0, "0x%lx (%lu slots of %lu bytes, arena %u)", slab, slots, slotSize, arena->id);
+	return slab;
+}
+
+
+// slabRelease
+//
+// Must be inside the mutex of the arena
+// Unmaps the empty slab
+//
+static void slabRelease(VGC_arena *arena, VGC_mmapHeader *slab)
+{
+	slabFreeListRemove(arena, slab);
+	if (slab->prev != 0) {
+		slab->prev->next = slab->next;
+	}
+	else {
+		arena->slabFirst = slab->next;
+	}
+	if (slab->next != 0) slab->next->prev = slab->prev;
+	__atomic_sub_fetch(&shared->slabCount, 1, __ATOMIC_RELAXED);
+
+	vgc_pagemapClear(slab, slab->size);
+	if (munmap(slab, slab->size) == -1) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "munmap", "Error", "can't unmap slab", ": %s", strerror(errno));
+	}
+}
+
+
+// slabTake
+//
+// Must be inside the mutex of the arena
+// Takes the first FREE slot of a slab of the class, mapping a new slab if there is none, "caller" goes in the side table
+// With "canary" not 0 the slot ends with a canary after "canary" bytes of memory
+// Returns the memory or 0
+//
+static void *slabTake(VGC_arena *arena, unsigned int class, void *caller, size_t canary)
+{
+	VGC_mmapHeader *slab = arena->slabFree[class];
+	if (slab == 0) slab = slabCreate(arena, class);
+	if (slab == 0) return 0;
+
+	unsigned int word = 0;
+	while (slab->slabMap[word] == 0) word++;
+	unsigned int slot = word * 64 + __builtin_ctzll(slab->slabMap[word]);
+	slab->slabMap[word] &= slab->slabMap[word] - 1;
+	if (++slab->elements == slab->slabSlots) slabFreeListRemove(arena, slab);
+
+	if (slab->callers != 0) slab->callers[slot] = caller;
+
+	void *memory = slab->slots + slot * slab->slotSize;
+	if (canary != 0) {
+		slab->canaryMap[slot / 64] |= (uint64_t)1 << (slot % 64);
+		slabCanarySet(slab, memory, canary);
+	}
+	return memory;
+}
+
+
+// slabAlloc
+//
+// A slot for a block of "size" bytes, see isSlabSize() and slabSlotSize()
+// Returns the memory or 0 if no slab could be mapped
+//
+static ATTR_ALWAYS_INLINE inline void *slabAlloc(size_t size, const VGC_mallocPath path)
+{
+	unsigned int class = slabClass(slabSlotSize(size, path));
+	void *caller = isPathChecked(path) ? vgc_stacktraceCaller() : 0;
+
+	VGC_arena *arena = threadArena();
+	if (__atomic_load_n(&arena->remoteFree, __ATOMIC_RELAXED) != 0) remoteFreeDrain(arena);
+	if (!PTHREAD_mutexLock(&arena->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on arena mutex", 0);
+		return 0;
+	}
+
+	void *memory = slabTake(arena, class, caller, isPathChecked(path) ? size : 0);
+
+	if (!PTHREAD_mutexUnlock(&arena->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock arena mutex", 0);
+	}
+
+	if (isPathDebug(path) && memory != 0) vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, "vgc_malloc", "Malloc", "", "", "%lu bytes at 0x%lx (slab)", slabClassSize(class), memory);
+	return memory;
+}
+
+
+// slabSlot
+//
+// Index of the slot at ptr, -1 if ptr is not the start of a slot
+//
+static inline long int slabSlot(VGC_mmapHeader *slab, void *ptr)
+{
+	size_t offset = (char*)ptr - slab->slots;
+	if (offset % slab->slotSize != 0 || offset / slab->slotSize >= slab->slabSlots) return -1;
+	return offset / slab->slotSize;
+}
+
+
+// slabUsableSize
+//
+// Bytes of memory of the BUSY slot at ptr, 0 if its canary was overwritten
+//
+static size_t slabUsableSize(VGC_mmapHeader *slab, void *ptr)
+{
+	long int slot = slabSlot(slab, ptr);
+	return slot >= 0 && slabIsCanary(slab, slot) ? slabCanarySize(slab, ptr) : slab->slotSize;
+}
+
+
+// slabFree
+//
+// Gives the slot back to its slab
+//
+static ATTR_ALWAYS_INLINE inline void slabFree(VGC_mmapHeader *slab, void *ptr, const VGC_mallocPath path)
+{
+	if (isPathChecked(path) && (slab->checkStart != 0xAA || slab->checkEnd != 0xAA)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_free", "slab", "Error", "wrong checksum in", ": %s (at 0x%lx)", slab->checkStart != 0xAA ? "checkStart" : "checkEnd", ptr);
+		return;
+	}
+
+	long int slot = slabSlot(slab, ptr);
+	if (slot < 0) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_free", "slab", "Error", "not the start of a slot", ": at 0x%lx", ptr);
+		return;
+	}
+	if (isPathChecked(path) && slabIsCanary(slab, slot) && slabCanarySize(slab, ptr) == 0) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_free", "slab", "Error", "canary overwritten after the memory", ": at 0x%lx", ptr);
+		return;
+	}
+
+	VGC_arena *arena = slab->arena;
+	if (!PTHREAD_mutexLock(&arena->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on arena mutex", 0);
+		return;
+	}
+
+	uint64_t bit = (uint64_t)1 << (slot % 64);
+	if ((slab->slabMap[slot / 64] & bit) != 0) {
+		if (!PTHREAD_mutexUnlock(&arena->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock arena mutex", 0);
+		}
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_free", "slab", "Error", "memory already freed", ": at 0x%lx", ptr);
+		return;
+	}
+
+	slab->slabMap[slot / 64] |= bit;
+	slab->canaryMap[slot / 64] &= ~bit;
+	if (slab->elements-- == slab->slabSlots) slabFreeListInsert(arena, slab);
+
+	// The slab is kept while it is the only one of its class with FREE slots
+	//
+	if (slab->elements == 0 && (arena->slabFree[slab->slabClass] != slab || slab->slabNext != 0)) slabRelease(arena, slab);
+
+	if (!PTHREAD_mutexUnlock(&arena->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock arena mutex", 0);
+	}
+	if (isPathDebug(path)) vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, "vgc_free", "Free", "", "", "0x%lx (slab)", ptr);
+}
+
+
+// slabTrim
+//
+// Must be inside the mutex of the arena
+// Unmaps the empty slabs of the arena, returns the bytes released
+//
+static size_t slabTrim(VGC_arena *arena)
+{
+	size_t released = 0;
+
+	VGC_mmapHeader *next = 0;
+	for (VGC_mmapHeader *slab = arena->slabFirst; slab != 0; slab = next) {
+		next = slab->next;
+		if (slab->elements != 0) continue;
+		released += slab->size;
+		slabRelease(arena, slab);
+	}
+	return released;
+}
+
+
+// dumpSlab
+//
+// Must be inside the mutex of the arena
+// Shows the BUSY slots of the slab with their callers
+//
+static void dumpSlab(const char *str, VGC_mmapHeader *slab, const char *desc)
+{
+	const char *dashes =  "---------------------------------------------------------------------";
+
+	vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, desc, 0, "slab at 0x%.12lx", slab);
+	vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, " ID memory         status    size", "", 0);
+	vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, dashes, "", 0);
+
+	for (unsigned int slot = 0; slot < slab->slabSlots; slot++) {
+		if ((slab->slabMap[slot / 64] & ((uint64_t)1 << (slot % 64))) != 0) continue;
+
+		vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "", "", "%s%3u%s 0x%.12lx %s%s%s %9lu bytes",
+				c_blue, slot, c_black, slab->slots + slot * slab->slotSize,
+				c_blue, mallocStatusName(VGC_MALLOC_BUSY), c_black, slab->slotSize);
+		if (slab->callers != 0) vgc_stacktraceShowCaller(slab->callers[slot]);
+	}
+
+	vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, dashes, "", 0);
+	vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "", "", "size allocated.: %s%9d bytes", c_blue, slab->size);
+	vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "", "", "size busy......: %s%9d bytes", c_blue, slab->elements * slab->slotSize);
+	vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "", "", "slots.........: %s%9d of %lu bytes", c_blue, slab->slabSlots, slab->slotSize);
+	vgc_message(INFO_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, dashes, "", 0);
+}
+
+
+// Remote frees
+//
+// A block freed by a thread of another arena doesn't wait for the mutexes of its arena, busy with the threads allocating there:
+// it is pushed on the remoteFree list of its arena with a compare and swap, the link is in the memory of the block.
+// The threads allocating in the arena take the whole list with one exchange, before locking the arena, and free its blocks.
+// While in the list a block of an MMAP has status VGC_MALLOC_CACHED and is counted in the elements of its MMAP, as in the thread caches.
+// A slot of a slab has no header: the key in its memory tells that it is in the list and catches a second free meanwhile.
+// With mprotect the link could cross into the protected page after the memory, the blocks are freed as before
+//
+typedef struct VGC_remoteFree {
+	struct VGC_remoteFree *next;
+	uintptr_t              key;	// shared->remoteFreeKey ^ the MMAP block of the block
+} VGC_remoteFree;
+
+
+// isRemoteFree
+//
+// The block is freed by a thread of another arena
+//
+static inline bool isRemoteFree(VGC_mmapHeader *mmapBlock)
+{
+	return shared->isRemoteFreeEnabled && !shared->isMprotectEnabled && mmapBlock->arena != threadArena();
+}
+
+
+// remoteFreePush
+//
+// Puts the block at ptr in the remote frees of its arena, without locks
+// Returns false if the block must be freed as usual, where the errors are reported: wrong slot or header, block of an MMAP that is not BUSY
+//
+static ATTR_ALWAYS_INLINE inline bool remoteFreePush(VGC_mmapHeader *mmapBlock, void *ptr, const VGC_mallocPath path)
+{
+	VGC_remoteFree *block = ptr;
+	uintptr_t key = shared->remoteFreeKey ^ (uintptr_t)mmapBlock;
+
+	if (isPathChecked(path) && (mmapBlock->checkStart != 0xAA || mmapBlock->checkEnd != 0xAA)) return false;
+	if (mmapBlock->type == VGC_MMAP_SLAB) {
+		if (slabSlot(mmapBlock, ptr) < 0) return false;
+		if (block->key == key) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_free", "slab", "Error", "memory already freed", ": at 0x%lx (remote free)", ptr);
+			return true;
+		}
+	}
+	else {
+		VGC_mallocHeader *mallocBlock = mallocHeaderOf(ptr);
+		if (isPathChecked(path) && (mallocBlock->checkStart != 0xAA || mallocBlock->checkEnd != 0xAA || mallocBlock->mmapBlock != mmapBlock)) return false;
+
+		VGC_mallocStatus status = VGC_MALLOC_BUSY;
+		if (!__atomic_compare_exchange_n(&mallocBlock->status, &status, VGC_MALLOC_CACHED, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) return false;
+	}
+
+	VGC_arena *arena = mmapBlock->arena;
+	block->key = key;
+	block->next = __atomic_load_n((VGC_remoteFree**)&arena->remoteFree, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n((VGC_remoteFree**)&arena->remoteFree, &block->next, block, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	return true;
+}
+
+
+// remoteFreeDrain
+//
+// Must be outside the mutexes of the arena
+// Frees the blocks in the remote frees of the arena
+//
+static void remoteFreeDrain(VGC_arena *arena)
+{
+	VGC_remoteFree *block = __atomic_exchange_n((VGC_remoteFree**)&arena->remoteFree, 0, __ATOMIC_ACQUIRE);
+	while (block != 0) {
+		VGC_remoteFree *next = block->next;
+		VGC_mmapHeader *mmapBlock = (VGC_mmapHeader*)(block->key ^ shared->remoteFreeKey);
+
+		block->key = 0;
+		if (mmapBlock->type == VGC_MMAP_SLAB) {
+			slabFree(mmapBlock, block, shared->path);
+		}
+		else {
+			mallocHeaderOf(block)->status = VGC_MALLOC_BUSY;
+			freeMallocBlock(block);
+		}
+		block = next;
+	}
+}
+
+
+
+// Large blocks
+//
+// A request too big for the MMAP blocks of the arenas gets an MMAP of its own, with a single BUSY malloc block.
+// With mprotect the memory ends at a trailing page protected as well, so overflows fault as in the other blocks.
+// The large MMAP blocks are in the shared->largeFirst list, protected by the shared mutex
+//
+
+// largeMinSize
+//
+// Requests from this size on are large blocks, the biggest block the engine lays out in the biggest MMAP
+//
+static inline size_t largeMinSize(void)
+{
+	return mallocEngine()->capacity(shared->mmapBlockMaxSize - VGC_MALLOC_MMAP_FIRST) - sizeof(VGC_mallocHeader);
+}
+
+
+// largeMmapSize
+//
+// Size of the MMAP for a large block of "size" bytes, including the trailing protected page
+//
+static inline size_t largeMmapSize(size_t size)
+{
+	const size_t pageSize = shared->pageSize;
+	const size_t guardSize = shared->isMprotectEnabled ? pageSize : 0;
+
+	return (VGC_MALLOC_MMAP_FIRST + sizeof(VGC_mallocHeader) + size + pageSize - 1) / pageSize * pageSize + guardSize;
+}
+
+
+// unmapLarge
+//
+static void unmapLarge(VGC_mmapHeader *mmapBlock, size_t mmapBlockSize)
+{
+	if (munmap(mmapBlock, mmapBlockSize) == -1) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "munmap", "Error", "unmapping MMAP", ": %s", strerror(errno));
+	}
+}
+
+
+// largeMallocBlock
+//
+// The BUSY block of a large MMAP, after the FREE block before the aligned memory if any (see allocLarge)
+//
+static inline VGC_mallocHeader *largeMallocBlock(VGC_mmapHeader *mmapBlock)
+{
+	VGC_mallocHeader *mallocBlock = firstMallocHeaderInMMAP(mmapBlock);
+	return mallocBlock->status == VGC_MALLOC_FREE ? mallocBlock->next : mallocBlock;
+}
+
+
+// mapLarge
+//
+// Maps the memory of a large block at an address aligned to "alignment" when it is bigger than a page:
+// the space is reserved with one "alignment" more, the block is mapped over its aligned part and the rest is unmapped
+//
+static void *mapLarge(size_t mmapBlockSize, size_t alignment)
+{
+	const int flags = mmapSharing() | MAP_ANONYMOUS;
+
+	if (alignment <= shared->pageSize) return mmap(0, mmapBlockSize, PROT_READ | PROT_WRITE, flags, -1, 0);
+
+	char *start = mmap(0, mmapBlockSize + alignment, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (start == MAP_FAILED) return MAP_FAILED;
+
+	char *aligned = (char*)(((uintptr_t)start + alignment - 1) & ~(alignment - 1));
+	if (mmap(aligned, mmapBlockSize, PROT_READ | PROT_WRITE, flags | MAP_FIXED, -1, 0) == MAP_FAILED) {
+		munmap(start, mmapBlockSize + alignment);
+		return MAP_FAILED;
+	}
+
+	if (aligned > start && munmap(start, aligned - start) == -1) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "munmap", "Error", "unmapping MMAP head", ": %s", strerror(errno));
+	}
+	if (aligned < start + alignment && munmap(aligned + mmapBlockSize, start + alignment - aligned) == -1) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "munmap", "Error", "unmapping MMAP tail", ": %s", strerror(errno));
+	}
+	return aligned;
+}
+
+
+// allocLarge
+//
+// With "alignment" not 0 the MMAP is aligned to it (or to a page) and its BUSY block is after a FREE block
+// that fills the gap up to the aligned memory, the gap is the same for all the MMAP's with the same alignment
+//
+static void *allocLarge(size_t size, size_t alignment, const VGC_mallocPath path)
+{
+	const size_t guardSize = shared->isMprotectEnabled ? shared->pageSize : 0;
+
+	if (size > SIZE_MAX / 2 || alignment > SIZE_MAX / 4) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_malloc", "size", "Error", "size is too big", ": %lu", size);
+		return 0;
+	}
+
+	// Gap as if the MMAP were at address 0, that is aligned to anything
+	//
+	size_t gap = alignment == 0 ? 0 : alignedGap((VGC_mallocHeader*)VGC_MALLOC_MMAP_FIRST, size, alignment);
+	size_t mmapBlockSize = largeMmapSize(size + gap);
+
+	VGC_mmapHeader *mmapBlock = mapLarge(mmapBlockSize, alignment);
+	if (mmapBlock == MAP_FAILED) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_malloc", "mmap", "Error", "no more memory available", ": %s", strerror(errno));
+		return 0;
+	}
+
+	if (!PTHREAD_mutexattrInit(&mmapBlock->mutexAttr)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexattrInit", "Error", "mmapBlock mutex attr init failed", 0);
+		unmapLarge(mmapBlock, mmapBlockSize);
+		return 0;
+	}
+	if (!PTHREAD_mutexInit(&mmapBlock->mutex, &mmapBlock->mutexAttr)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexInit", "Error", "can't create mutex on mmapBlock", 0);
+		if (!PTHREAD_mutexattrDestroy(&mmapBlock->mutexAttr)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexattrDestroy", "Error", "can't destroy mutex on mmapBlock", 0);
+		}
+		unmapLarge(mmapBlock, mmapBlockSize);
+		return 0;
+	}
+
+	// Initialise the MMAP, all its space is for one malloc block
+	//
+	mmapBlock->type = VGC_MMAP_LARGE;
+	mmapBlock->pages = VGC_MMAP_PAGES_SYSTEM;
+	mmapBlock->size = mmapBlockSize;
+	mmapBlock->maxSize = mmapBlockSize - guardSize - VGC_MALLOC_MMAP_FIRST - sizeof(VGC_mallocHeader);
+	mmapBlock->elements = 1;
+	mmapBlock->arena = 0;
+	freeListsClear(mmapBlock);
+	mmapBlock->checkStart = 0xAA;
+	mmapBlock->checkEnd = 0xAA;
+
+	VGC_mallocHeader *mallocBlock = firstMallocHeaderInMMAP(mmapBlock);
+	VGC_mallocHeader *prev = 0;
+	if (gap != 0) {
+		// The FREE block before the aligned memory, not in the free lists: the large MMAP has no free space to give
+		//
+		prev = mallocBlock;
+		prev->size = gap - sizeof(VGC_mallocHeader);
+		prev->status = VGC_MALLOC_FREE;
+		prev->mmapBlock = mmapBlock;
+		prev->prev = 0;
+		prev->next = (VGC_mallocHeader*)((char*)prev + gap);
+		prev->freePrev = 0;
+		prev->freeNext = 0;
+		prev->isZero = true;
+		prev->checkStart = 0xAA;
+		prev->checkEnd = 0xAA;
+		VGC_mprotect(prev);
+		mallocBlock = prev->next;
+	}
+
+	mallocBlock->size = mmapBlock->maxSize - gap;
+	mallocBlock->status = VGC_MALLOC_BUSY;
+	mallocBlock->mmapBlock = mmapBlock;
+	mallocBlock->prev = prev;
+	mallocBlock->next = 0;
+	mallocBlock->freePrev = 0;
+	mallocBlock->freeNext = 0;
+	mallocBlock->isZero = true;
+	mallocBlock->checkStart = 0xAA;
+	mallocBlock->checkEnd = 0xAA;
+	stacktraceSave(mallocBlock, path);
+	VGC_mprotect(mallocBlock);
+
+	if (guardSize != 0 && mprotect((char*)mmapBlock + mmapBlockSize - guardSize, guardSize, PROT_NONE) == -1) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mprotect", "Error", "can't protect the end of the large block", ": %s", strerror(errno));
+	}
+
+	if (!vgc_pagemapSet(mmapBlock, mmapBlockSize, mmapBlock)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "vgc_pagemapSet", "Error", "can't add MMAP to the page map", 0);
+		PTHREAD_mutexDestroy(&mmapBlock->mutex);
+		PTHREAD_mutexattrDestroy(&mmapBlock->mutexAttr);
+		unmapLarge(mmapBlock, mmapBlockSize);
+		return 0;
+	}
+
+	// Add to the list of the large blocks
+	//
+	if (!PTHREAD_mutexLock(&shared->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on shared mutex", 0);
+	}
+	mmapBlock->prev = 0;
+	mmapBlock->next = shared->largeFirst;
+	if (shared->largeFirst != 0) shared->largeFirst->prev = mmapBlock;
+	shared->largeFirst = mmapBlock;
+	if (!PTHREAD_mutexUnlock(&shared->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock shared mutex", 0);
+	}
+
+	void *memory = mallocBlockMemory(mallocBlock, size);
+	if (isPathDebug(path)) vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, "vgc_malloc", "Malloc", "", "", "%lu bytes at 0x%lx (large block of %luKB)", size, memory, mmapBlockSize / 1024);
+	return memory;
+}
+
+
+// freeLarge
+//
+static void freeLarge(VGC_mmapHeader *mmapBlock, void *ptr, const VGC_mallocPath path)
+{
+	VGC_mallocHeader *mallocBlock = largeMallocBlock(mmapBlock);
+
+	// The pointer is always checked, freeing the middle of a large block would unmap it
+	//
+	if (mallocHeaderOf(ptr) != mallocBlock || (isPathChecked(path) && (mmapBlock->checkStart != 0xAA || mmapBlock->checkEnd != 0xAA || mallocBlock->checkStart != 0xAA || mallocBlock->checkEnd != 0xAA))) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_free", "mallocBlock", "Error", "wrong large block", ": at 0x%lx", ptr);
+		return;
+	}
+
+	if (!PTHREAD_mutexLock(&shared->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on shared mutex", 0);
+		return;
+	}
+
+	if (mallocBlock->status != VGC_MALLOC_BUSY) {
+		if (!PTHREAD_mutexUnlock(&shared->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock shared mutex", 0);
+		}
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_free", "mallocBlock", "Error", "memory already freed", ": at 0x%lx", ptr);
+		return;
+	}
+	mallocBlock->status = VGC_MALLOC_FREE;
+
+	if (mmapBlock->prev != 0) mmapBlock->prev->next = mmapBlock->next;
+	else shared->largeFirst = mmapBlock->next;
+	if (mmapBlock->next != 0) mmapBlock->next->prev = mmapBlock->prev;
+	vgc_pagemapClear(mmapBlock, mmapBlock->size);
+
+	if (!PTHREAD_mutexUnlock(&shared->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock shared mutex", 0);
+	}
+
+	if (isPathDebug(path)) vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, "vgc_free", "Free", "", "", "%lu bytes at 0x%lx (large block of %luKB)", mallocBlock->size, ptr, mmapBlock->size / 1024);
+
+	if (!PTHREAD_mutexDestroy(&mmapBlock->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexDestroy", "Error", "can't destroy mmapBlock mutex", 0);
+	}
+	if (!PTHREAD_mutexattrDestroy(&mmapBlock->mutexAttr)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexattrDestroy", "Error", "can't destroy attr mmapBlock mutex", 0);
+	}
+	unmapLarge(mmapBlock, mmapBlock->size);
+}
+
+
+// reallocLarge
+//
+// Resize a large block with mremap(), the kernel moves its pages instead of copying them
+// The trailing protected page is released before the remap and protected again at the new end of the block
+// A MAP_SHARED | MAP_ANONYMOUS mapping can't grow past the size it had when created, in shared memory
+// the block only shrinks here and vgc_realloc() grows it by moving it
+// Returns the new memory or 0 if the block can't be remapped, in which case it is left untouched
+//
+static void *reallocLarge(VGC_mmapHeader *mmapBlock, void *ptr, size_t size, const VGC_mallocPath path)
+{
+	const size_t guardSize = shared->isMprotectEnabled ? shared->pageSize : 0;
+
+	if (size > SIZE_MAX / 2) return 0;
+	size_t mmapBlockSize = largeMmapSize(size);
+
+	if (!PTHREAD_mutexLock(&shared->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on shared mutex", 0);
+		return 0;
+	}
+
+	// An aligned block is moved by vgc_realloc() as the other blocks, the remap would keep the gap before it
+	//
+	VGC_mallocHeader *mallocBlock = firstMallocHeaderInMMAP(mmapBlock);
+	if (mallocBlock->status != VGC_MALLOC_BUSY || (isPathDebug(path) && !checkMmapBlock("vgc_realloc", mmapBlock))) {
+		if (!PTHREAD_mutexUnlock(&shared->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock shared mutex", 0);
+		}
+		return 0;
+	}
+
+	if (mmapBlockSize > mmapBlock->size && shared->isShared) {
+		if (!PTHREAD_mutexUnlock(&shared->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock shared mutex", 0);
+		}
+		return 0;
+	}
+
+	// mremap() can't move a mapping split in areas with different protections,
+	// the protected pages are released before the remap and protected again after it
+	//
+	char *guard = (char*)mmapBlock + mmapBlock->size - guardSize;
+	VGC_munprotect(mallocBlock);
+	if (guardSize != 0 && mprotect(guard, guardSize, PROT_READ | PROT_WRITE) == -1) {
+		VGC_mprotect(mallocBlock);
+		if (!PTHREAD_mutexUnlock(&shared->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock shared mutex", 0);
+		}
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mprotect", "Error", "can't unprotect the end of the large block", ": %s", strerror(errno));
+		return 0;
+	}
+
+	// The shared memory object keeps the pages cut off by the remap until it is unmapped, they are released first
+	//
+	size_t oldSize = mmapBlock->size;
+	if (mmapBlockSize < oldSize && shared->isShared && madvise((char*)mmapBlock + mmapBlockSize, oldSize - mmapBlockSize, MADV_REMOVE) == -1) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "madvise", "Error", "can't release the end of the large block", ": %s", strerror(errno));
+	}
+
+	VGC_mmapHeader *newBlock = mremap(mmapBlock, oldSize, mmapBlockSize, MREMAP_MAYMOVE);
+	if (newBlock == MAP_FAILED) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mremap", "Error", "can't remap the large block", ": %s", strerror(errno));
+		VGC_mprotect(mallocBlock);
+		if (guardSize != 0 && mprotect(guard, guardSize, PROT_NONE) == -1) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mprotect", "Error", "can't protect the end of the large block", ": %s", strerror(errno));
+		}
+		if (!PTHREAD_mutexUnlock(&shared->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock shared mutex", 0);
+		}
+		return 0;
+	}
+
+	// The old addresses are no longer valid, the new ones are known after the remap
+	//
+	vgc_pagemapClear(mmapBlock, oldSize);
+	if (!vgc_pagemapSet(newBlock, mmapBlockSize, newBlock)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "vgc_pagemapSet", "Error", "can't add MMAP to the page map", ": 0x%lx can't be freed", newBlock);
+	}
+
+	newBlock->size = mmapBlockSize;
+	newBlock->maxSize = mmapBlockSize - guardSize - VGC_MALLOC_MMAP_FIRST - sizeof(VGC_mallocHeader);
+	if (newBlock->prev != 0) newBlock->prev->next = newBlock;
+	else shared->largeFirst = newBlock;
+	if (newBlock->next != 0) newBlock->next->prev = newBlock;
+
+	mallocBlock = firstMallocHeaderInMMAP(newBlock);
+	mallocBlock->mmapBlock = newBlock;
+	mallocBlock->size = newBlock->maxSize;
+	mallocBlock->isZero = false;
+	stacktraceSave(mallocBlock, path);
+	VGC_mprotect(mallocBlock);
+
+	if (guardSize != 0 && mprotect((char*)newBlock + mmapBlockSize - guardSize, guardSize, PROT_NONE) == -1) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mprotect", "Error", "can't protect the end of the large block", ": %s", strerror(errno));
+	}
+
+	if (!PTHREAD_mutexUnlock(&shared->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock shared mutex", 0);
+	}
+
+	void *memory = mallocBlockMemory(mallocBlock, size);
+	if (isPathDebug(path)) vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, "vgc_realloc", "Realloc", "", "", "%lu bytes at 0x%lx from 0x%lx (large block of %luKB)", size, memory, ptr, mmapBlockSize / 1024);
+	return memory;
+}
+
+
+// mallocPath
+//
+// vgc_malloc() for one allocation path
+// With "alignment" not 0 the memory is aligned to it (see mallocAligned), such blocks don't go through the thread cache
+//
+static ATTR_ALWAYS_INLINE inline void *mallocPath(size_t size, size_t alignment, const VGC_mallocPath path)
+{
+	if (size == 0) {
+		if (isPathChecked(path)) vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_malloc", "size", "Warning",  "size is zero", 0);
+		return 0;
+	}
+
+	// The size would wrap when rounded up to VGC_MALLOC_ALIGNMENT
+	//
+	if (size > SIZE_MAX - VGC_MALLOC_ALIGNMENT) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_malloc", "size", "Error", "size is too big", ": %lu", size);
+		return 0;
+	}
+
+	if (!shared->isMprotectEnabled) {
+		size = roundup(size, VGC_MALLOC_ALIGNMENT);
+	}
+
+	// The engines that don't cut the FREE blocks at any length leave no FREE block before the aligned memory.
+	// Their buddy blocks are aligned to their size up to a page (see VGC_MALLOC_MMAP_FIRST): the request takes a block
+	// at least as big as the alignment, the bigger alignments are left to the large blocks
+	//
+	const VGC_mallocEngine *engine = mallocEngine();
+	if (alignment != 0 && !engine->isAnySize) {
+		if (alignment > VGC_MALLOC_SYSTEM_PAGE_SIZE) return allocLarge(size, alignment, path);
+		if (alignment > sizeof(VGC_mallocHeader)) size = MAX(size, alignment - sizeof(VGC_mallocHeader));
+	}
+
+	// Space for the FREE block that can be left before the aligned memory
+	//
+	size_t length = engine->length(size);
+	size_t alignedSize = alignment == 0 || !engine->isAnySize ? length : length + alignment + sizeof(VGC_mallocHeader) + (shared->isMprotectEnabled ? shared->pageSize : VGC_MALLOC_ALIGNMENT);
+	if (alignedSize >= largeMinSize()) return allocLarge(size, alignment, path);
+
+	void *memory = alignment == 0 && isSlabSize(slabSlotSize(size, path)) ? slabAlloc(size, path) : 0;
+	if (memory != 0) return memory;
+
+	memory = alignment == 0 ? threadCacheGet(length, path) : 0;
+	if (memory != 0) return memory;
+
+	VGC_arena *arena = threadArena();
+	if (__atomic_load_n(&arena->remoteFree, __ATOMIC_RELAXED) != 0) remoteFreeDrain(arena);
+	if (!PTHREAD_mutexLock(&arena->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on arena mutex", 0);
+		return 0;
+	}
+	if (arena->emptyCount > 0) arenaDecay(arena, false);
+
+	VGC_mmapHeader *mmapBlockLast = 0;
+	for (register VGC_mmapHeader *mmapBlock = arena->mmapBlockFirst; mmapBlock != 0; mmapBlock = mmapBlock->next) {
+		memory = allocMallocBlock(mmapBlock, length, alignment, path);
+		if (memory != 0) {
+			if (!PTHREAD_mutexUnlock(&arena->mutex)) {
+				vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock arena mutex", 0);
+			}
+			return memory;
+		}
+		mmapBlockLast = mmapBlock;
+	}
+#if 0
+	dumpMmapBlock(0, 0, "memory", mmapBlockLast, "memory dump");
+#endif
+
+	// There was no more space in the allocated MMAP blocks of the arena
+	// Allocate a new MMAP block and obtain new memory from it
+	//
+	VGC_mmapHeader *next = mmapBlockAllocate(arena, alignedSize, mmapBlockLast);
+	if (next == MAP_FAILED) {
+		if (!PTHREAD_mutexUnlock(&arena->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock arena mutex", 0);
+		}
+		return 0;
+	}
+
+	memory = allocMallocBlock(next, length, alignment, path);
+
+	if (!PTHREAD_mutexUnlock(&arena->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock arena mutex", 0);
+	}
+
+	return memory;
+}
+
+
+// carveMallocBlocks
+//
+// Must be inside a mutex for the arena
+// Allocates up to "n" blocks of "length" bytes from the MMAP block, with one lock of its mutex (see vgc_malloc_batch).
+// Each FREE block found leaves the free lists once and is cut in consecutive blocks, what is left of it goes back once.
+// Returns the number of blocks allocated, their memory is in ptrs[]
+//
+static ATTR_ALWAYS_INLINE inline size_t carveMallocBlocks(VGC_mmapHeader *mmapBlock, size_t length, size_t n, void **ptrs, const VGC_mallocPath path)
+{
+	size_t lengthOrig = length;
+#if defined(VGC_MALLOC_MPROTECT) || defined(VGC_MALLOC_MPROTECT_PKEY)
+	if (shared->isMprotectEnabled) length = roundup(length, shared->pageSize);
+#endif
+	size_t blockSize = length + sizeof(VGC_mallocHeader);
+	size_t count = 0;
+
+	if (!PTHREAD_mutexLock(&mmapBlock->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on mmapBlock", 0);
+		return 0;
+	}
+
+	const VGC_mallocEngine *engine = mallocEngine();
+	VGC_mallocHeader *mallocBlock;
+	while (count < n && (mallocBlock = engine->find(mmapBlock, length, 0)) != 0) {
+		if (isPathDebug(path) && !checkMallocBlock("vgc_malloc_batch", mmapBlock, mallocBlock)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "checkMallocBlock", "Error", "The MMAP for vgc_malloc_batch is unstable while allocating memory", 0);
+			break;
+		}
+
+		// The engines with blocks of given sizes split each block on their own
+		//
+		if (!engine->isAnySize) {
+			mallocBlock = engine->alloc(mmapBlock, mallocBlock, length, 0);
+			mallocBlock->status = VGC_MALLOC_BUSY;
+			stacktraceSave(mallocBlock, path);
+			mmapBlock->elements++;
+			ptrs[count++] = mallocBlockMemory(mallocBlock, lengthOrig);
+			continue;
+		}
+		freeListRemove(mmapBlock, mallocBlock);
+
+		// The last block takes all the space left when it is too small for a header and at least one byte more
+		//
+		for (;;) {
+			VGC_mallocHeader *next = 0;
+			if (mallocBlock->size > blockSize) {
+				next = (VGC_mallocHeader*)((char*)mallocBlock + blockSize);
+				next->mmapBlock = mmapBlock;
+				next->size = mallocBlock->size - blockSize;
+				next->status = VGC_MALLOC_FREE;
+				next->prev = mallocBlock;
+				next->next = mallocBlock->next;
+				next->isZero = mallocBlock->isZero;
+				next->checkStart = 0xAA;
+				next->checkEnd = 0xAA;
+				if (next->next != 0) next->next->prev = next;
+				mallocBlock->size = length;
+				mallocBlock->next = next;
+				VGC_mprotect(next);
+			}
+
+			mallocBlock->status = VGC_MALLOC_BUSY;
+			mallocBlock->checkStart = 0xAA;
+			mallocBlock->checkEnd = 0xAA;
+			stacktraceSave(mallocBlock, path);
+			mmapBlock->elements++;
+			ptrs[count++] = mallocBlockMemory(mallocBlock, lengthOrig);
+
+			if (next == 0) break;
+			if (count == n || next->size < length) {
+				freeListInsert(mmapBlock, next);
+				break;
+			}
+			mallocBlock = next;
+		}
+	}
+
+	// An empty MMAP kept by arenaDecay() is in use again
+	//
+	if (count != 0 && mmapBlock->emptySince != 0) {
+		mmapBlock->emptySince = 0;
+		mmapBlock->isPurged = false;
+		mmapBlock->arena->emptyCount--;
+	}
+
+	if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
+	}
+
+	if (isPathDebug(path) && count != 0) {
+		vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, "vgc_malloc_batch", "Malloc", "", "", "%lu blocks of %lu bytes from 0x%lx (#%u)", count, length, ptrs[0], mmapBlock->elements);
+	}
+
+	return count;
+}
+
+
+// mallocBatchPath
+//
+// vgc_malloc_batch() for one allocation path
+// The arena is locked once and each MMAP block once, the blocks don't go through the thread cache
+//
+static ATTR_ALWAYS_INLINE inline size_t mallocBatchPath(size_t size, size_t n, void **ptrs, const VGC_mallocPath path)
+{
+	if (size == 0) {
+		if (isPathChecked(path)) vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_malloc_batch", "size", "Warning",  "size is zero", 0);
+		return 0;
+	}
+
+	// The size would wrap when rounded up to VGC_MALLOC_ALIGNMENT
+	//
+	if (size > SIZE_MAX - VGC_MALLOC_ALIGNMENT) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_malloc_batch", "size", "Error", "size is too big", ": %lu", size);
+		return 0;
+	}
+
+	if (!shared->isMprotectEnabled) {
+		size = roundup(size, VGC_MALLOC_ALIGNMENT);
+	}
+
+	// Each large block has an MMAP of its own, there is nothing to share between them
+	//
+	if (mallocEngine()->length(size) >= largeMinSize()) {
+		for (size_t i = 0; i < n; i++) {
+			ptrs[i] = allocLarge(size, 0, path);
+			if (ptrs[i] == 0) return i;
+		}
+		return n;
+	}
+
+	VGC_arena *arena = threadArena();
+	size_t slotSize = slabSlotSize(size, path);
+	void *caller = isSlabSize(slotSize) && isPathChecked(path) ? vgc_stacktraceCaller() : 0;
+	if (__atomic_load_n(&arena->remoteFree, __ATOMIC_RELAXED) != 0) remoteFreeDrain(arena);
+	if (!PTHREAD_mutexLock(&arena->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on arena mutex", 0);
+		return 0;
+	}
+
+	size_t count = 0;
+	if (isSlabSize(slotSize)) {
+		while (count < n && (ptrs[count] = slabTake(arena, slabClass(slotSize), caller, isPathChecked(path) ? size : 0)) != 0) count++;
+
+		if (!PTHREAD_mutexUnlock(&arena->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock arena mutex", 0);
+		}
+		return count;
+	}
+
+	if (arena->emptyCount > 0) arenaDecay(arena, false);
+	size = mallocEngine()->length(size);
+
+	VGC_mmapHeader *mmapBlockLast = 0;
+	for (VGC_mmapHeader *mmapBlock = arena->mmapBlockFirst; mmapBlock != 0 && count < n; mmapBlock = mmapBlock->next) {
+		count += carveMallocBlocks(mmapBlock, size, n - count, &ptrs[count], path);
+		mmapBlockLast = mmapBlock;
+	}
+
+	// New MMAP blocks for the rest, each one is filled before the next is mapped
+	//
+	while (count < n) {
+		VGC_mmapHeader *next = mmapBlockAllocate(arena, size, mmapBlockLast);
+		if (next == MAP_FAILED) break;
+		size_t carved = carveMallocBlocks(next, size, n - count, &ptrs[count], path);
+		if (carved == 0) break;
+		count += carved;
+		mmapBlockLast = next;
+	}
+
+	if (!PTHREAD_mutexUnlock(&arena->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock arena mutex", 0);
+	}
+
+	return count;
+}
+
+
+// Deallocate the MMAP block if it is all free
+// Must be inside a mutex for the arena, the MMAP must be already unlinked from its neighbours
+//
+static void freeMMAP(VGC_mmapHeader *mmapBlock)
+{
+	VGC_arena *arena = mmapBlock->arena;
+
+	vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, __func__, "Unmapping MMAP at", "memory address", 0, "0x%lx (size: %dKB, arena %u)", mmapBlock, mmapBlock->size / 1024, arena->id);
+
+	arena->mmapBlockCount--;
+	__atomic_sub_fetch(&shared->mmapBlockCount, 1, __ATOMIC_RELAXED);
+	if (mmapBlock == arena->mmapBlockFirst) arena->mmapBlockFirst = mmapBlock->next;
+	vgc_pagemapClear(mmapBlock, mmapBlock->size);
+	if (munmap(mmapBlock, mmapBlock->size) == -1) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "munmap", "Error", "unmapping MMAP", ": %s", strerror(errno));
+	}
+}
+
+
+// nowMs
+//
+// Monotonic time in ms, used for the decay of the empty MMAP blocks
+//
+static inline uint64_t nowMs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+// purgeMemory
+//
+// Give the pages in the range back to the kernel, the range stays mapped
+// For MAP_SHARED blocks MADV_DONTNEED only drops the page table entries and the pages stay in memory,
+// MADV_REMOVE really frees them and they read as zero later. Private blocks are freed by MADV_DONTNEED.
+// The partial pages at the ends are cleared by hand.
+// Returns the number of bytes given back, 0 if none was, otherwise the whole range reads as zero
+//
+static size_t purgeMemory(void *start, size_t size)
+{
+	char *begin = (char*)(((uintptr_t)start + shared->pageSize - 1) & ~(shared->pageSize - 1));
+	char *end = (char*)(((uintptr_t)start + size) & ~(shared->pageSize - 1));
+	if (end <= begin) return 0;
+
+	if (madvise(begin, end - begin, shared->isShared ? MADV_REMOVE : MADV_DONTNEED) == 0) {
+		memset(start, 0, begin - (char*)start);
+		memset(end, 0, (char*)start + size - end);
+		return end - begin;
+	}
+	if (madvise(begin, end - begin, MADV_DONTNEED) == -1) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "madvise", "Error", "can't purge pages", ": %s", strerror(errno));
+	}
+	return 0;
+}
+
+
+// purgeFreeBlocks
+//
+// Must be inside the mutex of the mmapBlock
+// Gives back to the kernel the pages inside the FREE blocks of at least minSize bytes.
+// Blocks still marked isZero were never written since the last purge and are skipped.
+// Returns the number of bytes given back to the kernel
+//
+static size_t purgeFreeBlocks(VGC_mmapHeader *mmapBlock, size_t minSize)
+{
+	size_t purged = 0;
+
+	// Purged hugetlb pages go back to the reserved pool, not to the system
+	//
+	if (mmapBlock->pages == VGC_MMAP_PAGES_HUGETLB) return purged;
+	for (unsigned int class = sizeClass(minSize); class < VGC_MALLOC_FREE_LISTS; class++) {
+		if ((mmapBlock->freeListsMap & ((uint64_t)1 << class)) == 0) continue;
+
+		for (unsigned int sub = 0; sub < VGC_MALLOC_FREE_SUBLISTS; sub++) {
+			for (VGC_mallocHeader *mallocBlock = mmapBlock->freeLists[class][sub]; mallocBlock != 0; mallocBlock = mallocBlock->freeNext) {
+				if (mallocBlock->isZero || mallocBlock->size < minSize) continue;
+				size_t released = purgeMemory((char*)mallocBlock + sizeof(VGC_mallocHeader), mallocBlock->size);
+				if (released != 0) mallocBlock->isZero = true;
+				purged += released;
+			}
+		}
+	}
+	mmapBlock->dirty = 0;
+	return purged;
+}
+
+
+// releaseMMAP
+//
+// Must be inside the mutex of the arena and of the empty mmapBlock, the mmapBlock mutex is released
+// Unlinks the MMAP block from its neighbours and unmaps it
+//
+static bool releaseMMAP(VGC_mmapHeader *mmapBlock)
+{
+	if (mmapBlock->next != 0) {
+		if (!PTHREAD_mutexLock(&mmapBlock->next->mutex)) {
+			if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
+				vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
+			}
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on mmapBlock->next", 0);
+			return false;
+		}
+
+		mmapBlock->next->prev = mmapBlock->prev;
+
+		if (!PTHREAD_mutexUnlock(&mmapBlock->next->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock->next mutex", 0);
+		}
+	}
+
+	if (mmapBlock->prev != 0) {
+		if (!PTHREAD_mutexLock(&mmapBlock->prev->mutex)) {
+			if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
+				vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
+			}
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on mmapBlock->prev", 0);
+			return false;
+		}
+
+		mmapBlock->prev->next = mmapBlock->next;
+
+		if (!PTHREAD_mutexUnlock(&mmapBlock->prev->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock->prev mutex", 0);
+		}
+	}
+
+	mmapBlock->arena->emptyCount--;
+
+	if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
+	}
+	if (!PTHREAD_mutexDestroy(&mmapBlock->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexDestroy", "Error", "can't destroy mmapBlock mutex", 0);
+	}
+	if (!PTHREAD_mutexattrDestroy(&mmapBlock->mutexAttr)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexattrDestroy", "Error", "can't destroy attr mmapBlock mutex", 0);
+	}
+
+	freeMMAP(mmapBlock);
+	return true;
+}
+
+
+// arenaDecay
+//
+// Must be inside the mutex of the arena
+// Empty MMAP blocks are kept for the next allocations, avoiding mmap/munmap at each burst of allocations.
+// After VGC_MALLOC_DECAY_MS their pages are given back to the kernel, after twice that time they are unmapped.
+// The check runs at most four times per decay period, or at once with isForced to keep the arena
+// within VGC_MALLOC_EMPTY_MMAPS empty blocks, unmapping the oldest first
+//
+static void arenaDecay(VGC_arena *arena, bool isForced)
+{
+	uint64_t now = nowMs();
+	if (!isForced && now < arena->decayNext) return;
+	arena->decayNext = now + VGC_MALLOC_DECAY_MS / 4;
+
+	VGC_mmapHeader *oldest = 0;
+	VGC_mmapHeader *next = 0;
+	for (VGC_mmapHeader *mmapBlock = arena->mmapBlockFirst; mmapBlock != 0; mmapBlock = next) {
+		next = mmapBlock->next;
+		if (mmapBlock->emptySince == 0) continue;
+
+		if (!PTHREAD_mutexLock(&mmapBlock->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on mmapBlock", 0);
+			return;
+		}
+
+		uint64_t age = now - mmapBlock->emptySince;
+		if (age >= 2 * VGC_MALLOC_DECAY_MS) {
+			if (!releaseMMAP(mmapBlock)) return;
+			continue;
+		}
+		if (age >= VGC_MALLOC_DECAY_MS && !mmapBlock->isPurged) {
+			purgeFreeBlocks(mmapBlock, shared->pageSize);
+			mmapBlock->isPurged = true;
+			vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, __func__, "Purged MMAP at", "memory address", 0, "0x%lx (size: %dKB, arena %u)", mmapBlock, mmapBlock->size / 1024, arena->id);
+		}
+
+		if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
+		}
+		if (oldest == 0 || mmapBlock->emptySince < oldest->emptySince) oldest = mmapBlock;
+	}
+
+	if (arena->emptyCount > VGC_MALLOC_EMPTY_MMAPS && oldest != 0) {
+		if (!PTHREAD_mutexLock(&oldest->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on mmapBlock", 0);
+			return;
+		}
+		releaseMMAP(oldest);
+	}
+}
+
+
+// Check if next blocks are free and unify
+// mallocBlock must not be in a free list
+//
+static void freeBlocksNext(VGC_mallocHeader *mallocBlock)
+{
+	VGC_mallocHeader *nextBlock = mallocBlock->next;
+	if (nextBlock != 0 && nextBlock->status == VGC_MALLOC_FREE) {
+		freeListRemove(mallocBlock->mmapBlock, nextBlock);
+		VGC_munprotect(nextBlock);
+		mallocBlock->size += nextBlock->size + sizeof(VGC_mallocHeader);
+		mallocBlock->next = nextBlock->next;
+		if (nextBlock->next) nextBlock->next->prev = mallocBlock;
+	}
+}
+
+ 
+// Check if previous blocks are free and unify
+// mallocBlock must not be in a free list
+// Returns the resulting FREE block, not yet inserted in a free list
+//
+static VGC_mallocHeader *freeBlocksPrev(VGC_mallocHeader *mallocBlock)
+{
+	VGC_mallocHeader *prevBlock = mallocBlock->prev;
+	if (prevBlock != 0 && prevBlock->status == VGC_MALLOC_FREE) {
+		freeListRemove(mallocBlock->mmapBlock, prevBlock);
+		VGC_munprotect(mallocBlock);
+		prevBlock->isZero = false;
+		prevBlock->size += mallocBlock->size + sizeof(VGC_mallocHeader);
+		prevBlock->next = mallocBlock->next;
+		if (prevBlock->next) prevBlock->next->prev = prevBlock;
+		return prevBlock;
+	}
+	return mallocBlock;
+}
+
+
+// freeMallocBlockPath
+//
+// Give the block back to its MMAP, unifying it with the free blocks close to it
+//
+static ATTR_ALWAYS_INLINE inline void freeMallocBlockPath(void *ptr, const VGC_mallocPath path)
+{
+	VGC_mmapHeader *mmapBlock = mmapBlockOf(ptr);
+	if (mmapBlock == 0) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "freeMallocBlock", "mmapBlockOf", "Error", "points outside of MMAP at", ": 0x%lx", ptr);
+		return;
+	}
+
+	VGC_mallocHeader *mallocBlock = mallocHeaderOf(ptr);
+
+	if (!isPathChecked(path)) {
+		// No checks on the markers
+	}
+	else if (mallocBlock->checkStart != 0xAA || mallocBlock->checkEnd != 0xAA) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "Free", "", "", "%d bytes (at 0x%lx)", mallocBlock->size, ptr);
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mallocBlock", "Error", "wrong checksum in", ": %s (at 0x%lx)", mallocBlock->checkStart != 0xAA ? "checkStart" : "checkEnd", ptr);
+		return;
+	}
+	else if (mmapBlock->checkStart != 0xAA || mmapBlock->checkEnd != 0xAA || mallocBlock->mmapBlock != mmapBlock) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "Free", "", "", "%d bytes (at 0x%lx)", mallocBlock->size, ptr);
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mmapBlock", "Error", "wrong checksum in", ": %s (at 0x%lx)", mallocBlock->mmapBlock != mmapBlock ? "mallocBlock->mmapBlock" : mmapBlock->checkStart != 0xAA ? "checkStart" : "checkEnd", mmapBlock);
+		return;
+	}
+
+	// The block goes back to the arena that allocated it, whichever thread frees it
+	//
+	VGC_arena *arena = mmapBlock->arena;
+	if (!PTHREAD_mutexLock(&arena->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on arena mutex", 0);
+		return;
+	}
+
+	if (mallocBlock->status != VGC_MALLOC_BUSY) {
+		if (!PTHREAD_mutexUnlock(&arena->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock arena mutex", 0);
+		}
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mallocBlock", "Error", "memory already freed", ": at 0x%lx", ptr);
+		return;
+	}
+
+	mmapBlock->elements--;
+	if (isPathDebug(path)) {
+		vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, __func__, "Free", "", "", "%d bytes at 0x%lx (#%u)", mallocBlock->size, ptr, mmapBlock->elements);
+	}
+
+	if (!PTHREAD_mutexLock(&mmapBlock->mutex)) {
+		if (!PTHREAD_mutexUnlock(&arena->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock arena mutex", 0);
+		}
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on mmapBlock", ": %s", strerror(errno));
+		return;
+	}
+
+	// Free this block and any free blocks close to it to make it a bigger unified free block
+	//
+	if (isPathDebug(path) && !checkMallocBlock("vgc_free", mmapBlock, mallocBlock)) {
+		if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
+		}
+		if (!PTHREAD_mutexUnlock(&arena->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock arena mutex", 0);
+		}
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "checkMallocBlock", "Error", "The MMAP for vgc_free is unstable while freeing memory", 0);
+		return;
+	}
+
+	if (isPathDebug(path) && shared->isMprotectEnabled) {
+		vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, __func__, "Unprotect", "", "", "unprotect:0x%lx - free:0x%lx-0x%lx (%s) - size:%d - pid:%u", mallocBlock, ptr, (char*)ptr + mallocBlock->size, mallocBlock->status == VGC_MALLOC_FREE ? "free" : "busy", mallocBlock->size, getpid());
+	}
+
+	mmapBlock->dirty += mallocBlock->size;
+	mallocBlock->status = VGC_MALLOC_FREE;
+	mallocBlock->isZero = false;
+	VGC_munprotect(mallocBlock);
+	mallocEngine()->free(mmapBlock, mallocBlock);
+
+	if (mmapBlock->elements == 0) {
+		// The allocated MMAP block is all free, keep it for the next allocations
+		// arenaDecay() unmaps it if it stays unused or there are too many empty MMAP blocks
+		//
+		mmapBlock->emptySince = nowMs();
+		arena->emptyCount++;
+	}
+	else if (mmapBlock->dirty >= VGC_MALLOC_PURGE_THRESHOLD) {
+		// Enough memory was freed, give back the pages of the big FREE blocks so that RSS follows the memory in use
+		//
+		purgeFreeBlocks(mmapBlock, VGC_MALLOC_PURGE_SIZE);
+	}
+
+	if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
+	}
+	if (arena->emptyCount > 0) arenaDecay(arena, arena->emptyCount > VGC_MALLOC_EMPTY_MMAPS);
+	if (!PTHREAD_mutexUnlock(&arena->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock arena mutex", 0);
+	}
+}
+
+
+// freePath
+//
+// vgc_free() for one allocation path
+//
+static ATTR_ALWAYS_INLINE inline void freePath(void *ptr, const VGC_mallocPath path)
+{
+	if (ptr == 0) {
+		if (isPathChecked(path)) vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_free", "ptr", "Warning", "variable points to zero", 0);
+		return;
+	}
+
+	VGC_mmapHeader *mmapBlock = mmapBlockOf(ptr);
+	if (mmapBlock == 0) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_free", "mmapBlockOf", "Error", "points outside of MMAP at", ": 0x%lx", ptr);
+		return;
+	}
+
+	if (mmapBlock->type == VGC_MMAP_LARGE) {
+		freeLarge(mmapBlock, ptr, path);
+		return;
+	}
+	if (mmapBlock->type == VGC_MMAP_SLAB) {
+		if (!isRemoteFree(mmapBlock) || !remoteFreePush(mmapBlock, ptr, path)) slabFree(mmapBlock, ptr, path);
+		return;
+	}
+
+	if (threadCachePut(mallocHeaderOf(ptr), path)) return;
+	if (isRemoteFree(mmapBlock) && remoteFreePush(mmapBlock, ptr, path)) return;
+
+	freeMallocBlockPath(ptr, path);
+}
+
+
+// freeSizedPath
+//
+// vgc_free_sized() for one allocation path
+// The lean path trusts the caller: the MMAP block of the blocks too big for a slab is taken from the header, without the page map lookup.
+// The other paths check the pointer as vgc_free() does and that the size fits in the block
+//
+static ATTR_ALWAYS_INLINE inline void freeSizedPath(void *ptr, size_t size, const VGC_mallocPath path)
+{
+	if (ptr == 0) return;
+
+	VGC_mallocHeader *mallocBlock = mallocHeaderOf(ptr);
+	VGC_mmapHeader   *mmapBlock;
+
+	if (!isPathChecked(path) && size > VGC_MALLOC_SLAB_MAX_SIZE) {
+		mmapBlock = mallocBlock->mmapBlock;
+	}
+	else {
+		mmapBlock = mmapBlockOf(ptr);
+		if (mmapBlock == 0) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_free_sized", "mmapBlockOf", "Error", "points outside of MMAP at", ": 0x%lx", ptr);
+			return;
+		}
+	}
+
+	if (mmapBlock->type == VGC_MMAP_SLAB) {
+		// A slot with the canary overwritten is reported by slabFree()
+		//
+		size_t slotSize = isPathChecked(path) ? slabUsableSize(mmapBlock, ptr) : 0;
+		if (slotSize != 0 && size > slotSize) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_free_sized", "size", "Error", "bigger than the block", ": %lu bytes, slot of %lu bytes at 0x%lx", size, slotSize, ptr);
+			return;
+		}
+		if (!isRemoteFree(mmapBlock) || !remoteFreePush(mmapBlock, ptr, path)) slabFree(mmapBlock, ptr, path);
+		return;
+	}
+
+	if (isPathChecked(path)) {
+		if (mmapBlock->type == VGC_MMAP_BLOCKS && (mallocBlock->checkStart != 0xAA || mallocBlock->checkEnd != 0xAA || mallocBlock->mmapBlock != mmapBlock)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_free_sized", "mallocBlock", "Error", "wrong checksum in", ": %s (at 0x%lx)", mallocBlock->checkStart != 0xAA ? "checkStart" : "checkEnd", ptr);
+			return;
+		}
+		if (size > usableSize(mallocBlock, ptr)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_free_sized", "size", "Error", "bigger than the block", ": %lu bytes, block of %lu bytes at 0x%lx", size, usableSize(mallocBlock, ptr), ptr);
+			return;
+		}
+	}
+
+	if (mmapBlock->type == VGC_MMAP_LARGE) {
+		freeLarge(mmapBlock, ptr, path);
+		return;
+	}
+
+	if (threadCachePut(mallocBlock, path)) return;
+	if (isRemoteFree(mmapBlock) && remoteFreePush(mmapBlock, ptr, path)) return;
+
+	freeMallocBlockPath(ptr, path);
+}
+
+
+// freeBatchRun
+//
+// Frees the "n" blocks in ptrs[], all in the same MMAP block, with one lock of the arena and of the MMAP mutex (see vgc_free_batch).
+// The blocks are made FREE first, then each run of adjacent FREE blocks is unified in one pass and inserted once in the free lists.
+// The entries of the blocks that can't be freed are set to 0
+//
+static ATTR_ALWAYS_INLINE inline void freeBatchRun(VGC_mmapHeader *mmapBlock, void **ptrs, size_t n, const VGC_mallocPath path)
+{
+	if (isPathChecked(path) && (mmapBlock->checkStart != 0xAA || mmapBlock->checkEnd != 0xAA)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_free_batch", "mmapBlock", "Error", "wrong checksum in", ": %s (at 0x%lx)", mmapBlock->checkStart != 0xAA ? "checkStart" : "checkEnd", mmapBlock);
+		return;
+	}
+
+	VGC_arena *arena = mmapBlock->arena;
+	if (!PTHREAD_mutexLock(&arena->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on arena mutex", 0);
+		return;
+	}
+	if (!PTHREAD_mutexLock(&mmapBlock->mutex)) {
+		if (!PTHREAD_mutexUnlock(&arena->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock arena mutex", 0);
+		}
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on mmapBlock", ": %s", strerror(errno));
+		return;
+	}
+
+	const VGC_mallocEngine *engine = mallocEngine();
+	for (size_t i = 0; i < n; i++) {
+		VGC_mallocHeader *mallocBlock = mallocHeaderOf(ptrs[i]);
+
+		if (isPathChecked(path) && (mallocBlock->checkStart != 0xAA || mallocBlock->checkEnd != 0xAA || mallocBlock->mmapBlock != mmapBlock)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_free_batch", "mallocBlock", "Error", "wrong checksum in", ": %s (at 0x%lx)", mallocBlock->mmapBlock != mmapBlock ? "mallocBlock->mmapBlock" : mallocBlock->checkStart != 0xAA ? "checkStart" : "checkEnd", ptrs[i]);
+			ptrs[i] = 0;
+			continue;
+		}
+		if (mallocBlock->status != VGC_MALLOC_BUSY) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_free_batch", "mallocBlock", "Error", "memory already freed", ": at 0x%lx", ptrs[i]);
+			ptrs[i] = 0;
+			continue;
+		}
+		if (isPathDebug(path) && !checkMallocBlock("vgc_free_batch", mmapBlock, mallocBlock)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_free_batch", "checkMallocBlock", "Error", "The MMAP for vgc_free_batch is unstable while freeing memory", 0);
+			ptrs[i] = 0;
+			continue;
+		}
+
+		mmapBlock->elements--;
+		mmapBlock->dirty += mallocBlock->size;
+		mallocBlock->status = VGC_MALLOC_FREE;
+		mallocBlock->isZero = false;
+		VGC_munprotect(mallocBlock);
+		if (engine->isAnySize) freeListInsert(mmapBlock, mallocBlock);
+		else engine->free(mmapBlock, mallocBlock);
+	}
+
+	// Each run of FREE blocks becomes one block, starting from its first one.
+	// The headers unified in a block before them lose their marker, so they are skipped when met later in ptrs[].
+	// They are in the memory of the block now, it is not zero anymore.
+	// The engines with blocks of given sizes unify them at each free
+	//
+	for (size_t i = 0; engine->isAnySize && i < n; i++) {
+		if (ptrs[i] == 0) continue;
+
+		VGC_mallocHeader *first = mallocHeaderOf(ptrs[i]);
+		if (first->checkStart != 0xAA) continue;
+		while (first->prev != 0 && first->prev->status == VGC_MALLOC_FREE) first = first->prev;
+		if (first->next == 0 || first->next->status != VGC_MALLOC_FREE) continue;
+
+		freeListRemove(mmapBlock, first);
+		while (first->next != 0 && first->next->status == VGC_MALLOC_FREE) {
+			VGC_mallocHeader *next = first->next;
+			freeListRemove(mmapBlock, next);
+			VGC_munprotect(next);
+			next->checkStart = 0;
+			first->size += next->size + sizeof(VGC_mallocHeader);
+			first->isZero = false;
+			first->next = next->next;
+			if (first->next != 0) first->next->prev = first;
+		}
+		freeListInsert(mmapBlock, first);
+	}
+
+	if (isPathDebug(path)) {
+		vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, "vgc_free_batch", "Free", "", "", "%lu blocks from 0x%lx (#%u)", n, mmapBlock, mmapBlock->elements);
+	}
+
+	if (mmapBlock->elements == 0) {
+		// The allocated MMAP block is all free, keep it for the next allocations (see freeMallocBlockPath)
+		//
+		mmapBlock->emptySince = nowMs();
+		arena->emptyCount++;
+	}
+	else if (mmapBlock->dirty >= VGC_MALLOC_PURGE_THRESHOLD) {
+		purgeFreeBlocks(mmapBlock, VGC_MALLOC_PURGE_SIZE);
+	}
+
+	if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
+	}
+	if (arena->emptyCount > 0) arenaDecay(arena, arena->emptyCount > VGC_MALLOC_EMPTY_MMAPS);
+	if (!PTHREAD_mutexUnlock(&arena->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock arena mutex", 0);
+	}
+}
+
+
+// freeBatchPath
+//
+// vgc_free_batch() for one allocation path
+// The pointers that follow each other in ptrs[] and are in the same MMAP block are freed together, the blocks don't go through the thread cache
+//
+static ATTR_ALWAYS_INLINE inline void freeBatchPath(size_t n, void **ptrs, const VGC_mallocPath path)
+{
+	size_t i = 0;
+	while (i < n) {
+		if (ptrs[i] == 0) {
+			i++;
+			continue;
+		}
+
+		VGC_mmapHeader *mmapBlock = mmapBlockOf(ptrs[i]);
+		if (mmapBlock == 0) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_free_batch", "mmapBlockOf", "Error", "points outside of MMAP at", ": 0x%lx", ptrs[i]);
+			i++;
+			continue;
+		}
+		if (mmapBlock->type == VGC_MMAP_LARGE) {
+			freeLarge(mmapBlock, ptrs[i], path);
+			i++;
+			continue;
+		}
+		if (mmapBlock->type == VGC_MMAP_SLAB) {
+			slabFree(mmapBlock, ptrs[i], path);
+			i++;
+			continue;
+		}
+
+		size_t j = i + 1;
+		while (j < n && ptrs[j] != 0 && mmapBlockOf(ptrs[j]) == mmapBlock) j++;
+		freeBatchRun(mmapBlock, &ptrs[i], j - i, path);
+		i = j;
+	}
+}
+
+
+// reallocInPlace
+//
+// Resize the BUSY block so that it has "length" bytes, without moving it (see the realloc of the engines).
+// Returns false if the block can't be resized where it is
+//
+static ATTR_ALWAYS_INLINE inline bool reallocInPlace(VGC_mmapHeader *mmapBlock, VGC_mallocHeader *mallocBlock, size_t length, const VGC_mallocPath path)
+{
+	if (!PTHREAD_mutexLock(&mmapBlock->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on mmapBlock", 0);
+		return false;
+	}
+
+	if (mallocBlock->status != VGC_MALLOC_BUSY || (isPathDebug(path) && !checkMallocBlock("vgc_realloc", mmapBlock, mallocBlock))) {
+		if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
+		}
+		return false;
+	}
+
+	const VGC_mallocEngine *engine = mallocEngine();
+	if (!engine->realloc(mmapBlock, mallocBlock, engine->length(length))) {
+		if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
+		}
+		return false;
+	}
+
+	stacktraceSave(mallocBlock, path);
+
+	if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
+	}
+
+	if (isPathDebug(path)) vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, "vgc_realloc", "Realloc", "", "", "%d bytes at 0x%lx (in place)", mallocBlock->size, (char*)mallocBlock + sizeof(VGC_mallocHeader));
+	return true;
+}
+
+
+// reallocPath
+//
+// vgc_realloc() for one allocation path
+//
+static ATTR_ALWAYS_INLINE inline void *reallocPath(void *ptr, size_t size, const VGC_mallocPath path)
+{
+	if (size == 0) {
+		if (ptr != 0) {
+			vgc_free(ptr);
+		}
+		return 0;
+	}
+
+	if (ptr == 0) return vgc_malloc(size);
+
+	// The size would wrap when rounded up to VGC_MALLOC_ALIGNMENT
+	//
+	if (size > SIZE_MAX - VGC_MALLOC_ALIGNMENT) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_realloc", "size", "Error", "size is too big", ": %lu", size);
+		return 0;
+	}
+
+	VGC_mmapHeader *mmapBlock = mmapBlockOf(ptr);
+	if (mmapBlock == 0) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_realloc", "mmapBlockOf", "Error", "points outside of MMAP at", ": 0x%lx", ptr);
+		return 0;
+	}
+
+	// A slot stays where it is while the size is in the same slab class.
+	// The canary is written only under the arena mutex, as the scrubber reads it: a slot with one stays only for the same size
+	//
+	if (mmapBlock->type == VGC_MMAP_SLAB) {
+		long int slot = slabSlot(mmapBlock, ptr);
+		if (slot < 0) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_realloc", "slab", "Error", "not the start of a slot", ": at 0x%lx", ptr);
+			return 0;
+		}
+		bool   isCanary = slabIsCanary(mmapBlock, slot);
+		size_t slotSize = slabUsableSize(mmapBlock, ptr);
+		if (slotSize == 0) {
+			if (isPathChecked(path)) {
+				vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_realloc", "slab", "Error", "canary overwritten after the memory", ": at 0x%lx", ptr);
+				return 0;
+			}
+			slotSize = mmapBlock->slotSize - VGC_MALLOC_SLAB_CANARY_SIZE;
+		}
+
+		size = roundup(size, VGC_MALLOC_ALIGNMENT);
+		if (isCanary ? size == slotSize : isSlabSize(size) && slabClass(size) == mmapBlock->slabClass) return ptr;
+
+		void *new = vgc_malloc(size);
+		if (new == 0) return 0;
+
+		memcpy(new, ptr, MIN(slotSize, size));
+		vgc_free(ptr);
+		return new;
+	}
+
+	VGC_mallocHeader *mallocBlock = mallocHeaderOf(ptr);
+	if (isPathChecked(path) && (mallocBlock->checkStart != 0xAA || mallocBlock->checkEnd != 0xAA || mallocBlock->mmapBlock != mmapBlock)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, "vgc_realloc", "mallocBlock", "Error", "wrong checksum in", ": %s (at 0x%lx)", mallocBlock->checkStart != 0xAA ? "checkStart" : "checkEnd", ptr);
+		return 0;
+	}
+
+	// With mprotect the memory starts "offset" bytes after the header so that it ends at the end of the block
+	//
+	size_t offset = (char*)ptr - ((char*)mallocBlock + sizeof(VGC_mallocHeader));
+	size_t oldSize = mallocBlock->size - offset;
+
+	if (!shared->isMprotectEnabled) {
+		size = roundup(size, VGC_MALLOC_ALIGNMENT);
+	}
+
+	// The block can stay where it is, or be remapped if it is a large block,
+	// with mprotect only if its memory still ends at the end of the block
+	//
+	if (!shared->isMprotectEnabled || (offset + size) % shared->pageSize == 0) {
+		if (mmapBlock->type == VGC_MMAP_BLOCKS && size < largeMinSize()) {
+			if (reallocInPlace(mmapBlock, mallocBlock, offset + size, path)) return ptr;
+		}
+		else if (mmapBlock->type == VGC_MMAP_LARGE && size >= largeMinSize()) {
+			void *memory = reallocLarge(mmapBlock, ptr, size, path);
+			if (memory != 0) return memory;
+		}
+	}
+
+	void *new = vgc_malloc(size);
+	if (new == 0) return 0;
+
+	memcpy(new, ptr, MIN(oldSize, size));
+	vgc_free(ptr);
+	return new;
+}
+
+
+// One copy of the allocation functions for each path, each compiled with only the checks of its path
+//
+static void *mallocLean(size_t size)              { return mallocPath(size, 0, VGC_MALLOC_PATH_LEAN); }
+static void *mallocLeak(size_t size)              { return mallocPath(size, 0, VGC_MALLOC_PATH_LEAK); }
+static void *mallocFull(size_t size)              { return mallocPath(size, 0, VGC_MALLOC_PATH_FULL); }
+static void *mallocAlignedLean(size_t size, size_t alignment) { return mallocPath(size, alignment, VGC_MALLOC_PATH_LEAN); }
+static void *mallocAlignedLeak(size_t size, size_t alignment) { return mallocPath(size, alignment, VGC_MALLOC_PATH_LEAK); }
+static void *mallocAlignedFull(size_t size, size_t alignment) { return mallocPath(size, alignment, VGC_MALLOC_PATH_FULL); }
+static void  freeLean(void *ptr)                  { freePath(ptr, VGC_MALLOC_PATH_LEAN); }
+static void  freeLeak(void *ptr)                  { freePath(ptr, VGC_MALLOC_PATH_LEAK); }
+static void  freeFull(void *ptr)                  { freePath(ptr, VGC_MALLOC_PATH_FULL); }
+static void  freeSizedLean(void *ptr, size_t size) { freeSizedPath(ptr, size, VGC_MALLOC_PATH_LEAN); }
+static void  freeSizedLeak(void *ptr, size_t size) { freeSizedPath(ptr, size, VGC_MALLOC_PATH_LEAK); }
+static void  freeSizedFull(void *ptr, size_t size) { freeSizedPath(ptr, size, VGC_MALLOC_PATH_FULL); }
+static void  freeMallocBlockLean(void *ptr)       { freeMallocBlockPath(ptr, VGC_MALLOC_PATH_LEAN); }
+static void  freeMallocBlockLeak(void *ptr)       { freeMallocBlockPath(ptr, VGC_MALLOC_PATH_LEAK); }
+static void  freeMallocBlockFull(void *ptr)       { freeMallocBlockPath(ptr, VGC_MALLOC_PATH_FULL); }
+static size_t mallocBatchLean(size_t size, size_t n, void **ptrs) { return mallocBatchPath(size, n, ptrs, VGC_MALLOC_PATH_LEAN); }
+static size_t mallocBatchLeak(size_t size, size_t n, void **ptrs) { return mallocBatchPath(size, n, ptrs, VGC_MALLOC_PATH_LEAK); }
+static size_t mallocBatchFull(size_t size, size_t n, void **ptrs) { return mallocBatchPath(size, n, ptrs, VGC_MALLOC_PATH_FULL); }
+static void  freeBatchLean(size_t n, void **ptrs)  { freeBatchPath(n, ptrs, VGC_MALLOC_PATH_LEAN); }
+static void  freeBatchLeak(size_t n, void **ptrs)  { freeBatchPath(n, ptrs, VGC_MALLOC_PATH_LEAK); }
+static void  freeBatchFull(size_t n, void **ptrs)  { freeBatchPath(n, ptrs, VGC_MALLOC_PATH_FULL); }
+static void *reallocLean(void *ptr, size_t size)  { return reallocPath(ptr, size, VGC_MALLOC_PATH_LEAN); }
+static void *reallocLeak(void *ptr, size_t size)  { return reallocPath(ptr, size, VGC_MALLOC_PATH_LEAK); }
+static void *reallocFull(void *ptr, size_t size)  { return reallocPath(ptr, size, VGC_MALLOC_PATH_FULL); }
+
+typedef struct VGC_mallocPathFunctions {
+	void *(*malloc)(size_t size);
+	void *(*mallocAligned)(size_t size, size_t alignment);
+	void  (*free)(void *ptr);
+	void  (*freeSized)(void *ptr, size_t size);
+	void  (*freeMallocBlock)(void *ptr);
+	size_t (*mallocBatch)(size_t size, size_t n, void **ptrs);
+	void  (*freeBatch)(size_t n, void **ptrs);
+	void *(*realloc)(void *ptr, size_t size);
+} VGC_mallocPathFunctions;
+
+static const VGC_mallocPathFunctions mallocPaths[VGC_MALLOC_PATH_ALL] = {
+	[VGC_MALLOC_PATH_LEAN] = { mallocLean, mallocAlignedLean, freeLean, freeSizedLean, freeMallocBlockLean, mallocBatchLean, freeBatchLean, reallocLean },
+	[VGC_MALLOC_PATH_LEAK] = { mallocLeak, mallocAlignedLeak, freeLeak, freeSizedLeak, freeMallocBlockLeak, mallocBatchLeak, freeBatchLeak, reallocLeak },
+	[VGC_MALLOC_PATH_FULL] = { mallocFull, mallocAlignedFull, freeFull, freeSizedFull, freeMallocBlockFull, mallocBatchFull, freeBatchFull, reallocFull }
+};
+
+
+// vgc_malloc
+//
+// The vgc_malloc() function allocates size bytes and returns a pointer to the allocated memory.
+// The memory is not initialized.
+// If size is 0, then vgc_malloc() returns NULL.
+//
+// Returns:
+// The vgc_malloc() function returns a pointer to the allocated memory that is suitably aligned for any kind of variable.
+// On error, this function returns NULL.
+// NULL may also be returned by a successful call to vgc_malloc() with a size of zero.
+//
+ATTR_PUBLIC void *vgc_malloc(size_t size)
+{
+	return mallocPaths[shared->path].malloc(size);
+}
+
+
+// vgc_free
+//
+// The vgc_free() function frees the memory space pointed to by ptr, which must have been returned by a previous
+// call to vgc_malloc(), vgc_calloc() or vgc_realloc().
+// Otherwise, or if vgc_free(ptr) has already been called before, undefined behavior occurs.
+// If ptr is NULL, no operation is performed.
+//
+// Returns:
+// The vgc_free() function returns no value.
+//
+ATTR_PUBLIC void vgc_free(void *ptr)
+{
+	mallocPaths[shared->path].free(ptr);
+}
+
+
+// vgc_free_sized
+//
+// Same as vgc_free() for memory returned by vgc_malloc(), vgc_calloc() or vgc_realloc() of size bytes,
+// or of any size up to vgc_malloc_usable_size(ptr).
+// The size lets the lean path skip the page map lookup, the other paths check it against the block.
+//
+// Returns:
+// The vgc_free_sized() function returns no value.
+//
+ATTR_PUBLIC void vgc_free_sized(void *ptr, size_t size)
+{
+	mallocPaths[shared->path].freeSized(ptr, size);
+}
+
+
+// vgc_malloc_batch
+//
+// The vgc_malloc_batch() function allocates n blocks of size bytes each and places their addresses in ptrs[0] to ptrs[n - 1].
+// The memory is not initialized. The locks are taken once for all the blocks and each FREE block found is cut in as many
+// blocks as it can hold, consecutive blocks are usually next to each other in memory.
+// Each block is freed with vgc_free() or vgc_free_batch().
+//
+// Returns:
+// The number of blocks allocated, less than n if the memory ran out: only the first ones in ptrs[] are set.
+// 0 if size is 0.
+//
+ATTR_PUBLIC size_t vgc_malloc_batch(size_t size, size_t n, void **ptrs)
+{
+	return mallocPaths[shared->path].mallocBatch(size, n, ptrs);
+}
+
+
+// vgc_free_batch
+//
+// The vgc_free_batch() function frees the n blocks pointed to by ptrs[0] to ptrs[n - 1], returned by any of the allocation functions.
+// The pointers that follow each other in ptrs[] and are in the same MMAP block are freed with one lock
+// and the adjacent blocks among them are unified at once, as for the blocks from a vgc_malloc_batch().
+// NULL entries are skipped, the entries of the blocks that are not valid are set to NULL.
+//
+// Returns:
+// The vgc_free_batch() function returns no value.
+//
+ATTR_PUBLIC void vgc_free_batch(size_t n, void **ptrs)
+{
+	mallocPaths[shared->path].freeBatch(n, ptrs);
+}
+
+
+// freeMallocBlock
+//
+// Give the block back to its MMAP, unifying it with the free blocks close to it
+//
+static void freeMallocBlock(void *ptr)
+{
+	mallocPaths[shared->path].freeMallocBlock(ptr);
+}
+
+
+// mallocAligned
+//
+// vgc_malloc() of memory aligned to "alignment", a power of two.
+// Alignments the blocks already have need nothing more: VGC_MALLOC_ALIGNMENT without mprotect,
+// up to a page with mprotect where the memory ends at the end of a page and the size is rounded to the alignment.
+// Otherwise the aligned memory is carved from a FREE block, the space before it stays FREE.
+//
+static void *mallocAligned(size_t size, size_t alignment)
+{
+	if (size == 0) return vgc_malloc(size);
+	if (shared->isMprotectEnabled) {
+		if (size > SIZE_MAX - alignment) return 0;
+		size = roundup(size, alignment);
+		if (alignment <= shared->pageSize) return vgc_malloc(size);
+	}
+	else if (alignment <= VGC_MALLOC_ALIGNMENT) {
+		return vgc_malloc(size);
+	}
+	return mallocPaths[shared->path].mallocAligned(size, alignment);
+}
+
+
+// vgc_aligned_alloc
+//
+// The vgc_aligned_alloc() function allocates size bytes and returns a pointer to the allocated memory, a multiple of alignment.
+// The memory is not initialized. alignment must be a power of two.
+//
+// Returns:
+// The vgc_aligned_alloc() function returns a pointer to the allocated memory, that can be freed with vgc_free().
+// On error, this function returns NULL and errno is EINVAL for a wrong alignment or ENOMEM.
+//
+ATTR_PUBLIC void *vgc_aligned_alloc(size_t alignment, size_t size)
+{
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "alignment", "Error", "not a power of two", ": %lu", alignment);
+		errno = EINVAL;
+		return 0;
+	}
+
+	void *memory = mallocAligned(size, alignment);
+	if (memory == 0 && size != 0) errno = ENOMEM;
+	return memory;
+}
+
+
+// vgc_posix_memalign
+//
+// The vgc_posix_memalign() function allocates size bytes aligned to alignment and places the address of the allocated memory in *memptr.
+// alignment must be a power of two multiple of sizeof(void*).
+// If size is 0, *memptr is set to NULL.
+//
+// Returns:
+// 0 on success, EINVAL for a wrong alignment or ENOMEM. On error *memptr is not changed.
+//
+ATTR_PUBLIC int vgc_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "alignment", "Error", "not a power of two multiple of sizeof(void*)", ": %lu", alignment);
+		return EINVAL;
+	}
+
+	if (size == 0) {
+		*memptr = 0;
+		return 0;
+	}
+
+	void *memory = mallocAligned(size, alignment);
+	if (memory == 0) return ENOMEM;
+	*memptr = memory;
+	return 0;
+}
+
+
+// vgc_memalign
+//
+// Same as vgc_aligned_alloc(), obsolete
+//
+ATTR_PUBLIC void *vgc_memalign(size_t alignment, size_t size)
+{
+	return vgc_aligned_alloc(alignment, size);
+}
+
+
+// zeroMemory
+//
+// Same as memset(ptr, 0, size), big sizes are written with non temporal stores so they don't evict the cache
+//
+static void zeroMemory(void *ptr, size_t size)
+{
+#ifdef __SSE2__
+	if (size >= VGC_MALLOC_STREAM_SIZE) {
+		char   *p = ptr;
+		size_t  head = (16 - (uintptr_t)p % 16) % 16;
+
+		memset(p, 0, head);
+		p += head;
+		size -= head;
+
+		const __m128i zero = _mm_setzero_si128();
+		for (; size >= 64; size -= 64, p += 64) {
+			_mm_stream_si128((__m128i*)p, zero);
+			_mm_stream_si128((__m128i*)(p + 16), zero);
+			_mm_stream_si128((__m128i*)(p + 32), zero);
+			_mm_stream_si128((__m128i*)(p + 48), zero);
+		}
+		_mm_sfence();
+		memset(p, 0, size);
+		return;
+	}
+#endif
+	memset(ptr, 0, size);
+}
+
+
+// vgc_calloc
+//
+// The vgc_calloc() function  allocates memory for an array of nmemb elements of size bytes each and returns a pointer to the allocated memory.
+// The memory is set to zero.
+// If nmemb or size is 0, then vgc_calloc() returns NULL.
+//
+// Returns:
+// The vgc_calloc() function returns a pointer to the allocated memory that is suitably aligned for any kind of variable.
+// On error, or if nmemb * size overflows, this function returns NULL.
+// NULL may also be returned by a successful call to vgc_calloc() with nmemb or size equal to zero.
+//
+ATTR_PUBLIC void *vgc_calloc(size_t nmemb, size_t size)
+{
+	size_t mallocSize;
+	if (__builtin_mul_overflow(nmemb, size, &mallocSize)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mallocSize", "Error", "total size is too big", ": %lu * %lu", nmemb, size);
+		return 0;
+	}
+	if (mallocSize == 0) {
+		if (isPathChecked(shared->path)) vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mallocSize", "Warning", "total size is zero", 0);
+		return 0;
+	}
+
+	void *ptr = vgc_malloc(mallocSize);
+	if (ptr == 0) return 0;
+
+	// Memory never used since the MMAP was created is already zero, the slots of the slabs are not tracked
+	//
+	if (mmapBlockOf(ptr)->type == VGC_MMAP_SLAB || !mallocHeaderOf(ptr)->isZero) zeroMemory(ptr, mallocSize);
+	return ptr;
+}
+
+
+// newFreeBlock
+//
+// Must be inside a mutex for the mmapBlock
+// Creates a FREE block at "at" between prev and next, adding it to the free lists
+//
+static void newFreeBlock(VGC_mmapHeader *mmapBlock, void *at, size_t size, VGC_mallocHeader *prev, VGC_mallocHeader *next)
+{
+	VGC_mallocHeader *freeBlock = at;
+
+	freeBlock->mmapBlock = mmapBlock;
+	freeBlock->size = size;
+	freeBlock->status = VGC_MALLOC_FREE;
+	freeBlock->prev = prev;
+	freeBlock->next = next;
+	freeBlock->isZero = false;
+	freeBlock->checkStart = 0xAA;
+	freeBlock->checkEnd = 0xAA;
+	prev->next = freeBlock;
+	if (next != 0) next->prev = freeBlock;
+	freeListInsert(mmapBlock, freeBlock);
+	VGC_mprotect(freeBlock);
+}
+
+
+// vgc_realloc
+//
+// The vgc_realloc() function changes the size of the memory block pointed to by ptr to size bytes.
+// The contents will be unchanged in the range from the start of the region up to the minimum of the old and new sizes.
+// If the new size is larger than the old size, the added memory will not be initialized.
+// If ptr is NULL, then the call is equivalent to vgc_malloc(size), for all values of size;
+// if size is equal to zero, and ptr is not NULL, then the call is equivalent to vgc_free(ptr).
+// Unless ptr is NULL, it must have been returned by an earlier call to vgc_malloc(), vgc_calloc() or vgc_realloc().
+// If the area pointed to was moved, a vgc_free(ptr) is done.
+//
+// Returns:
+// The vgc_realloc() function returns a pointer to the newly allocated memory, which is suitably aligned for any kind of variable
+// and may be different from ptr, or NULL if the request fails.
+// If size was equal to 0, NULL is returned.
+// If vgc_realloc() fails the original block is left untouched; it is not freed or moved.
+//
+ATTR_PUBLIC void *vgc_realloc(void *ptr, size_t size)
+{
+	return mallocPaths[shared->path].realloc(ptr, size);
+}
+
+
+// vgc_malloc_usable_size
+//
+// The vgc_malloc_usable_size() function returns the number of bytes that can be used in the block pointed to by ptr,
+// which must have been returned by vgc_malloc() or one of the other allocation functions.
+// It is at least the size requested: without mprotect the blocks are rounded up to VGC_MALLOC_ALIGNMENT and a block takes
+// all the FREE space it was taken from when the rest would be too small for a block, a slot of a slab is all usable.
+// With mprotect the memory ends at the protected page after it, the usable size is the size requested.
 //
 // Returns:
-// The vgc_malloc() function returns a pointer to the allocated memory that is suitably aligned for any kind of variable.
-// On error, this function returns NULL.
-// NULL may also be returned by a successful call to vgc_malloc() with a size of zero.
+// The number of usable bytes, 0 if ptr is NULL or not valid.
 //
-ATTR_PUBLIC void *vgc_malloc(size_t size)
+ATTR_PUBLIC size_t vgc_malloc_usable_size(void *ptr)
 {
-	if (shared->mmapBlockFirst == 0) {
-		// Initialise first MMAP block
-		//
-		shared->mmapBlockFirst = mmapBlockAllocate(shared->mmapBlockSize, 0);
-		if (shared->mmapBlockFirst == MAP_FAILED) return 0;
-	}
+	if (ptr == 0) return 0;
 
-	if (size == 0) {
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "size", "Warning",  "size is zero", 0);
+	VGC_mmapHeader *mmapBlock = mmapBlockOf(ptr);
+	if (mmapBlock == 0) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mmapBlockOf", "Error", "points outside of MMAP at", ": 0x%lx", ptr);
 		return 0;
 	}
 
-	if (!shared->isMprotectEnabled) {
-		size += size % sizeof(char*) == 0 ? 0 : sizeof(char*) - (size % sizeof(char*));  // Align to 64bit, could use this? __attribute__ ((aligned (__BIGGEST_ALIGNMENT__)))
-	}
+	if (mmapBlock->type == VGC_MMAP_SLAB) {
+		long int slot = slabSlot(mmapBlock, ptr);
+		if (slot < 0 || (mmapBlock->slabMap[slot / 64] & ((uint64_t)1 << (slot % 64))) != 0) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "slab", "Error", "not an allocated block", ": at 0x%lx", ptr);
+			return 0;
+		}
 
-	if (size >= shared->mmapBlockFirst->maxSize) {
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "size", "Error", "size is too big", ": %d", size);
-		return 0;
+		size_t slotSize = slabUsableSize(mmapBlock, ptr);
+		if (slotSize == 0) vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "slab", "Error", "canary overwritten after the memory", ": at 0x%lx", ptr);
+		return slotSize;
 	}
 
-	if (!PTHREAD_mutexLock(&shared->mutex)) {
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on shared mutex", 0);
+	VGC_mallocHeader *mallocBlock = mallocHeaderOf(ptr);
+	if (mallocBlock->checkStart != 0xAA || mallocBlock->checkEnd != 0xAA || mallocBlock->mmapBlock != mmapBlock || mallocBlock->status == VGC_MALLOC_FREE) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mallocBlock", "Error", "not an allocated block", ": at 0x%lx", ptr);
 		return 0;
 	}
 
-	VGC_mmapHeader *mmapBlockLast = 0;
-	for (register VGC_mmapHeader *mmapBlock = shared->mmapBlockFirst; mmapBlock != 0; mmapBlock = mmapBlock->next) {
-		void *memory = allocMallocBlock(mmapBlock, size);
-		if (memory != 0) {
-			if (!PTHREAD_mutexUnlock(&shared->mutex)) {
-				vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock shared mutex", 0);
+	return usableSize(mallocBlock, ptr);
+}
+
+
+// vgc_malloc_trim
+//
+// Same as malloc_trim(): gives back to the kernel the pages inside all the FREE blocks
+// and unmaps the empty MMAP blocks and slabs kept in the arenas.
+// Only whole pages of FREE blocks are released, pad is there for compatibility with malloc_trim()
+// Returns 1 if some memory was released, 0 otherwise
+//
+ATTR_PUBLIC int vgc_malloc_trim(ATTR_UNUSED size_t pad)
+{
+	size_t released = 0;
+
+	for (unsigned int i = 0; i < shared->arenaCount; i++) {
+		VGC_arena *arena = &shared->arenas[i];
+		remoteFreeDrain(arena);
+		if (!PTHREAD_mutexLock(&arena->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on arena mutex", 0);
+			return released != 0;
+		}
+
+		VGC_mmapHeader *next = 0;
+		for (VGC_mmapHeader *mmapBlock = arena->mmapBlockFirst; mmapBlock != 0; mmapBlock = next) {
+			next = mmapBlock->next;
+			if (!PTHREAD_mutexLock(&mmapBlock->mutex)) {
+				vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on mmapBlock", 0);
+				break;
+			}
+
+			if (mmapBlock->emptySince != 0) {
+				released += mmapBlock->size;
+				if (!releaseMMAP(mmapBlock)) break;
+				continue;
+			}
+
+			released += purgeFreeBlocks(mmapBlock, shared->pageSize);
+			if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
+				vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
 			}
-			return memory;
 		}
-		mmapBlockLast = mmapBlock;
-	}
-#if 0
-	dumpMmapBlock(0, 0, "memory", mmapBlockLast, "memory dump");
-#endif
+		released += slabTrim(arena);
 
-	// There was no more space in the allocated MMAP blocks
-	// Allocate a new MMAP block and obtain new memory from it
-	//
-	VGC_mmapHeader *next = mmapBlockAllocate(shared->mmapBlockSize, mmapBlockLast);
-	if (next == MAP_FAILED) {
-		if (!PTHREAD_mutexUnlock(&shared->mutex)) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock shared mutex", 0);
+		if (!PTHREAD_mutexUnlock(&arena->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock arena mutex", 0);
 		}
-		return 0;
 	}
 
-	void *memory = allocMallocBlock(next, size);
+	return released != 0;
+}
 
-	if (!PTHREAD_mutexUnlock(&shared->mutex)) {
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock shared mutex", 0);
-	}
 
-	return memory;
-}
+
+// Scrubber
+//
+// Optional thread that checks all the MMAP blocks with checkMmapBlock() and the canaries of the slabs in background (setting scrubber),
+// a corruption is found soon after it happens without walking the MMAP blocks in vgc_malloc() and vgc_free().
+// It locks one MMAP block at a time, then sleeps so that it uses at most shared->scrubberCpu percent of a CPU.
+// The arena is locked only to find the next block, vgc_malloc() can use the arena while a block is checked.
+// The thread belongs to the process that started it, it is not running in the forked processes.
+//
+static pthread_t scrubberThread;
+static pid_t     scrubberPid = 0;	// Process running the scrubber thread, 0 if not running
+static bool      isScrubberStopping = false;
 
 
-// Deallocate the MMAP block if it is all free
+// threadCpuNs
 //
-static void freeMMAP(VGC_mmapHeader *mmapBlock)
+static inline uint64_t threadCpuNs(void)
 {
-	vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, __func__, "Unmapping MMAP at", "memory address", 0, "0x%lx (size: %dKB)", mmapBlock, mmapBlock->size / 1024);
-
-	shared->mmapBlockCount--;
-	if (mmapBlock == shared->mmapBlockFirst) shared->mmapBlockFirst = 0;
-	if (munmap(mmapBlock, mmapBlock->size) == -1) {
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "munmap", "Error", "unmapping MMAP", ": %s", strerror(errno));
-	}
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 
-// Check if next blocks are free and unify
+// scrubberSleep
 //
-static void freeBlocksNext(VGC_mallocHeader *mallocBlock)
+// Sleeps ns nanoseconds in small steps, returns false if the scrubber is stopping
+//
+static bool scrubberSleep(uint64_t ns)
 {
-	VGC_mallocHeader *nextBlock = mallocBlock->next;
-	if (nextBlock != 0 && nextBlock->status == VGC_MALLOC_FREE) {
-		VGC_munprotect(nextBlock);
-		mallocBlock->size += nextBlock->size + sizeof(VGC_mallocHeader);
-		mallocBlock->next = nextBlock->next;
-		if (nextBlock->next) nextBlock->next->prev = mallocBlock;
+	const uint64_t step = 10 * 1000000;
+
+	sched_yield();
+	while (!__atomic_load_n(&isScrubberStopping, __ATOMIC_RELAXED)) {
+		if (ns == 0) return true;
+		uint64_t sleep = MIN(ns, step);
+		struct timespec ts = { .tv_sec = 0, .tv_nsec = sleep };
+		nanosleep(&ts, 0);
+		ns -= sleep;
 	}
+	return false;
 }
 
- 
-// Check if previous blocks are free and unify
+
+// scrubCursorNext
 //
-static void freeBlocksPrev(VGC_mallocHeader *mallocBlock)
+// Must be inside the mutex that protects the list of "cursor" (the arena mutex or shared->mutex)
+// The block after "cursor", the last block checked, or the first block of the list if cursor is 0.
+// The cursor may have been released while no lock was held: it is still in the list only if the page map
+// still has it as an MMAP of the same list, otherwise the pass ends there and 0 is returned
+//
+static VGC_mmapHeader *scrubCursorNext(VGC_mmapHeader *first, VGC_mmapHeader *cursor, VGC_mmapType type, VGC_arena *arena)
 {
-	VGC_mallocHeader *prevBlock = mallocBlock->prev;
-	if (prevBlock != 0 && prevBlock->status == VGC_MALLOC_FREE) {
-		VGC_munprotect(mallocBlock);
-		prevBlock->size += mallocBlock->size + sizeof(VGC_mallocHeader);
-		prevBlock->next = mallocBlock->next;
-		if (prevBlock->next) prevBlock->next->prev = prevBlock;
-	}
+	if (cursor == 0) return first;
+	if (vgc_pagemapGet(cursor) != cursor || cursor->type != type || cursor->arena != arena) return 0;
+	return cursor->next;
 }
 
 
-// vgc_free
-//
-// The vgc_free() function frees the memory space pointed to by ptr, which must have been returned by a previous
-// call to vgc_malloc(), vgc_calloc() or vgc_realloc().
-// Otherwise, or if vgc_free(ptr) has already been called before, undefined behavior occurs.
-// If ptr is NULL, no operation is performed.
+// scrubMmapBlock
 //
-// Returns:
-// The vgc_free() function returns no value.
+// Checks the MMAP block after "cursor" in the arena (the first one if cursor is 0), with the same locks as vgc_free()
+// The arena mutex is held only to find the block and lock it, the block can't be released while it is locked
+// Returns the block checked, the cursor of the next call, or 0 if there is no such block
 //
-ATTR_PUBLIC void vgc_free(void *ptr)
+static VGC_mmapHeader *scrubMmapBlock(VGC_arena *arena, VGC_mmapHeader *cursor)
 {
-	if (ptr == 0) {
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "ptr", "Warning", "variable points to zero", 0);
-		return;
-	}
-
-	if (!PTHREAD_mutexLock(&shared->mutex)) {
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on shared mutex", 0);
-		return;
+	if (!PTHREAD_mutexLock(&arena->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on arena mutex", 0);
+		return 0;
 	}
 
-	if (!isInMmapBlock(ptr)) {
-		if (!PTHREAD_mutexUnlock(&shared->mutex)) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock shared mutex", 0);
-		}
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "isInMmapBlock", "Error", "points outside of MMAP at", ": 0x%lx", ptr);
-		return;
+	VGC_mmapHeader *mmapBlock = scrubCursorNext(arena->mmapBlockFirst, cursor, VGC_MMAP_BLOCKS, arena);
+	bool isLocked = mmapBlock != 0 && PTHREAD_mutexLock(&mmapBlock->mutex);
+	if (mmapBlock != 0 && !isLocked) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on mmapBlock", 0);
 	}
 
-	if (shared->isMprotectEnabled) {
-		unsigned long int mask = shared->pageSize - 1;
-		ptr = (void*)((unsigned long int)ptr & ~mask);
+	if (!PTHREAD_mutexUnlock(&arena->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock arena mutex", 0);
 	}
+	if (!isLocked) return 0;
 
-	VGC_mallocHeader *mallocBlock = (VGC_mallocHeader*)((char*)ptr - sizeof(VGC_mallocHeader));
-
-	if (mallocBlock->checkStart != 0xAA || mallocBlock->checkEnd != 0xAA) {
-		if (!PTHREAD_mutexUnlock(&shared->mutex)) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock shared mutex", 0);
-		}
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "Free", "", "", "%d bytes (at 0x%lx)", mallocBlock->size, ptr);
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mallocBlock", "Error", "wrong checksum in", ": %s (at 0x%lx)", mallocBlock->checkStart != 0xAA ? "checkStart" : "checkEnd", ptr);
-		dumpMmapBlock(0, 0, "vgc_free", mallocBlock->mmapBlock, "MMAP block wrong checksum");
-		return;
+	if (!checkMmapBlock("scrubber", mmapBlock)) {
+		__atomic_add_fetch(&shared->scrubberErrors, 1, __ATOMIC_RELAXED);
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "checkMmapBlock", "Error", "found corrupted MMAP", ": 0x%lx (arena %u)", mmapBlock, arena->id);
 	}
-
-	VGC_mmapHeader *mmapBlock = mallocBlock->mmapBlock;
-	if (mmapBlock->checkStart != 0xAA || mmapBlock->checkEnd != 0xAA) {
-		if (!PTHREAD_mutexUnlock(&shared->mutex)) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock shared mutex", 0);
-		}
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "Free", "", "", "%d bytes (at 0x%lx)", mallocBlock->size, ptr);
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mmapBlock", "Error", "wrong checksum in", ": %s (at 0x%lx)", mmapBlock->checkStart != 0xAA ? "checkStart" : "checkEnd", mmapBlock);
-		dumpMmapBlock(0, 0, "vgc_free", mmapBlock, "MMAP block wrong checksum");
-		return;
+	if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
 	}
+	return mmapBlock;
+}
 
-	mmapBlock->elements--;
-	vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, __func__, "Free", "", "", "%d bytes at 0x%lx (#%u)", mallocBlock->size, ptr, mmapBlock->elements);
 
-	if (!PTHREAD_mutexLock(&mmapBlock->mutex)) {
-		if (!PTHREAD_mutexUnlock(&shared->mutex)) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock shared mutex", 0);
-		}
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on mmapBlock", ": %s", strerror(errno));
-		return;
+// scrubSlab
+//
+// Checks the canaries of the BUSY slots of the slab after "cursor" in the arena (the first one if cursor is 0)
+// The slabs have no mutex of their own, the arena mutex is held while the slab is checked
+// Returns the slab checked, the cursor of the next call, or 0 if there is no such slab
+//
+static VGC_mmapHeader *scrubSlab(VGC_arena *arena, VGC_mmapHeader *cursor)
+{
+	if (!PTHREAD_mutexLock(&arena->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on arena mutex", 0);
+		return 0;
 	}
 
-	// Free this block and any free blocks close to it to make it a bigger unified free block
-	//
-	if (!checkMmapBlock("vgc_free", mmapBlock)) {
-		if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
-		}
-		if (!PTHREAD_mutexUnlock(&shared->mutex)) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock shared mutex", 0);
-		}
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "checkMmapBlock", "Error", "The MMAP for vgc_free is unstable while freeing memory", 0);
-		return;
-	}
+	VGC_mmapHeader *slab = scrubCursorNext(arena->slabFirst, cursor, VGC_MMAP_SLAB, arena);
+	for (unsigned int slot = 0; slab != 0 && slot < slab->slabSlots; slot++) {
+		if (!slabIsCanary(slab, slot) || slabCanarySize(slab, slab->slots + slot * slab->slotSize) != 0) continue;
 
-	if (shared->isMprotectEnabled) {
-		vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, __func__, "Unprotect", "", "", "unprotect:0x%lx - free:0x%lx-0x%lx (%s) - size:%d - pid:%u", mallocBlock, ptr, (char*)ptr + mallocBlock->size, mallocBlock->status == VGC_MALLOC_FREE ? "free" : "busy", mallocBlock->size, getpid());
+		__atomic_add_fetch(&shared->scrubberErrors, 1, __ATOMIC_RELAXED);
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "slabCanarySize", "Error", "canary overwritten after the memory", ": at 0x%lx (arena %u)", slab->slots + slot * slab->slotSize, arena->id);
 	}
 
-	mallocBlock->status = VGC_MALLOC_FREE;
-	VGC_munprotect(mallocBlock);
-	freeBlocksNext(mallocBlock);
-	freeBlocksPrev(mallocBlock);
-
-	VGC_mallocHeader *first = firstMallocHeaderInMMAP(mmapBlock);
-	if (first->next == 0) {
-		// The allocated MMAP block is all free, it can be deallocated
-		//
-		if (mmapBlock->next != 0) {
-			if (!PTHREAD_mutexLock(&mmapBlock->next->mutex)) {
-				if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
-					vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
-				}
-				if (!PTHREAD_mutexUnlock(&shared->mutex)) {
-					vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock shared mutex", 0);
-				}
-				vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on mmapBlock->next", 0);
-				return;
-			}
-
-			mmapBlock->next->prev = mmapBlock->prev;
-
-			if (!PTHREAD_mutexUnlock(&mmapBlock->next->mutex)) {
-				vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock->next mutex", 0);
-			}
-		}
-
-		if (mmapBlock->prev != 0) {
-			if (!PTHREAD_mutexLock(&mmapBlock->prev->mutex)) {
-				if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
-					vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
-				}
-				if (!PTHREAD_mutexUnlock(&shared->mutex)) {
-					vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock shared mutex", 0);
-				}
-				vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on mmapBlock->prev", 0);
-				return;
-			}
-
-			mmapBlock->prev->next = mmapBlock->next;
-
-			if (!PTHREAD_mutexUnlock(&mmapBlock->prev->mutex)) {
-				vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock->prev mutex", 0);
-			}
-		}
-
-		if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
-		}
-		if (!PTHREAD_mutexDestroy(&mmapBlock->mutex)) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexDestroy", "Error", "can't destroy mmapBlock mutex", 0);
-		}
-		if (!PTHREAD_mutexattrDestroy(&mmapBlock->mutexAttr)) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexattrDestroy", "Error", "can't destroy attr mmapBlock mutex", 0);
-		}
+	if (!PTHREAD_mutexUnlock(&arena->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock arena mutex", 0);
+	}
+	return slab;
+}
 
-		freeMMAP(mmapBlock);
 
-		if (!PTHREAD_mutexUnlock(&shared->mutex)) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock shared mutex", 0);
-		}
-		return;
+// scrubLargeBlock
+//
+// Checks the large block after "cursor" (the first one if cursor is 0), a large MMAP has one or two blocks to check
+// Returns the block checked, the cursor of the next call, or 0 if there is no such block
+//
+static VGC_mmapHeader *scrubLargeBlock(VGC_mmapHeader *cursor)
+{
+	if (!PTHREAD_mutexLock(&shared->mutex)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on shared mutex", 0);
+		return 0;
 	}
 
-	if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
+	VGC_mmapHeader *mmapBlock = scrubCursorNext(shared->largeFirst, cursor, VGC_MMAP_LARGE, 0);
+	if (mmapBlock != 0 && !checkMmapBlock("scrubber", mmapBlock)) {
+		__atomic_add_fetch(&shared->scrubberErrors, 1, __ATOMIC_RELAXED);
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "checkMmapBlock", "Error", "found corrupted MMAP", ": 0x%lx (large block)", mmapBlock);
 	}
+
 	if (!PTHREAD_mutexUnlock(&shared->mutex)) {
 		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock shared mutex", 0);
 	}
+	return mmapBlock;
 }
 
 
-// vgc_calloc
-//
-// The vgc_calloc() function  allocates memory for an array of nmemb elements of size bytes each and returns a pointer to the allocated memory.
-// The memory is set to zero.
-// If nmemb or size is 0, then vgc_calloc() returns NULL.
+// scrubberMain
 //
-// Returns:
-// The vgc_calloc() function returns a pointer to the allocated memory that is suitably aligned for any kind of variable.
-// On error, this function returns NULL.
-// NULL may also be returned by a successful call to vgc_calloc() with nmemb or size equal to zero.
+// The time spent checking a block is followed by a sleep long enough to stay inside the CPU budget
 //
-ATTR_PUBLIC void *vgc_calloc(size_t nmemb, size_t size)
+static void *scrubberMain(ATTR_UNUSED void *args)
 {
-	size_t mallocSize = nmemb * size;
-	if (mallocSize == 0) {
-		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mallocSize", "Warning", "total size is zero", 0);
-		return 0;
-	}
+	vgc_isInternal = true;
+	vgc_message(VGC_MALLOC_DEBUG_LEVEL, __FILE__, __LINE__, moduleName, __func__, "Scrubber", "", "", "started (%u%% CPU)", shared->scrubberCpu);
 
-	void *ptr = vgc_malloc(mallocSize);
-	return ptr == 0 ? 0 : memset(ptr, 0, mallocSize);
+	for (;;) {
+		// Each arena has the MMAP blocks and the slabs to check, the large blocks come last
+		//
+		for (unsigned int i = 0; i < 2 * shared->arenaCount + 1; i++) {
+			for (VGC_mmapHeader *cursor = 0; ; ) {
+				uint64_t start = threadCpuNs();
+				VGC_arena *arena = &shared->arenas[i / 2];
+				cursor = i == 2 * shared->arenaCount ? scrubLargeBlock(cursor) : i % 2 == 0 ? scrubMmapBlock(arena, cursor) : scrubSlab(arena, cursor);
+				if (cursor == 0) break;
+
+				unsigned int cpu = MAX(1, MIN(100, __atomic_load_n(&shared->scrubberCpu, __ATOMIC_RELAXED)));
+				if (!scrubberSleep((threadCpuNs() - start) * (100 - cpu) / cpu)) return 0;
+			}
+		}
+
+		__atomic_add_fetch(&shared->scrubberPasses, 1, __ATOMIC_RELAXED);
+		if (!scrubberSleep(VGC_MALLOC_SCRUBBER_PAUSE_MS * 1000000ULL)) return 0;
+	}
 }
 
 
-// vgc_realloc
-//
-// The vgc_realloc() function changes the size of the memory block pointed to by ptr to size bytes.
-// The contents will be unchanged in the range from the start of the region up to the minimum of the old and new sizes.
-// If the new size is larger than the old size, the added memory will not be initialized.
-// If ptr is NULL, then the call is equivalent to vgc_malloc(size), for all values of size;
-// if size is equal to zero, and ptr is not NULL, then the call is equivalent to vgc_free(ptr).
-// Unless ptr is NULL, it must have been returned by an earlier call to vgc_malloc(), vgc_calloc() or vgc_realloc().
-// If the area pointed to was moved, a vgc_free(ptr) is done.
+// vgc_mallocScrubberUpdate
 //
-// Returns:
-// The vgc_realloc() function returns a pointer to the newly allocated memory, which is suitably aligned for any kind of variable
-// and may be different from ptr, or NULL if the request fails.
-// If size was equal to 0, NULL is returned.
-// If vgc_realloc() fails the original block is left untouched; it is not freed or moved.
+// Starts or stops the scrubber thread of this process as set in shared->isScrubberEnabled
 //
-ATTR_PUBLIC void *vgc_realloc(void *ptr, size_t size)
+bool vgc_mallocScrubberUpdate(void)
 {
-	// per una implementazione ottimale:
-	//  vedere se il blocco successivo è libero in caso di size più grande della vecchia
-	//  se size minore della vecchia il blocco viene diviso in due e il resto viene allocato come libero
-	//  copiare la vecchia memoria nella nuova se non c'è posto contiguo
-	//
-	if (size == 0) {
-		if (ptr != 0) {
-			vgc_free(ptr);
-		}
-		return 0;
-	}
+	if (!isInitialised) return true;
 
-	if (ptr == 0) return vgc_malloc(size);
+	bool isRunning = scrubberPid == getpid();
+	if (shared->isScrubberEnabled == isRunning) return true;
 
-	void *new = vgc_malloc(size);
-	if (new == 0) return 0;
+	if (isRunning) {
+		__atomic_store_n(&isScrubberStopping, true, __ATOMIC_RELAXED);
+		if (!PTHREAD_join(scrubberThread, 0)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_join", "Error", "can't stop the scrubber thread", 0);
+			return false;
+		}
+		scrubberPid = 0;
+		return true;
+	}
 
-	VGC_mallocHeader *mallocBlock = (VGC_mallocHeader*)((char*)ptr - sizeof(VGC_mallocHeader));	// Get size of currently pointed block (by "ptr" parameter)
-	size_t newSize = MIN(mallocBlock->size, size);	// Calculate the minimum of the current and old sizes
-	memcpy(new, ptr, newSize);
-	vgc_free(ptr);
-	return new;
+	__atomic_store_n(&isScrubberStopping, false, __ATOMIC_RELAXED);
+	if (!PTHREAD_create(&scrubberThread, 0, scrubberMain, 0)) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_create", "Error", "can't start the scrubber thread", 0);
+		shared->isScrubberEnabled = false;
+		return false;
+	}
+	scrubberPid = getpid();
+	return true;
 }
 
 
@@ -906,21 +4436,38 @@ ATTR_PUBLIC void vgc_mallocCheckMMAP(char *response, int size)
 	if (!PTHREAD_mutexLock(&shared->mutex)) {
 		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on shared mutex", 0);
 	}
-	for (register VGC_mmapHeader *mmapBlock = shared->mmapBlockFirst; mmapBlock != 0; mmapBlock = mmapBlock->next) {
-		if (!PTHREAD_mutexLock(&mmapBlock->mutex)) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on mmapBlock", 0);
-		}
+	for (register VGC_mmapHeader *mmapBlock = shared->largeFirst; mmapBlock != 0; mmapBlock = mmapBlock->next) {
 		if (!checkMmapBlock(str, mmapBlock)) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "Found memory problem", "Error", "MMAP memory allocation");
-		}
-		dumpMmapBlock(response, size, str, mmapBlock, "Dump MMAP memory allocation for vgc_malloc");
-		if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
-			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "Found memory problem", "Error", "MMAP memory allocation (large block)");
 		}
+		dumpMmapBlock(response, size, str, mmapBlock, "Dump MMAP memory allocation for vgc_malloc (large block)");
 	}
 	if (!PTHREAD_mutexUnlock(&shared->mutex)) {
 		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock shared mutex", 0);
 	}
+
+	for (unsigned int i = 0; i < shared->arenaCount; i++) {
+		VGC_arena *arena = &shared->arenas[i];
+		if (!PTHREAD_mutexLock(&arena->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on arena mutex", 0);
+		}
+		for (register VGC_mmapHeader *mmapBlock = arena->mmapBlockFirst; mmapBlock != 0; mmapBlock = mmapBlock->next) {
+			if (!PTHREAD_mutexLock(&mmapBlock->mutex)) {
+				vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on mmapBlock", 0);
+			}
+			if (!checkMmapBlock(str, mmapBlock)) {
+				vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, str, "Found memory problem", "Error", "MMAP memory allocation");
+			}
+			dumpMmapBlock(response, size, str, mmapBlock, "Dump MMAP memory allocation for vgc_malloc");
+			if (!PTHREAD_mutexUnlock(&mmapBlock->mutex)) {
+				vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock mmapBlock mutex", 0);
+			}
+		}
+		for (VGC_mmapHeader *slab = arena->slabFirst; slab != 0; slab = slab->next) dumpSlab(str, slab, "Dump slab for vgc_malloc");
+		if (!PTHREAD_mutexUnlock(&arena->mutex)) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock arena mutex", 0);
+		}
+	}
 }
 #endif
 #if 0
@@ -928,19 +4475,7 @@ ATTR_PUBLIC void vgc_mallocCheckMMAP(char *response, int size)
 //
 ATTR_PUBLIC bool vgc_mallocIsAllocated(void *ptr)
 {
-	if (!PTHREAD_mutexLock(&shared->mutex)) {
-		vgc_message(1, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexLock", "Error", "can't get lock on shared mutex", 0);
-		return false;
-	}
-
-	bool ret = isInMmapBlock(ptr);
-
-	if (!PTHREAD_mutexUnlock(&shared->mutex)) {
-		vgc_message(1, __FILE__, __LINE__, moduleName, __func__, "PTHREAD_mutexUnlock", "Error", "can't unlock shared mutex", 0);
-		return false;
-	}
-
-	return ret;
+	return mmapBlockOf(ptr) != 0;
 }
 
 
@@ -948,7 +4483,7 @@ ATTR_PUBLIC bool vgc_mallocIsAllocated(void *ptr)
 //
 ATTR_PUBLIC int vgc_mallocSizeMMAP(void)
 {
-	return shared->mmapBlockSize;
+	return shared->mmapBlockMaxSize;
 }
 
 
@@ -13,6 +13,15 @@ void *vgc_malloc(size_t size);
 void *vgc_calloc(size_t nmemb, size_t size);
 void *vgc_realloc(void *ptr, size_t size);
 void  vgc_free(void *ptr);
+void  vgc_free_sized(void *ptr, size_t size);
+size_t vgc_malloc_usable_size(void *ptr);
+size_t vgc_malloc_batch(size_t size, size_t n, void **ptrs);
+void  vgc_free_batch(size_t n, void **ptrs);
+void *vgc_aligned_alloc(size_t alignment, size_t size);
+int   vgc_posix_memalign(void **memptr, size_t alignment, size_t size);
+void *vgc_memalign(size_t alignment, size_t size);
+int   vgc_malloc_trim(size_t pad);
+int   vgc_mallctl(const char *name, void *oldp, const void *newp);
 
 #ifdef __cplusplus
 	}
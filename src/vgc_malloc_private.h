@@ -3,16 +3,55 @@
 //
 #pragma once
 
+#include <stdint.h>
+
 #include "vgc_pthread.h"
 
 
 // Defines
 //
-#if defined(VGC_MALLOC_MPROTECT) || defined(VGC_MALLOC_MPROTECT_PKEY)
 #define VGC_MALLOC_SYSTEM_PAGE_SIZE 4096
-#endif
 #ifdef VGC_MALLOC_STACKTRACE
-#define VGC_MALLOC_STACKTRACE_SIZE 10
+# ifndef VGC_MALLOC_STACKTRACE_SIZE
+#  define VGC_MALLOC_STACKTRACE_SIZE 10
+# endif
+#endif
+
+// Huge page size of the MMAP blocks when huge pages are enabled (see mapMMAP() in vgc_malloc.c)
+//
+#ifndef VGC_MALLOC_HUGEPAGE_SIZE
+# define VGC_MALLOC_HUGEPAGE_SIZE (2 * 1024 * 1024)
+#endif
+
+// Two level segregated fit (TLSF) free lists in each MMAP block (see sizeClass(), sizeSubclass() and freeListFind() in vgc_malloc.c)
+// FREE blocks are kept by power of two size class, first level, each split in VGC_MALLOC_FREE_SUBLISTS linear ranges, second level.
+// The first level stops at 2^48 bytes, the user address space, so that the lists fit in the page of the MMAP header with mprotect
+//
+#define VGC_MALLOC_FREE_LISTS 48
+#define VGC_MALLOC_FREE_SUBLISTS_LOG2 3	// At most 3, the second level map of a class is a uint8_t
+#define VGC_MALLOC_FREE_SUBLISTS (1 << VGC_MALLOC_FREE_SUBLISTS_LOG2)
+
+// Alignment of the memory without mprotect, as for the C library allocator any type fits in it (max_align_t)
+// The sizes are rounded up to it and the headers are multiples of it
+//
+#define VGC_MALLOC_ALIGNMENT 16
+
+// Slabs: pages carved in equal slots for the blocks up to VGC_MALLOC_SLAB_MAX_SIZE bytes, without mprotect (see slabAlloc() in vgc_malloc.c)
+// Sizes up to 128 bytes have a class every 16 bytes, then four classes for each power of two
+//
+#define VGC_MALLOC_SLAB_MAX_SIZE 1024
+#define VGC_MALLOC_SLAB_CLASSES  20
+#ifndef VGC_MALLOC_SLAB_SIZE
+# define VGC_MALLOC_SLAB_SIZE (64 * 1024)
+#endif
+#define VGC_MALLOC_SLAB_MAP_WORDS (VGC_MALLOC_SLAB_SIZE / VGC_MALLOC_ALIGNMENT / 64)
+#define VGC_MALLOC_SLAB_CANARY_SIZE VGC_MALLOC_ALIGNMENT	// Bytes at least after the memory of the slots taken on the checked paths
+
+// Maximum number of arenas, each with its own lock and list of MMAP blocks
+// The arenas used are one per online CPU up to this maximum
+//
+#ifndef VGC_MALLOC_ARENAS
+# define VGC_MALLOC_ARENAS 32
 #endif
 
 
@@ -20,27 +59,92 @@
 //
 typedef enum {
 	VGC_MALLOC_FREE,
-	VGC_MALLOC_BUSY
+	VGC_MALLOC_BUSY,
+	VGC_MALLOC_CACHED	// Freed by the user but kept in a thread cache or in the remote frees of its arena, still accounted as BUSY in its MMAP
 } VGC_mallocStatus;
 
 
+// MMAP block type
+//
+typedef enum {
+	VGC_MMAP_BLOCKS,	// Malloc blocks of any size taken from the free lists, the MMAP belongs to an arena
+	VGC_MMAP_LARGE,		// A single malloc block too big for VGC_MMAP_BLOCKS, mapped on its own
+	VGC_MMAP_SLAB		// Slots of one slab class, without malloc headers, the MMAP belongs to an arena
+} VGC_mmapType;
+
+
+// Pages backing a VGC_MMAP_BLOCKS block
+//
+typedef enum {
+	VGC_MMAP_PAGES_SYSTEM,	// _SC_PAGE_SIZE pages
+	VGC_MMAP_PAGES_THP,	// Aligned to a huge page and marked with MADV_HUGEPAGE, the kernel may use transparent huge pages
+	VGC_MMAP_PAGES_HUGETLB	// Huge pages reserved in the system (MAP_HUGETLB)
+} VGC_mmapPages;
+
+
+// Allocation path used by vgc_malloc() and vgc_free(), each one compiled separately with only its checks
+//
+typedef enum {
+	VGC_MALLOC_PATH_LEAN,	// No markers checked, no stack traces and no leak report
+	VGC_MALLOC_PATH_LEAK,	// Markers checked, stack traces saved and leaks reported at exit
+	VGC_MALLOC_PATH_FULL,	// As VGC_MALLOC_PATH_LEAK and the whole MMAP block checked at each operation, with debug messages
+	VGC_MALLOC_PATH_ALL
+} VGC_mallocPath;
+
+
+// Allocation engine: how the blocks of the VGC_MMAP_BLOCKS are found, split and unified (see mallocEngines in vgc_malloc.c)
+//
+typedef enum {
+	VGC_MALLOC_ENGINE_FIT,		// Segregated fit, the FREE blocks are unified at each free
+	VGC_MALLOC_ENGINE_CLASS,	// Sizes rounded up to their size class, the FREE blocks are unified lazily (see classFind)
+	VGC_MALLOC_ENGINE_BUDDY,	// Blocks of a power of two bytes, header included, unified with their buddy only
+	VGC_MALLOC_ENGINE_ALL
+} VGC_mallocEngineType;
+
+
 // MMAP header block
 //
-typedef struct VGC_mmapHeader {
+typedef struct __attribute__((aligned(VGC_MALLOC_ALIGNMENT))) VGC_mmapHeader {
 #if defined(VGC_MALLOC_MPROTECT) || defined(VGC_MALLOC_MPROTECT_PKEY)
 	union {
 		char                           alignBuffer[VGC_MALLOC_SYSTEM_PAGE_SIZE];
 		struct {
 #endif
 			unsigned char          checkStart;
+			VGC_mmapType           type;
+			VGC_mmapPages          pages;
 			size_t                 size;
 			size_t                 maxSize;
 			size_t                 free;
 			size_t                 elements;	// Number of malloc's active on this MMAP
-			pthread_mutex_t        mutex;
+			VGC_mutex              mutex;
 			pthread_mutexattr_t    mutexAttr;
 			struct VGC_mmapHeader *prev;
 			struct VGC_mmapHeader *next;
+			struct VGC_arena      *arena;		// Arena owning this MMAP, 0 for VGC_MMAP_LARGE
+			uint64_t               emptySince;	// Time in ms when the last block was freed, 0 if in use
+			bool                   isPurged;	// The pages of the empty MMAP were given back to the kernel
+			size_t                 dirty;		// Bytes freed since the last purge of the FREE blocks
+			unsigned int           checks;		// Blocks checked since the last full check of the MMAP (see checkMallocBlock)
+			size_t                 unmerged;	// Bytes freed and not yet unified with the FREE blocks close to them (class engine)
+			union {
+				struct {	// VGC_MMAP_BLOCKS
+					uint64_t               freeListsMap;					// Bit n is set if a list of freeLists[n] is not empty
+					uint8_t                freeSublistsMap[VGC_MALLOC_FREE_LISTS];		// Bit m of n is set if freeLists[n][m] is not empty
+					struct VGC_mallocHeader *freeLists[VGC_MALLOC_FREE_LISTS][VGC_MALLOC_FREE_SUBLISTS];	// FREE blocks by size class
+				};
+				struct {	// VGC_MMAP_SLAB, elements is the number of BUSY slots
+					unsigned int           slabClass;
+					unsigned int           slabSlots;
+					size_t                 slotSize;
+					char                  *slots;			// First slot
+					void                 **callers;			// Side table with the caller of each BUSY slot for the leak report, or 0
+					struct VGC_mmapHeader *slabPrev;		// Links in the list of the slabs of the class with FREE slots
+					struct VGC_mmapHeader *slabNext;
+					uint64_t               slabMap[VGC_MALLOC_SLAB_MAP_WORDS];	// Bit n is set if slot n is FREE
+					uint64_t               canaryMap[VGC_MALLOC_SLAB_MAP_WORDS];	// Bit n is set if slot n ends with a canary
+				};
+			};
 			unsigned char          checkEnd;
 #if defined(VGC_MALLOC_MPROTECT) || defined(VGC_MALLOC_MPROTECT_PKEY)
 		};
@@ -48,10 +152,14 @@ typedef struct VGC_mmapHeader {
 #endif
 } VGC_mmapHeader;
 
+#if defined(VGC_MALLOC_MPROTECT) || defined(VGC_MALLOC_MPROTECT_PKEY)
+_Static_assert(sizeof(VGC_mmapHeader) == VGC_MALLOC_SYSTEM_PAGE_SIZE, "the MMAP header must fit in one page to be protected");
+#endif
+
 
 // Malloc header block
 //
-typedef struct VGC_mallocHeader {
+typedef struct __attribute__((aligned(VGC_MALLOC_ALIGNMENT))) VGC_mallocHeader {
 #if defined(VGC_MALLOC_MPROTECT) || defined(VGC_MALLOC_MPROTECT_PKEY)
 	union {
 		char                             alignBuffer[VGC_MALLOC_SYSTEM_PAGE_SIZE * 2];
@@ -67,6 +175,9 @@ typedef struct VGC_mallocHeader {
 			struct VGC_mmapHeader   *mmapBlock;
 			struct VGC_mallocHeader *prev;
 			struct VGC_mallocHeader *next;
+			struct VGC_mallocHeader *freePrev;	// Links in the free list of the MMAP, valid only when FREE
+			struct VGC_mallocHeader *freeNext;
+			bool                     isZero;	// The memory was never written since the MMAP was created or its pages were purged
 			unsigned char            checkEnd;
 #ifdef VGC_MALLOC_STACKTRACE
 			void			*btArray[VGC_MALLOC_STACKTRACE_SIZE];
@@ -78,6 +189,33 @@ typedef struct VGC_mallocHeader {
 #endif
 } VGC_mallocHeader;
 
+#if defined(VGC_MALLOC_MPROTECT) || defined(VGC_MALLOC_MPROTECT_PKEY)
+_Static_assert(sizeof(VGC_mallocHeader) == VGC_MALLOC_SYSTEM_PAGE_SIZE * 2, "the malloc header must fit in its protected page and the next one");
+#endif
+
+// Offset of the first malloc header in an MMAP: its memory starts at a page, so the buddy blocks are aligned to their size
+// up to a page (see firstMallocHeaderInMMAP() in vgc_malloc.c). With mprotect the headers are whole pages and nothing is left
+//
+#define VGC_MALLOC_MMAP_FIRST ((sizeof(VGC_mmapHeader) + sizeof(VGC_mallocHeader) + VGC_MALLOC_SYSTEM_PAGE_SIZE - 1) / VGC_MALLOC_SYSTEM_PAGE_SIZE * VGC_MALLOC_SYSTEM_PAGE_SIZE - sizeof(VGC_mallocHeader))
+
+
+// Arena: independent list of MMAP blocks
+// Lock order is arena mutex, then mmapBlock mutex
+//
+typedef struct VGC_arena {
+	VGC_mutex             mutex;
+	pthread_mutexattr_t   mutexAttr;
+	VGC_mmapHeader       *mmapBlockFirst;
+	int                   mmapBlockCount;
+	int                   emptyCount;		// MMAP blocks kept with no malloc's active
+	size_t                mmapBlockSize;		// Size of the next MMAP block, doubled at each new block up to shared->mmapBlockMaxSize
+	uint64_t              decayNext;		// Time in ms of the next check of the empty MMAP blocks
+	VGC_mmapHeader       *slabFirst;		// List of the VGC_MMAP_SLAB blocks
+	VGC_mmapHeader       *slabFree[VGC_MALLOC_SLAB_CLASSES];	// Slabs of each class with FREE slots
+	void                 *remoteFree;		// Blocks freed by the threads of other arenas, lock free (see remoteFreePush)
+	unsigned int          id;
+} VGC_arena;
+
 
 // All the malloc management data is here
 //
@@ -94,14 +232,39 @@ typedef struct VGC_mallocDebugChild {
 
 typedef struct VGC_shared {
 	pid_t		      pid;
-	pthread_mutex_t       mutex;
+	VGC_mutex             mutex;
 	pthread_mutexattr_t   mutexAttr;
 	size_t                pageSize;
-	VGC_mmapHeader       *mmapBlockFirst;
-	int                   mmapBlockCount;
-	size_t		      mmapBlockSize;		// Number of pages of 4kB (_SC_PAGE_SIZE) to allocate at each call of MMAP
-#if defined(VGC_MALLOC_MPROTECT) || defined(VGC_MALLOC_MPROTECT_PKEY)
+	VGC_arena             arenas[VGC_MALLOC_ARENAS];
+	unsigned int          arenaCount;		// Number of arenas in use
+	int                   mmapBlockCount;		// Total in all the arenas
+	VGC_mmapHeader       *largeFirst;		// List of VGC_MMAP_LARGE blocks, protected by mutex
+	size_t		      mmapBlockMinSize;		// Size of the first MMAP block of each arena
+	size_t		      mmapBlockMaxSize;		// Size the MMAP blocks of an arena grow up to, bigger requests are VGC_MMAP_LARGE blocks
+	size_t                hugePageSize;		// Huge page size for the MMAP blocks, 0 if they use the system pages
 	bool		      isMprotectEnabled;
+
+	// Settings changed with VGC_MALLOC_CONF and vgc_mallctl(), the sizes above are derived from them (see vgc_mallctl.c)
+	//
+	size_t                mmapMinPages;
+	size_t                mmapPages;
+	bool                  isHugepagesEnabled;
+	bool                  isStacktraceEnabled;
+	int                   stacktraceSize;
+	VGC_mallocPath        path;
+	VGC_mallocEngineType  engine;
+	VGC_mutexType         mutexType;		// Kind of the mutexes, fixed at start up, VGC_MUTEX_ALL until then if not set (see mutexType)
+	unsigned int          checkInterval;		// The whole MMAP is checked every checkInterval operations on it, 0 never
+	bool                  isScrubberEnabled;
+	unsigned int          scrubberCpu;		// Percentage of a CPU the scrubber thread can use
+	size_t                scrubberPasses;		// Complete checks of all the MMAP blocks done by the scrubber
+	size_t                scrubberErrors;		// MMAP blocks found corrupted by the scrubber
+	bool                  isShared;			// The memory is shared with the processes forked later, otherwise fork() copies it
+	bool                  isSlabEnabled;		// The small blocks are slab slots, without mprotect
+	int                   slabCount;		// VGC_MMAP_SLAB blocks in all the arenas
+	bool                  isRemoteFreeEnabled;	// The blocks freed by the threads of other arenas go to their remote frees
+	uintptr_t             remoteFreeKey;		// Marks the blocks in the remote frees (see remoteFreePush)
+#if defined(VGC_MALLOC_MPROTECT) || defined(VGC_MALLOC_MPROTECT_PKEY)
 #  if defined(VGC_MALLOC_MPROTECT_MP)
 	int                   maxProcesses;
 	bool                  isFather;
@@ -109,3 +272,22 @@ typedef struct VGC_shared {
 #  endif
 #endif
 } VGC_shared;
+
+
+// Starts or stops the scrubber thread as set in shared->isScrubberEnabled (vgc_malloc.c)
+//
+bool vgc_mallocScrubberUpdate(void);
+
+// True while the thread runs the library's own work, where the C library allocations (printf, popen, backtrace)
+// must not come back to vgc_malloc() when the standard functions are interposed (vgc_preload.c)
+//
+extern __thread bool vgc_isInternal __attribute__((tls_model("initial-exec")));
+
+// Settings applied before VGC_MALLOC_CONF, a library built on vgc-malloc sets them before it is initialised (vgc_preload.c)
+//
+extern const char *vgc_mallocConf;
+
+// The library is loaded by libvgcpreload.so: the program owns stdout and exits without freeing its memory,
+// so there are no banners and no cleanup at exit (vgc_preload.c)
+//
+extern bool vgc_isPreloaded;
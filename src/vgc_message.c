@@ -50,6 +50,20 @@ ATTR_PUBLIC void vgc_messageInit(void)
 }
 
 
+// Messages with a level up to this are printed
+//
+ATTR_PUBLIC int vgc_messageGetLevel(void)
+{
+	return messageLevel;
+}
+
+
+ATTR_PUBLIC void vgc_messageSetLevel(int level)
+{
+	messageLevel = level;
+}
+
+
 
 static const char *dots(const char *string, Type type, const char *status)
 {
@@ -23,3 +23,5 @@ extern const char *const DASHES;
 //
 void vgc_message(const int level, char *file, int line, const char *moduleName, const char *functionName, const char *title, const char *subtitle, const char *status, const char *fmt, ...);
 void vgc_messageInit(void);
+int  vgc_messageGetLevel(void);
+void vgc_messageSetLevel(int level);
@@ -74,6 +74,7 @@ bool VGC_mprotect(VGC_mallocHeader *header)
 
 	const int prot = PROT_NONE;
 
+	if (!shared->isMprotectEnabled) return true;
 	if (!do_mprotect(header->protect, shared->pageSize, prot)) return false;
 #ifdef VGC_MALLOC_MPROTECT_MP
 	mprotectDistribute(header, prot);
@@ -90,6 +91,7 @@ bool VGC_munprotect(VGC_mallocHeader *header)
 
 	const int prot = PROT_READ | PROT_WRITE;
 
+	if (!shared->isMprotectEnabled) return true;
 	if (!do_mprotect(header->protect, shared->pageSize, prot)) return false;
 #ifdef VGC_MALLOC_MPROTECT_MP
 	mprotectDistribute(header, prot);
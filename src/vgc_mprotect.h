@@ -3,12 +3,16 @@
 //
 #pragma once
 
+#include "vgc_common.h"
 #include "vgc_malloc_private.h"
 
 
 #if defined(VGC_MALLOC_MPROTECT) || defined(VGC_MALLOC_MPROTECT_PKEY)
 bool VGC_mprotect(VGC_mallocHeader *header);
 bool VGC_munprotect(VGC_mallocHeader *header);
+#else
+static inline bool VGC_mprotect(ATTR_UNUSED VGC_mallocHeader *header)   { return true; }
+static inline bool VGC_munprotect(ATTR_UNUSED VGC_mallocHeader *header) { return true; }
 #endif
 
 
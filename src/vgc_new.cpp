@@ -15,3 +15,11 @@ void operator delete(void* ptr) noexcept
 {
 	vgc::vgc_free(ptr);
 }
+
+
+// Sized delete: the compiler passes the size of the object (see vgc_free_sized)
+//
+void operator delete(void* ptr, std::size_t size) noexcept
+{
+	vgc::vgc_free_sized(ptr, size);
+}
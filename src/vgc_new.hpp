@@ -3,3 +3,4 @@
 
 void* operator new(std::size_t size);
 void  operator delete(void* ptr) noexcept;
+void  operator delete(void* ptr, std::size_t size) noexcept;
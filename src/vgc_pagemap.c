@@ -0,0 +1,159 @@
+//
+// Copyright (C) 2024 by Vincenzo Capuano
+//
+
+// Page map: three levels radix tree from the address of a page to the MMAP block owning it
+//
+// The lookup takes no lock: the nodes are created once and never released, the entries are written
+// with release semantics when an MMAP is created or unmapped (inside the mutex of its arena)
+// and read with acquire semantics.
+// The map is private to the process, like the addresses it translates.
+//
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "vgc_message.h"
+#include "vgc_pagemap.h"
+
+
+static const char *moduleName = "VGC-MALLOC-PAGEMAP";
+
+// Bits of the user space addresses (x86_64 and aarch64 with 4 levels page tables)
+// The page number is split in root, mid and leaf indexes, the root takes the bits left
+//
+#define PAGEMAP_ADDRESS_BITS 48
+#define PAGEMAP_LEAF_BITS    12
+#define PAGEMAP_MID_BITS     12
+
+typedef struct PagemapLeaf {
+	VGC_mmapHeader *mmapBlock[1 << PAGEMAP_LEAF_BITS];
+} PagemapLeaf;
+
+typedef struct PagemapMid {
+	PagemapLeaf *leaf[1 << PAGEMAP_MID_BITS];
+} PagemapMid;
+
+static PagemapMid  **root = 0;
+static size_t        rootSize = 0;	// Number of entries in root
+static unsigned int  pageShift = 0;
+
+
+// allocNode
+//
+// Returns a zeroed node
+//
+static void *allocNode(size_t size)
+{
+	void *node = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (node == MAP_FAILED) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "mmap", "Error", "can't allocate page map node", ": %s", strerror(errno));
+		return 0;
+	}
+	return node;
+}
+
+
+// getNode
+//
+// Returns the node in *slot, creating it if it doesn't exist
+// Two threads may create the same node at the same time, the loser releases its own
+//
+static void *getNode(void **slot, size_t size)
+{
+	void *node = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (node != 0) return node;
+
+	void *new = allocNode(size);
+	if (new == 0) return 0;
+
+	if (__atomic_compare_exchange_n(slot, &node, new, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return new;
+
+	if (munmap(new, size) == -1) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "munmap", "Error", "unmapping page map node", ": %s", strerror(errno));
+	}
+	return node;
+}
+
+
+// getEntry
+//
+// Returns the entry for the page of the address, creating the nodes on the path if "create" is true
+//
+static VGC_mmapHeader **getEntry(uintptr_t address, bool create)
+{
+	uintptr_t page = address >> pageShift;
+	size_t    rootIndex = page >> (PAGEMAP_MID_BITS + PAGEMAP_LEAF_BITS);
+	size_t    midIndex = (page >> PAGEMAP_LEAF_BITS) & ((1 << PAGEMAP_MID_BITS) - 1);
+	size_t    leafIndex = page & ((1 << PAGEMAP_LEAF_BITS) - 1);
+
+	if (rootIndex >= rootSize) return 0;
+
+	PagemapMid *mid = create ? getNode((void**)&root[rootIndex], sizeof(PagemapMid)) : __atomic_load_n(&root[rootIndex], __ATOMIC_ACQUIRE);
+	if (mid == 0) return 0;
+
+	PagemapLeaf *leaf = create ? getNode((void**)&mid->leaf[midIndex], sizeof(PagemapLeaf)) : __atomic_load_n(&mid->leaf[midIndex], __ATOMIC_ACQUIRE);
+	if (leaf == 0) return 0;
+
+	return &leaf->mmapBlock[leafIndex];
+}
+
+
+// vgc_pagemapSet
+//
+// Map all the pages in [start, start + size) to mmapBlock
+//
+bool vgc_pagemapSet(void *start, size_t size, VGC_mmapHeader *mmapBlock)
+{
+	for (uintptr_t address = (uintptr_t)start; address < (uintptr_t)start + size; address += (uintptr_t)1 << pageShift) {
+		VGC_mmapHeader **entry = getEntry(address, true);
+		if (entry == 0) {
+			vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "getEntry", "Error", "can't map address", ": 0x%lx", address);
+			vgc_pagemapClear(start, address - (uintptr_t)start);
+			return false;
+		}
+		__atomic_store_n(entry, mmapBlock, __ATOMIC_RELEASE);
+	}
+	return true;
+}
+
+
+// vgc_pagemapClear
+//
+// Unmap all the pages in [start, start + size), the nodes are kept for the next MMAP blocks
+//
+void vgc_pagemapClear(void *start, size_t size)
+{
+	for (uintptr_t address = (uintptr_t)start; address < (uintptr_t)start + size; address += (uintptr_t)1 << pageShift) {
+		VGC_mmapHeader **entry = getEntry(address, false);
+		if (entry != 0) __atomic_store_n(entry, 0, __ATOMIC_RELEASE);
+	}
+}
+
+
+// vgc_pagemapGet
+//
+// Returns the MMAP block owning the address or 0 if it isn't in any MMAP block
+//
+VGC_mmapHeader *vgc_pagemapGet(const void *ptr)
+{
+	VGC_mmapHeader **entry = getEntry((uintptr_t)ptr, false);
+	return entry == 0 ? 0 : __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+}
+
+
+// vgc_pagemapInit
+//
+bool vgc_pagemapInit(size_t pageSize)
+{
+	pageShift = __builtin_ctzl(pageSize);
+	rootSize = (size_t)1 << (PAGEMAP_ADDRESS_BITS - pageShift - PAGEMAP_MID_BITS - PAGEMAP_LEAF_BITS);
+
+	root = allocNode(rootSize * sizeof(PagemapMid*));
+	if (root == 0) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "allocNode", "Fatal error", "can't create page map", 0);
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,15 @@
+//
+// Copyright (C) 2024 by Vincenzo Capuano
+//
+#pragma once
+
+#include "vgc_common.h"
+#include "vgc_malloc_private.h"
+
+
+// Functions
+//
+bool            vgc_pagemapInit(size_t pageSize);
+bool            vgc_pagemapSet(void *start, size_t size, VGC_mmapHeader *mmapBlock);
+void            vgc_pagemapClear(void *start, size_t size);
+VGC_mmapHeader *vgc_pagemapGet(const void *ptr);
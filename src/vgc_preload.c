@@ -0,0 +1,349 @@
+//
+// Copyright (C) 2024 by Vincenzo Capuano
+//
+
+// Interposer of the standard allocation functions: LD_PRELOAD=libvgcpreload.so runs an unmodified program on vgc-malloc
+//
+// The memory of the program comes from vgc_malloc() and the other vgc functions.
+// The allocations of the library itself (printf of the messages, popen and backtrace of the stack traces, the scrubber thread)
+// and those made before it is initialised go to the allocator of the C library, found with dlsym(RTLD_NEXT).
+// dlsym() allocates too: while it runs the memory comes from a static bootstrap buffer that is never given back.
+// free() and realloc() send each pointer to its owner: the bootstrap buffer, vgc-malloc (found in the page map) or the C library.
+// Programs expect fork() to copy the memory, the setting shared is false unless VGC_MALLOC_CONF sets it.
+// The output of the program is its own: the banners are not printed and there is no leak report at exit.
+//
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "vgc_common.h"
+#include "vgc_pagemap.h"
+#include "vgc_malloc_private.h"
+#include "vgc_malloc.h"
+
+// Size of the bootstrap buffer, dlsym() only needs a few hundred bytes
+//
+#ifndef VGC_PRELOAD_BOOTSTRAP_SIZE
+#define VGC_PRELOAD_BOOTSTRAP_SIZE (64 * 1024)
+#endif
+
+#define BOOTSTRAP_ALIGNMENT VGC_MALLOC_ALIGNMENT
+
+
+extern VGC_shared *shared;
+
+// Functions of the C library
+//
+typedef struct RealFunctions {
+	void  *(*malloc)(size_t size);
+	void   (*free)(void *ptr);
+	void  *(*calloc)(size_t nmemb, size_t size);
+	void  *(*realloc)(void *ptr, size_t size);
+	void  *(*memalign)(size_t alignment, size_t size);
+	size_t (*malloc_usable_size)(void *ptr);
+} RealFunctions;
+
+static RealFunctions real;
+static bool          isRealResolved = false;
+
+static __thread bool isResolving __attribute__((tls_model("initial-exec"))) = false;
+
+static char   bootstrap[VGC_PRELOAD_BOOTSTRAP_SIZE] __attribute__((aligned(BOOTSTRAP_ALIGNMENT)));
+static size_t bootstrapUsed = 0;
+
+
+// preloadInit
+//
+// Runs before the constructor of vgc_malloc.c, that has no priority
+//
+static void __attribute__ ((constructor(101))) preloadInit(void)
+{
+	vgc_isPreloaded = true;
+	vgc_mallocConf = "shared:false";
+}
+
+
+// resolveReal
+//
+// Finds the functions of the C library, the allocations of dlsym() meanwhile come from the bootstrap buffer
+// Threads resolving at the same time find the same functions
+//
+static void resolveReal(void)
+{
+	if (__atomic_load_n(&isRealResolved, __ATOMIC_ACQUIRE)) return;
+
+	isResolving = true;
+	real.malloc             = dlsym(RTLD_NEXT, "malloc");
+	real.free               = dlsym(RTLD_NEXT, "free");
+	real.calloc             = dlsym(RTLD_NEXT, "calloc");
+	real.realloc            = dlsym(RTLD_NEXT, "realloc");
+	real.memalign           = dlsym(RTLD_NEXT, "memalign");
+	real.malloc_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+	isResolving = false;
+
+	__atomic_store_n(&isRealResolved, true, __ATOMIC_RELEASE);
+}
+
+
+// bootstrapAlloc
+//
+// Memory from the bootstrap buffer, each block starts with its size
+// The buffer is zero and never reused, so the memory is zero too
+//
+static void *bootstrapAlloc(size_t size)
+{
+	size_t blockSize = BOOTSTRAP_ALIGNMENT + roundup(size, BOOTSTRAP_ALIGNMENT);
+	size_t offset = __atomic_fetch_add(&bootstrapUsed, blockSize, __ATOMIC_RELAXED);
+	if (offset + blockSize > sizeof(bootstrap)) {
+		errno = ENOMEM;
+		return 0;
+	}
+
+	*(size_t*)&bootstrap[offset] = size;
+	return &bootstrap[offset + BOOTSTRAP_ALIGNMENT];
+}
+
+
+// isBootstrap
+//
+static inline bool isBootstrap(void *ptr)
+{
+	return (char*)ptr >= bootstrap && (char*)ptr < bootstrap + sizeof(bootstrap);
+}
+
+
+// bootstrapSize
+//
+static inline size_t bootstrapSize(void *ptr)
+{
+	return *(size_t*)((char*)ptr - BOOTSTRAP_ALIGNMENT);
+}
+
+
+// isVgcReady
+//
+// vgc-malloc serves the calling thread: it is initialised (shared->pid is set last) and the thread isn't inside it
+//
+static inline bool isVgcReady(void)
+{
+	return !vgc_isInternal && shared != 0 && shared->pid != 0;
+}
+
+
+// isVgc
+//
+// The memory was allocated by vgc-malloc
+//
+static inline bool isVgc(void *ptr)
+{
+	return vgc_pagemapGet(ptr) != 0;
+}
+
+
+// isTooBig
+//
+// The size can't be rounded to VGC_MALLOC_ALIGNMENT, the request fails with ENOMEM
+//
+static inline bool isTooBig(size_t size)
+{
+	return size > SIZE_MAX - VGC_MALLOC_ALIGNMENT;
+}
+
+
+// preloadSize
+//
+// Size given to vgc-malloc: sizes of 0 get a block too, programs take NULL as out of memory.
+// The size is rounded to VGC_MALLOC_ALIGNMENT: with mprotect the memory ends at the end of a page
+// and it is aligned only so, overflows smaller than the rounding are not caught.
+// The sizes too big to be rounded are rejected before (see isTooBig)
+//
+static inline size_t preloadSize(size_t size)
+{
+	return roundup(MAX(size, 1), VGC_MALLOC_ALIGNMENT);
+}
+
+
+// malloc
+//
+ATTR_PUBLIC void *malloc(size_t size)
+{
+	if (isResolving) return bootstrapAlloc(size);
+	if (!isVgcReady()) {
+		resolveReal();
+		return real.malloc(size);
+	}
+	if (isTooBig(size)) {
+		errno = ENOMEM;
+		return 0;
+	}
+
+	vgc_isInternal = true;
+	void *memory = vgc_malloc(preloadSize(size));
+	vgc_isInternal = false;
+
+	if (memory == 0) errno = ENOMEM;
+	return memory;
+}
+
+
+// free
+//
+// Blocks freed once vgc-malloc is cleaned up are left as they are
+//
+ATTR_PUBLIC void free(void *ptr)
+{
+	if (ptr == 0 || isBootstrap(ptr)) return;
+	if (!isVgc(ptr)) {
+		resolveReal();
+		real.free(ptr);
+		return;
+	}
+	if (shared == 0) return;
+
+	bool isInternal = vgc_isInternal;
+	vgc_isInternal = true;
+	vgc_free(ptr);
+	vgc_isInternal = isInternal;
+}
+
+
+// calloc
+//
+ATTR_PUBLIC void *calloc(size_t nmemb, size_t size)
+{
+	size_t callocSize;
+	if (__builtin_mul_overflow(nmemb, size, &callocSize)) {
+		errno = ENOMEM;
+		return 0;
+	}
+
+	if (isResolving) return bootstrapAlloc(callocSize);
+	if (!isVgcReady()) {
+		resolveReal();
+		return real.calloc(nmemb, size);
+	}
+	if (isTooBig(callocSize)) {
+		errno = ENOMEM;
+		return 0;
+	}
+
+	vgc_isInternal = true;
+	void *memory = vgc_calloc(1, preloadSize(callocSize));
+	vgc_isInternal = false;
+
+	if (memory == 0) errno = ENOMEM;
+	return memory;
+}
+
+
+// realloc
+//
+// Each block is resized by its owner, blocks of the bootstrap buffer are copied to a new block
+//
+ATTR_PUBLIC void *realloc(void *ptr, size_t size)
+{
+	if (ptr == 0) return malloc(size);
+
+	if (isBootstrap(ptr)) {
+		void *memory = malloc(size);
+		if (memory != 0) memcpy(memory, ptr, MIN(size, bootstrapSize(ptr)));
+		return memory;
+	}
+
+	if (!isVgc(ptr)) {
+		resolveReal();
+		return real.realloc(ptr, size);
+	}
+	if (shared == 0 || isTooBig(size)) {
+		errno = ENOMEM;
+		return 0;
+	}
+
+	bool isInternal = vgc_isInternal;
+	vgc_isInternal = true;
+	void *memory = vgc_realloc(ptr, size == 0 ? 0 : preloadSize(size));
+	vgc_isInternal = isInternal;
+
+	if (memory == 0 && size != 0) errno = ENOMEM;
+	return memory;
+}
+
+
+// memalign
+//
+ATTR_PUBLIC void *memalign(size_t alignment, size_t size)
+{
+	if (isResolving) {
+		if (alignment > BOOTSTRAP_ALIGNMENT) {
+			errno = ENOMEM;
+			return 0;
+		}
+		return bootstrapAlloc(size);
+	}
+	if (!isVgcReady()) {
+		resolveReal();
+		return real.memalign(alignment, size);
+	}
+	if (isTooBig(size)) {
+		errno = ENOMEM;
+		return 0;
+	}
+
+	vgc_isInternal = true;
+	void *memory = vgc_memalign(alignment, preloadSize(size));
+	vgc_isInternal = false;
+	return memory;
+}
+
+
+// aligned_alloc
+//
+ATTR_PUBLIC void *aligned_alloc(size_t alignment, size_t size)
+{
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+		errno = EINVAL;
+		return 0;
+	}
+	return memalign(alignment, size);
+}
+
+
+// posix_memalign
+//
+ATTR_PUBLIC int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) return EINVAL;
+
+	int   errnoSaved = errno;
+	void *memory = memalign(alignment, size);
+	if (memory == 0) {
+		int status = errno;
+		errno = errnoSaved;
+		return status;
+	}
+
+	*memptr = memory;
+	return 0;
+}
+
+
+// malloc_usable_size
+//
+ATTR_PUBLIC size_t malloc_usable_size(void *ptr)
+{
+	if (ptr == 0) return 0;
+	if (isBootstrap(ptr)) return bootstrapSize(ptr);
+	if (!isVgc(ptr)) {
+		resolveReal();
+		return real.malloc_usable_size(ptr);
+	}
+	if (shared == 0) return 0;
+
+	bool isInternal = vgc_isInternal;
+	vgc_isInternal = true;
+	size_t size = vgc_malloc_usable_size(ptr);
+	vgc_isInternal = isInternal;
+	return size;
+}
@@ -4,18 +4,140 @@
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/param.h>
+#include <sys/syscall.h>
 
 #include "vgc_common.h"
 #include "vgc_message.h"
 #include "vgc_pthread.h"
 
 
+// Most spins of a VGC_MUTEX_FUTEX mutex before waiting on the futex
+//
+#ifndef VGC_MUTEX_SPIN_MAX
+# define VGC_MUTEX_SPIN_MAX 100
+#endif
+
 static const char *moduleName = "PTHREAD";
 
+// Set by PTHREAD_mutexSetType() for the mutexes initialised from then on
+//
+static VGC_mutexType mutexType = VGC_MUTEX_PTHREAD;
+static int           mutexFlags = FUTEX_PRIVATE_FLAG;
+static int           mutexSpinMax = VGC_MUTEX_SPIN_MAX;
+
+static __thread pid_t threadId = 0;
+
+
+// Futex mutexes
+//
+// The uncontended lock and unlock are a single atomic operation each, without a system call.
+// A contended lock spins while the owner is likely to unlock soon: up to twice the spins that were needed by the last locks,
+// then it waits on the futex. The state is 2 while there may be waiters, the unlock wakes one of them.
+// The owner is kept to report a relock (EDEADLK) and an unlock by another thread (EPERM) as PTHREAD_MUTEX_ERRORCHECK does.
+// A futex mutex is not robust: if its owner dies it stays locked
+//
+
+// currentThreadId
+//
+// The thread id is read once for each thread, the child of a fork reads its own (see PTHREAD_mutexSetType)
+//
+static inline pid_t currentThreadId(void)
+{
+	if (threadId == 0) threadId = syscall(SYS_gettid);
+	return threadId;
+}
+
+static void resetThreadId(void) { threadId = 0; }
+
+
+static bool futexLock(VGC_mutex *mutex)
+{
+	pid_t self = currentThreadId();
+	if (__atomic_load_n(&mutex->futex.owner, __ATOMIC_RELAXED) == self) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "futex", "Error", "status EDEADLK", 0);
+		return false;
+	}
+
+	uint32_t state = 0;
+	if (!__atomic_compare_exchange_n(&mutex->futex.state, &state, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		int  spins = __atomic_load_n(&mutex->futex.spins, __ATOMIC_RELAXED);
+		int  spinMax = MIN(mutexSpinMax, 2 * spins + 10);
+		int  spin = 0;
+		bool isLocked = false;
+		while (!isLocked && spin < spinMax) {
+			spin++;
+			__builtin_ia32_pause();
+			state = 0;
+			isLocked = __atomic_load_n(&mutex->futex.state, __ATOMIC_RELAXED) == 0 && __atomic_compare_exchange_n(&mutex->futex.state, &state, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(&mutex->futex.spins, spins + (spin - spins) / 8, __ATOMIC_RELAXED);
+
+		while (!isLocked) {
+			isLocked = __atomic_exchange_n(&mutex->futex.state, 2, __ATOMIC_ACQUIRE) == 0;
+			if (isLocked) break;
+
+			if (syscall(SYS_futex, &mutex->futex.state, FUTEX_WAIT | mutex->futex.flags, 2, 0, 0, 0) == -1 && errno != EAGAIN && errno != EINTR) {
+				vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "futex", "Error", "FUTEX_WAIT failed", ": %s", strerror(errno));
+				return false;
+			}
+		}
+	}
+
+	__atomic_store_n(&mutex->futex.owner, self, __ATOMIC_RELAXED);
+	return true;
+}
+
 
-ATTR_PUBLIC bool PTHREAD_mutexLock(pthread_mutex_t *mutex)
+static bool futexUnlock(VGC_mutex *mutex)
 {
-	switch(pthread_mutex_lock(mutex)) {
+	if (__atomic_load_n(&mutex->futex.owner, __ATOMIC_RELAXED) != currentThreadId()) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "futex", "Error", "status EPERM", 0);
+		return false;
+	}
+
+	__atomic_store_n(&mutex->futex.owner, 0, __ATOMIC_RELAXED);
+	if (__atomic_exchange_n(&mutex->futex.state, 0, __ATOMIC_RELEASE) != 2) return true;
+
+	if (syscall(SYS_futex, &mutex->futex.state, FUTEX_WAKE | mutex->futex.flags, 1, 0, 0, 0) == -1) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "futex", "Error", "FUTEX_WAKE failed", ": %s", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+
+// PTHREAD_mutexSetType
+//
+// The mutexes already initialised keep their kind.
+// The futexes are private to the process unless the memory is shared with other processes (isProcessShared).
+// With a single CPU the owner can't run while a thread spins, the futex mutexes don't spin
+//
+ATTR_PUBLIC void PTHREAD_mutexSetType(VGC_mutexType type, bool isProcessShared)
+{
+	static bool isForkHandled = false;
+
+	mutexType = type;
+	mutexFlags = isProcessShared ? 0 : FUTEX_PRIVATE_FLAG;
+	mutexSpinMax = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? VGC_MUTEX_SPIN_MAX : 0;
+	if (type == VGC_MUTEX_FUTEX && !isForkHandled) isForkHandled = PTHREAD_atfork(0, 0, resetThreadId);
+}
+
+
+ATTR_PUBLIC VGC_mutexType PTHREAD_mutexGetType(void)
+{
+	return mutexType;
+}
+
+
+
+ATTR_PUBLIC bool PTHREAD_mutexLock(VGC_mutex *mutex)
+{
+	if (mutex->type == VGC_MUTEX_FUTEX) return futexLock(mutex);
+
+	switch(pthread_mutex_lock(&mutex->pthread)) {
 		case 0:			return true;
 
 		case EOWNERDEAD:	vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "pthread_mutex_lock", "Warning", "status EOWNERDEAD", 0);
@@ -40,9 +162,11 @@ ATTR_PUBLIC bool PTHREAD_mutexLock(pthread_mutex_t *mutex)
 }
 
 
-ATTR_PUBLIC bool PTHREAD_mutexUnlock(pthread_mutex_t *mutex)
+ATTR_PUBLIC bool PTHREAD_mutexUnlock(VGC_mutex *mutex)
 {
-	switch(pthread_mutex_unlock(mutex)) {
+	if (mutex->type == VGC_MUTEX_FUTEX) return futexUnlock(mutex);
+
+	switch(pthread_mutex_unlock(&mutex->pthread)) {
 		case 0:		return true;
 
 		case EPERM:	vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "pthread_mutex_unlock", "Error", "status EPERM", 0);
@@ -54,10 +178,20 @@ ATTR_PUBLIC bool PTHREAD_mutexUnlock(pthread_mutex_t *mutex)
 }	
 
 
-ATTR_PUBLIC bool PTHREAD_mutexInit(pthread_mutex_t *restrict mutex, const pthread_mutexattr_t *restrict attr)
+// PTHREAD_mutexInit
+//
+// The attributes are those of the pthread mutexes, a futex mutex without attributes is private to the process
+//
+ATTR_PUBLIC bool PTHREAD_mutexInit(VGC_mutex *restrict mutex, const pthread_mutexattr_t *restrict attr)
 {
 	memset(mutex, 0, sizeof(*mutex));
-	switch(pthread_mutex_init(mutex, attr)) {
+	mutex->type = mutexType;
+	if (mutex->type == VGC_MUTEX_FUTEX) {
+		mutex->futex.flags = attr == 0 ? FUTEX_PRIVATE_FLAG : mutexFlags;
+		return true;
+	}
+
+	switch(pthread_mutex_init(&mutex->pthread, attr)) {
 		case 0:		return true;
 
 		case EBUSY:	vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "pthread_mutex_init", "Error", "status EBUSY", 0);
@@ -75,9 +209,15 @@ ATTR_PUBLIC bool PTHREAD_mutexInit(pthread_mutex_t *restrict mutex, const pthrea
 }
 
 
-ATTR_PUBLIC bool PTHREAD_mutexDestroy(pthread_mutex_t *mutex)
+ATTR_PUBLIC bool PTHREAD_mutexDestroy(VGC_mutex *mutex)
 {
-	switch(pthread_mutex_destroy(mutex)) {
+	if (mutex->type == VGC_MUTEX_FUTEX) {
+		if (__atomic_load_n(&mutex->futex.state, __ATOMIC_RELAXED) == 0) return true;
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "futex", "Error", "status EBUSY", 0);
+		return false;
+	}
+
+	switch(pthread_mutex_destroy(&mutex->pthread)) {
 		case 0:		return true;
 
 		case EINVAL:	vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "pthread_mutex_destroy", "Error", "status EINVAL", 0);
@@ -89,9 +229,18 @@ ATTR_PUBLIC bool PTHREAD_mutexDestroy(pthread_mutex_t *mutex)
 }
 
 
-ATTR_PUBLIC bool PTHREAD_mutexConsistent(pthread_mutex_t *mutex)
+// PTHREAD_mutexConsistent
+//
+// Only the pthread mutexes are robust
+//
+ATTR_PUBLIC bool PTHREAD_mutexConsistent(VGC_mutex *mutex)
 {
-	switch(pthread_mutex_consistent(mutex)) {
+	if (mutex->type == VGC_MUTEX_FUTEX) {
+		vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "futex", "Error", "status EINVAL", 0);
+		return false;
+	}
+
+	switch(pthread_mutex_consistent(&mutex->pthread)) {
 		case 0:		return true;
 
 		case EINVAL:	vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "pthread_mutex_consistent", "Error", "status EINVAL", 0);
@@ -544,3 +693,51 @@ ATTR_PUBLIC pthread_t PTHREAD_self(void)
 {
 	return pthread_self();
 }
+
+
+ATTR_PUBLIC bool PTHREAD_keyCreate(pthread_key_t *key, void (*destructor)(void*))
+{
+	switch (pthread_key_create(key, destructor)) {
+		case 0:		return true;
+
+		case EAGAIN:	vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "pthread_key_create", "Error", "status EAGAIN", 0);
+				return false;
+
+		case ENOMEM:	vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "pthread_key_create", "Error", "status ENOMEM", 0);
+				return false;
+
+		default:	vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "pthread_key_create", "Error", "unknown error", 0);
+				return false;
+	}
+}
+
+
+ATTR_PUBLIC bool PTHREAD_setspecific(pthread_key_t key, const void *value)
+{
+	switch (pthread_setspecific(key, value)) {
+		case 0:		return true;
+
+		case EINVAL:	vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "pthread_setspecific", "Error", "status EINVAL", 0);
+				return false;
+
+		case ENOMEM:	vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "pthread_setspecific", "Error", "status ENOMEM", 0);
+				return false;
+
+		default:	vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "pthread_setspecific", "Error", "unknown error", 0);
+				return false;
+	}
+}
+
+
+ATTR_PUBLIC bool PTHREAD_atfork(void (*prepare)(void), void (*parent)(void), void (*child)(void))
+{
+	switch (pthread_atfork(prepare, parent, child)) {
+		case 0:		return true;
+
+		case ENOMEM:	vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "pthread_atfork", "Error", "status ENOMEM", 0);
+				return false;
+
+		default:	vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "pthread_atfork", "Error", "unknown error", 0);
+				return false;
+	}
+}
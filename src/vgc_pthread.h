@@ -5,14 +5,45 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 
-bool PTHREAD_mutexInit(pthread_mutex_t *restrict mutex, const pthread_mutexattr_t *restrict attr);
-bool PTHREAD_mutexDestroy(pthread_mutex_t *mutex);
-bool PTHREAD_mutexLock(pthread_mutex_t *mutex);
-bool PTHREAD_mutexUnlock(pthread_mutex_t *mutex);
+// Kind of the mutexes taken by the PTHREAD_mutex functions
+//
+typedef enum {
+	VGC_MUTEX_PTHREAD,	// pthread mutex with the attributes given, robust, process shared and error checking with PTHREAD_mutexattrInit()
+	VGC_MUTEX_FUTEX,	// Spins for a while, then waits on a futex. It checks the owner as PTHREAD_MUTEX_ERRORCHECK, it is not robust
+	VGC_MUTEX_ALL
+} VGC_mutexType;
+
+// Mutex of the kind set by PTHREAD_mutexSetType() when it was initialised
+// VGC_MUTEX_INITIALIZER is a pthread mutex as PTHREAD_MUTEX_INITIALIZER
+//
+typedef struct VGC_mutex {
+	VGC_mutexType            type;
+	union {
+		pthread_mutex_t  pthread;
+		struct {
+			uint32_t state;		// 0 unlocked, 1 locked, 2 locked and maybe with threads waiting on the futex
+			pid_t    owner;		// Thread id of the owner, 0 if unlocked
+			int      spins;		// Average of the spins before the last locks, the next lock spins up to twice as many
+			int      flags;		// FUTEX_PRIVATE_FLAG unless the memory is shared with other processes
+		} futex;
+	};
+} VGC_mutex;
+
+#define VGC_MUTEX_INITIALIZER { .type = VGC_MUTEX_PTHREAD, .pthread = PTHREAD_MUTEX_INITIALIZER }
 
-bool PTHREAD_mutexConsistent(pthread_mutex_t *mutex);
+void PTHREAD_mutexSetType(VGC_mutexType type, bool isProcessShared);
+VGC_mutexType PTHREAD_mutexGetType(void);
+
+bool PTHREAD_mutexInit(VGC_mutex *restrict mutex, const pthread_mutexattr_t *restrict attr);
+bool PTHREAD_mutexDestroy(VGC_mutex *mutex);
+bool PTHREAD_mutexLock(VGC_mutex *mutex);
+bool PTHREAD_mutexUnlock(VGC_mutex *mutex);
+
+bool PTHREAD_mutexConsistent(VGC_mutex *mutex);
 
 bool PTHREAD_mutexattrInit(pthread_mutexattr_t *attr);
 bool PTHREAD_mutexattrDestroy(pthread_mutexattr_t *attr);
@@ -44,4 +75,8 @@ bool PTHREAD_join(pthread_t thread, void **retval);
 bool PTHREAD_detach(pthread_t thread);
 bool PTHREAD_cancel(pthread_t thread);
 
+bool PTHREAD_keyCreate(pthread_key_t *key, void (*destructor)(void*));
+bool PTHREAD_setspecific(pthread_key_t key, const void *value);
+bool PTHREAD_atfork(void (*prepare)(void), void (*parent)(void), void (*child)(void));
+
 pthread_t PTHREAD_self(void);
@@ -3,7 +3,9 @@
 //
 //#define _GNU_SOURCE	// Needed for REG_RIP - It is in the Makefile
 
+#include <link.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
@@ -11,14 +13,24 @@
 #include <execinfo.h>
 #include <ucontext.h>
 
+#include "vgc_common.h"
 #include "vgc_message.h"
 #include "vgc_stacktrace.h"
 
 
+extern VGC_shared *shared;
+
 static const char *moduleName = "STACKTRACE";
 
 #define SI_FROMUSER(siptr) (siptr)->si_code
 
+#ifdef VGC_MALLOC_STACKTRACE
+// Code of this library, its frames are skipped looking for the caller (see vgc_stacktraceCaller)
+//
+static uintptr_t libraryStart = 0;
+static uintptr_t libraryEnd = 0;
+#endif
+
 
 #ifdef VGC_MALLOC_STACKTRACE
 typedef struct ProcessPath {
@@ -45,11 +57,13 @@ static ProcessPath *getProcessPath(void)
 
 // stack trace
 //
-static void stacktrace(ProcessPath *self, char **messages, int size)
+// Shows the frames from first to last excluded
+//
+static void stacktrace(ProcessPath *self, char **messages, int first, int last)
 {
 	const int BUFFER_SIZE = 1024;
 
-	for (int i = 3; i < size - 1; i++) {
+	for (int i = first; i < last; i++) {
 		if (strncmp(messages[i], "/lib/", strlen("/lib/")) == 0) continue;
 		if (strncmp(messages[i], "/lib64/", strlen("/lib64/")) == 0) continue;
 		if (strncmp(messages[i], "/usr/lib64/", strlen("/usr/lib64/")) == 0) continue;
@@ -81,12 +95,30 @@ static void stacktrace(ProcessPath *self, char **messages, int size)
 void vgc_stacktraceShow(VGC_mallocHeader *mallocBlock)
 {
 #ifdef VGC_MALLOC_STACKTRACE
-	if (mallocBlock->btArraySize == 0) return;
+	if (mallocBlock->btArraySize == 0 || mallocBlock->btArraySize > VGC_MALLOC_STACKTRACE_SIZE) return;
 
 	char **messages = backtrace_symbols(mallocBlock->btArray, mallocBlock->btArraySize);
 	if (messages == 0) return;
 
-	stacktrace(getProcessPath(), messages, mallocBlock->btArraySize);
+	stacktrace(getProcessPath(), messages, 3, mallocBlock->btArraySize - 1);
+	free(messages);
+#endif
+}
+
+
+// vgc_stacktraceShowCaller
+//
+// Shows the caller saved by vgc_stacktraceCaller()
+//
+void vgc_stacktraceShowCaller(void *caller)
+{
+#ifdef VGC_MALLOC_STACKTRACE
+	if (caller == 0) return;
+
+	char **messages = backtrace_symbols(&caller, 1);
+	if (messages == 0) return;
+
+	stacktrace(getProcessPath(), messages, 0, 1);
 	free(messages);
 #endif
 }
@@ -98,11 +130,54 @@ void vgc_stacktraceShow(VGC_mallocHeader *mallocBlock)
 void vgc_stacktraceSave(VGC_mallocHeader *mallocBlock)
 {
 #ifdef VGC_MALLOC_STACKTRACE
-	mallocBlock->btArraySize = backtrace(mallocBlock->btArray, VGC_MALLOC_STACKTRACE_SIZE);
+	mallocBlock->btArraySize = shared->isStacktraceEnabled ? backtrace(mallocBlock->btArray, shared->stacktraceSize) : 0;
 #endif
 }
 
 
+// vgc_stacktraceCaller
+//
+// The first frame outside of this library, a single address that can be kept for each block where
+// a whole stack trace would take more than the block (the slab slots)
+//
+void *vgc_stacktraceCaller(void)
+{
+#ifdef VGC_MALLOC_STACKTRACE
+	if (!shared->isStacktraceEnabled) return 0;
+
+	void *btArray[VGC_MALLOC_STACKTRACE_SIZE];
+	int   size = backtrace(btArray, VGC_MALLOC_STACKTRACE_SIZE);
+	for (int i = 1; i < size; i++) {
+		if ((uintptr_t)btArray[i] < libraryStart || (uintptr_t)btArray[i] >= libraryEnd) return btArray[i];
+	}
+#endif
+	return 0;
+}
+
+
+#ifdef VGC_MALLOC_STACKTRACE
+// findLibrary
+//
+// dl_iterate_phdr() callback: the executable segment of the object containing "address" is the code of this library
+//
+static int findLibrary(struct dl_phdr_info *info, ATTR_UNUSED size_t size, void *address)
+{
+	for (int i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+		if (phdr->p_type != PT_LOAD || (phdr->p_flags & PF_X) == 0) continue;
+
+		uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+		if ((uintptr_t)address < start || (uintptr_t)address >= start + phdr->p_memsz) continue;
+
+		libraryStart = start;
+		libraryEnd = start + phdr->p_memsz;
+		return 1;
+	}
+	return 0;
+}
+#endif
+
+
 #ifdef VGC_MALLOC_STACKTRACE_SIGNAL
 static void continueAfterCrash(void)
 {
@@ -150,7 +225,7 @@ static void vgc_stacktrace(int sigNumber, siginfo_t *info, void *ucontext)
 	//
 	uc->uc_mcontext.gregs[REG_RIP] = (unsigned long int)continueAfterCrash;
 	vgc_message(ERROR_LEVEL, __FILE__, __LINE__, moduleName, __func__, "[bt]", 0, 0, "signal %d (%s), address is 0x%lx from 0x%lx", sigNumber, strsignal(sigNumber), info->si_addr, callerAddress);
-	stacktrace(getProcessPath(), messages, size);
+	stacktrace(getProcessPath(), messages, 3, size - 1);
 	free(messages);
 }
 #endif
@@ -161,6 +236,9 @@ static void vgc_stacktrace(int sigNumber, siginfo_t *info, void *ucontext)
 //
 bool vgc_stacktraceInit(void)
 {
+#ifdef VGC_MALLOC_STACKTRACE
+	dl_iterate_phdr(findLibrary, (void*)vgc_stacktraceCaller);
+#endif
 #ifdef VGC_MALLOC_STACKTRACE_SIGNAL
 	// Initialise signals management
 	//
@@ -8,4 +8,6 @@
 //
 void vgc_stacktraceSave(VGC_mallocHeader *mallocBlock);
 void vgc_stacktraceShow(VGC_mallocHeader *mallocBlock);
+void *vgc_stacktraceCaller(void);
+void vgc_stacktraceShowCaller(void *caller);
 bool vgc_stacktraceInit(void);
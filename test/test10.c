@@ -0,0 +1,61 @@
+// Test vgc_malloc_batch() and vgc_free_batch() with slots, blocks and large blocks
+// Prints FAILED and returns 1 at the first failure
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "vgc_malloc.h"
+
+
+#define CHECK(condition)	do { if (!(condition)) { printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #condition); return false; } } while (0)
+
+
+static bool isFilled(const unsigned char *ptr, size_t size, unsigned char value)
+{
+	for (size_t i = 0; i < size; i++) {
+		if (ptr[i] != value) return false;
+	}
+	return true;
+}
+
+
+static bool testBatch(void)
+{
+	const size_t sizes[] = { 32, 500, 20000, 4 << 20 };
+	void *ptrs[100];
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		size_t n = vgc_malloc_batch(sizes[s], 100, ptrs);
+		CHECK(n == 100);
+		for (size_t i = 0; i < n; i++) {
+			CHECK(ptrs[i] != 0 && vgc_malloc_usable_size(ptrs[i]) >= sizes[s]);
+			memset(ptrs[i], (int)i, sizes[s]);
+		}
+		for (size_t i = 0; i < n; i++) CHECK(isFilled(ptrs[i], sizes[s], (unsigned char)i));
+
+		// Some pointers freed one by one and the holes left as NULL, vgc_free_batch() skips them
+		//
+		for (size_t i = 0; i < n; i += 7) {
+			vgc_free(ptrs[i]);
+			ptrs[i] = 0;
+		}
+		vgc_free_batch(n, ptrs);
+	}
+
+	CHECK(vgc_malloc_batch(100, 0, ptrs) == 0);
+	CHECK(vgc_malloc_batch(SIZE_MAX, 4, ptrs) == 0);
+	return true;
+}
+
+
+int main(void)
+{
+	printf("Start\n");
+
+	bool isOk = testBatch();
+
+	printf("%s\n", isOk ? "End" : "FAILED");
+	return isOk ? 0 : 1;
+}
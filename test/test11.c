@@ -0,0 +1,239 @@
+// Test of libvgcpreload.so, run as LD_PRELOAD=libvgcpreload.so t11 (see the target smoke in the Makefile)
+// The program uses the standard allocation functions only: the memory must come from vgc-malloc,
+// the memory of the C library and of the bootstrap buffer must still be freed and resized, and fork() must copy the heap
+// It is linked with -rdynamic so that its dlsym() is the one called by the interposer
+// Prints FAILED and returns 1 at the first failure
+//
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <gnu/lib-names.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+
+#define CHECK(condition)	do { if (!(condition)) { printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #condition); return false; } } while (0)
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static int (*vgcMallctl)(const char *name, void *oldp, const void *newp);
+
+// Blocks allocated while the interposer finds the functions of the C library, they come from its bootstrap buffer
+//
+static unsigned char *bootstrapMalloc = 0;
+static unsigned char *bootstrapCalloc = 0;
+
+
+static bool isFilled(const unsigned char *ptr, size_t size, unsigned char value)
+{
+	for (size_t i = 0; i < size; i++) {
+		if (ptr[i] != value) return false;
+	}
+	return true;
+}
+
+
+// dlsym
+//
+// Called by the interposer to find the functions of the C library, it allocates as the dlsym() of some C libraries do.
+// RTLD_NEXT is relative to the caller, from here it would find the interposer again: the C library is searched instead
+//
+void *dlsym(void *handle, const char *symbol)
+{
+	static void *(*realDlsym)(void *handle, const char *symbol) = 0;
+	static void *libc = 0;
+
+	if (realDlsym == 0) realDlsym = (void *(*)(void*, const char*))dlvsym(RTLD_NEXT, "dlsym", "GLIBC_2.2.5");
+	if (handle != RTLD_NEXT) return realDlsym(handle, symbol);
+
+	if (bootstrapMalloc == 0) {
+		bootstrapMalloc = malloc(100);
+		if (bootstrapMalloc != 0) memset(bootstrapMalloc, 0x77, 100);
+		bootstrapCalloc = calloc(10, 10);
+	}
+	if (libc == 0) libc = dlopen(LIBC_SO, RTLD_LAZY | RTLD_NOLOAD);
+	return libc == 0 ? 0 : realDlsym(libc, symbol);
+}
+
+
+// The allocations go to vgc-malloc, its statistics count them
+//
+static bool testVgc(void)
+{
+	vgcMallctl = (int (*)(const char*, void*, const void*))dlsym(RTLD_DEFAULT, "vgc_mallctl");
+	CHECK(vgcMallctl != 0);
+
+	int largeBlocks;
+	CHECK(vgcMallctl("stats.large_blocks", &largeBlocks, 0) == 0);
+	unsigned char *large = malloc(64 << 20);
+	CHECK(large != 0);
+	int largeBlocksAfter;
+	CHECK(vgcMallctl("stats.large_blocks", &largeBlocksAfter, 0) == 0);
+	CHECK(largeBlocksAfter == largeBlocks + 1);
+	free(large);
+
+	unsigned char *zero = calloc(1000, 10);
+	CHECK(zero != 0 && isFilled(zero, 10000, 0));
+	CHECK(malloc_usable_size(zero) >= 10000);
+	free(zero);
+
+	char *copy = strdup("vgc-malloc");
+	CHECK(copy != 0 && strcmp(copy, "vgc-malloc") == 0);
+	free(copy);
+
+	void *memptr = 0;
+	CHECK(posix_memalign(&memptr, 4096, 100) == 0 && (uintptr_t)memptr % 4096 == 0);
+	free(memptr);
+	void *aligned = aligned_alloc(64, 640);
+	CHECK(aligned != 0 && (uintptr_t)aligned % 64 == 0);
+	free(aligned);
+
+	// Sizes of 0 get a block, the sizes too big fail with ENOMEM
+	//
+	void *empty = malloc(0);
+	CHECK(empty != 0);
+	free(empty);
+	free(0);
+	volatile size_t tooBig = SIZE_MAX;
+	errno = 0;
+	CHECK(malloc(tooBig) == 0 && errno == ENOMEM);
+	errno = 0;
+	CHECK(calloc(tooBig / 2, 4) == 0 && errno == ENOMEM);
+	return true;
+}
+
+
+static bool testRealloc(void)
+{
+	unsigned char *ptr = 0;
+	for (size_t size = 16; size <= 16 << 20; size *= 4) {
+		unsigned char *new = realloc(ptr, size);
+		CHECK(new != 0);
+		if (ptr != 0) CHECK(isFilled(new, size / 4, 0x5A));
+		memset(new, 0x5A, size);
+		ptr = new;
+	}
+	ptr = realloc(ptr, 100);
+	CHECK(ptr != 0 && isFilled(ptr, 100, 0x5A));
+	CHECK(realloc(ptr, 0) == 0);
+	return true;
+}
+
+
+// The memory of the C library, allocated before vgc-malloc was ready, is freed and resized by it
+//
+static bool testLibc(void)
+{
+	unsigned char *ptr = __libc_malloc(1000);
+	CHECK(ptr != 0);
+	memset(ptr, 0x33, 1000);
+	CHECK(malloc_usable_size(ptr) >= 1000);
+
+	ptr = realloc(ptr, 100000);
+	CHECK(ptr != 0 && isFilled(ptr, 1000, 0x33));
+	free(ptr);
+
+	ptr = __libc_realloc(0, 500);
+	CHECK(ptr != 0);
+	free(ptr);
+	return true;
+}
+
+
+// The blocks of the bootstrap buffer keep their size, are moved to vgc-malloc by realloc() and are never freed
+//
+static bool testBootstrap(void)
+{
+	CHECK(bootstrapMalloc != 0 && bootstrapCalloc != 0);
+	CHECK(malloc_usable_size(bootstrapMalloc) == 100 && isFilled(bootstrapMalloc, 100, 0x77));
+	CHECK(isFilled(bootstrapCalloc, 100, 0));
+
+	unsigned char *ptr = realloc(bootstrapMalloc, 5000);
+	CHECK(ptr != 0 && ptr != bootstrapMalloc && isFilled(ptr, 100, 0x77));
+	CHECK(malloc_usable_size(ptr) >= 5000);
+	free(ptr);
+	free(bootstrapCalloc);
+	CHECK(isFilled(bootstrapMalloc, 100, 0x77));
+	return true;
+}
+
+
+static void *threadMain(void *arg)
+{
+	void **ptrs = arg;
+
+	for (int i = 0; i < 10000; i++) {
+		free(ptrs[i % 64]);
+		ptrs[i % 64] = malloc(16 + i % 3000);
+		if (ptrs[i % 64] == 0) return (void*)1;
+		memset(ptrs[i % 64], i, 16);
+	}
+	return 0;
+}
+
+
+// The blocks allocated by a thread are freed by the next one
+//
+static bool testThreads(void)
+{
+	void *ptrs[64] = { 0 };
+
+	for (int i = 0; i < 4; i++) {
+		pthread_t thread;
+		void *result;
+		CHECK(pthread_create(&thread, 0, threadMain, ptrs) == 0);
+		CHECK(pthread_join(thread, &result) == 0 && result == 0);
+	}
+	for (int i = 0; i < 64; i++) free(ptrs[i]);
+	return true;
+}
+
+
+// The heap is private: the child has its own copy and allocates in it
+//
+static bool testFork(void)
+{
+	unsigned char *ptr = malloc(100000);
+	CHECK(ptr != 0);
+	memset(ptr, 0x11, 100000);
+
+	pid_t pid = fork();
+	CHECK(pid != -1);
+	if (pid == 0) {
+		bool isOk = isFilled(ptr, 100000, 0x11);
+		memset(ptr, 0x22, 100000);
+		for (int i = 0; i < 1000; i++) free(malloc(16 + i));
+		free(ptr);
+		_exit(isOk ? 0 : 1);
+	}
+
+	int status;
+	CHECK(waitpid(pid, &status, 0) == pid);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	CHECK(isFilled(ptr, 100000, 0x11));
+	free(ptr);
+	return true;
+}
+
+
+int main(void)
+{
+	printf("Start\n");
+
+	bool isOk = testVgc()
+		&& testRealloc()
+		&& testLibc()
+		&& testBootstrap()
+		&& testThreads()
+		&& testFork();
+
+	printf("%s\n", isOk ? "End" : "FAILED");
+	return isOk ? 0 : 1;
+}
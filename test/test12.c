@@ -0,0 +1,153 @@
+// Test the canary of the slab slots taken on the checked paths: the overruns are caught by vgc_free(), vgc_realloc(),
+// vgc_malloc_usable_size() and the scrubber, the slots taken on the lean path have none
+// Without the slabs, with mprotect, there is nothing to test
+// Prints FAILED and returns 1 at the first failure
+//
+#include <unistd.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "vgc_malloc.h"
+
+
+#define CHECK(condition)	do { if (!(condition)) { printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #condition); return false; } } while (0)
+
+
+static bool setPath(int path)
+{
+	CHECK(vgc_mallctl("opt.path", 0, &path) == 0);
+	return true;
+}
+
+
+// A slot keeps its size and is freed as long as the canary is intact, an overrun leaves it BUSY
+//
+static bool testFree(void)
+{
+	CHECK(setPath(1));
+
+	unsigned char *ptr = vgc_malloc(100);
+	CHECK(ptr != 0);
+	CHECK(vgc_malloc_usable_size(ptr) == 112);
+	memset(ptr, 0x11, 112);
+	vgc_free(ptr);
+
+	ptr = vgc_malloc(100);
+	CHECK(ptr != 0);
+	unsigned char canary = ptr[112];
+	ptr[112] = 0;
+	CHECK(vgc_malloc_usable_size(ptr) == 0);
+	vgc_free(ptr);
+	CHECK(vgc_realloc(ptr, 2000) == 0);
+
+	// Once the canary is restored the slot is still BUSY
+	//
+	ptr[112] = canary;
+	CHECK(vgc_malloc_usable_size(ptr) == 112);
+	vgc_free_sized(ptr, 128);
+	CHECK(vgc_malloc_usable_size(ptr) == 112);
+	vgc_free_sized(ptr, 100);
+	return true;
+}
+
+
+// The slot moves when the size changes, with the memory copied up to the canary
+//
+static bool testRealloc(void)
+{
+	CHECK(setPath(2));
+
+	unsigned char *ptr = vgc_malloc(48);
+	CHECK(ptr != 0);
+	memset(ptr, 0x22, 48);
+	CHECK(vgc_realloc(ptr, 40) == ptr);
+
+	unsigned char *new = vgc_realloc(ptr, 64);
+	CHECK(new != 0 && vgc_malloc_usable_size(new) == 64);
+	for (int i = 0; i < 48; i++) CHECK(new[i] == 0x22);
+	new[63] = 0x33;
+
+	new = vgc_realloc(new, 16);
+	CHECK(new != 0 && vgc_malloc_usable_size(new) == 16 && new[0] == 0x22);
+	vgc_free(new);
+	return true;
+}
+
+
+// The slots taken on the lean path fill their class and are freed by the checked paths
+//
+static bool testLean(void)
+{
+	CHECK(setPath(0));
+	unsigned char *ptr = vgc_malloc(100);
+	CHECK(ptr != 0 && vgc_malloc_usable_size(ptr) == 112);
+	memset(ptr, 0x44, 112);
+
+	CHECK(setPath(1));
+	CHECK(vgc_malloc_usable_size(ptr) == 112);
+	vgc_free(ptr);
+
+	// A slot with a canary freed on the lean path
+	//
+	ptr = vgc_malloc(100);
+	CHECK(ptr != 0);
+	CHECK(setPath(0));
+	vgc_free(ptr);
+	return true;
+}
+
+
+// The scrubber finds the overrun of a BUSY slot
+//
+static bool testScrubber(void)
+{
+	CHECK(setPath(1));
+
+	unsigned char *ptr = vgc_malloc(32);
+	CHECK(ptr != 0);
+
+	size_t errors, passes, passesNow;
+	CHECK(vgc_mallctl("stats.scrubber_errors", &errors, 0) == 0);
+	ptr[40] = 0;
+
+	bool isOn = true;
+	unsigned int cpu = 100;
+	CHECK(vgc_mallctl("opt.scrubber_cpu", 0, &cpu) == 0);
+	CHECK(vgc_mallctl("opt.scrubber", 0, &isOn) == 0);
+	CHECK(vgc_mallctl("stats.scrubber_passes", &passes, 0) == 0);
+	for (int i = 0; i < 1000; i++) {
+		CHECK(vgc_mallctl("stats.scrubber_passes", &passesNow, 0) == 0);
+		if (passesNow >= passes + 2) break;
+		usleep(10000);
+	}
+	isOn = false;
+	CHECK(vgc_mallctl("opt.scrubber", 0, &isOn) == 0);
+
+	size_t errorsNow;
+	CHECK(vgc_mallctl("stats.scrubber_errors", &errorsNow, 0) == 0);
+	CHECK(passesNow >= passes + 2 && errorsNow > errors);
+	return true;
+}
+
+
+int main(void)
+{
+	printf("Start\n");
+
+	bool isMprotect;
+	bool isOk = vgc_mallctl("opt.mprotect", &isMprotect, 0) == 0;
+	if (isOk && isMprotect) {
+		printf("slabs are off with mprotect\n");
+	}
+	else {
+		isOk = isOk
+			&& testFree()
+			&& testRealloc()
+			&& testLean()
+			&& testScrubber();
+	}
+
+	printf("%s\n", isOk ? "End" : "FAILED");
+	return isOk ? 0 : 1;
+}
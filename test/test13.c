@@ -0,0 +1,169 @@
+// Test the remote frees: a block freed by a thread of another arena waits in the remote frees of its arena
+// until the next allocation there, a second free meanwhile is caught, and the remote frees left at exit are not leaks.
+// The program chooses the arena of each thread: it is linked with -rdynamic, its sysconf() and sched_getcpu()
+// are the ones called by vgc-malloc and make two CPUs whatever the machine
+// Without remote frees, with mprotect, there is nothing to test
+// Prints FAILED and returns 1 at the first failure
+//
+#include <unistd.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "vgc_malloc.h"
+
+
+#define CHECK(condition)	do { if (!(condition)) { printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #condition); return false; } } while (0)
+
+extern long int __sysconf(int name);
+
+static __thread int cpu = 0;
+
+typedef struct RemoteFree {
+	void *ptrs[4];
+	int   count;
+} RemoteFree;
+
+
+// sysconf
+//
+long int sysconf(int name)
+{
+	return name == _SC_NPROCESSORS_ONLN ? 2 : __sysconf(name);
+}
+
+
+// sched_getcpu
+//
+int sched_getcpu(void)
+{
+	return cpu;
+}
+
+
+static void *remoteFreeMain(void *arg)
+{
+	RemoteFree *remoteFree = arg;
+
+	cpu = 1;
+	for (int i = 0; i < remoteFree->count; i++) vgc_free(remoteFree->ptrs[i]);
+	return 0;
+}
+
+
+// freeRemote
+//
+// The blocks are freed by a thread of the arena of CPU 1, the calling thread is in the one of CPU 0
+//
+static bool freeRemote(RemoteFree *remoteFree)
+{
+	pthread_t thread;
+	CHECK(pthread_create(&thread, 0, remoteFreeMain, remoteFree) == 0);
+	CHECK(pthread_join(thread, 0) == 0);
+	return true;
+}
+
+
+// The blocks stay BUSY until the next allocation of their arena: a slot is taken again, a block of an MMAP is FREE
+//
+static bool testDrain(void)
+{
+	unsigned char *slot = vgc_malloc(80);
+	unsigned char *block = vgc_malloc(20000);
+	CHECK(slot != 0 && block != 0);
+	memset(slot, 0x11, 80);
+
+	RemoteFree remoteFree = { { slot, block }, 2 };
+	CHECK(freeRemote(&remoteFree));
+	CHECK(vgc_malloc_usable_size(slot) == 80);
+	CHECK(vgc_malloc_usable_size(block) >= 20000);
+
+	unsigned char *again = vgc_malloc(80);
+	CHECK(again == slot);
+	CHECK(vgc_malloc_usable_size(block) == 0);
+	vgc_free(again);
+	return true;
+}
+
+
+// A second free of a slot waiting in the remote frees is caught by its key, the slot is in the list once
+//
+static bool testDoubleFree(void)
+{
+	void *slot = vgc_malloc(96);
+	CHECK(slot != 0);
+
+	RemoteFree remoteFree = { { slot, slot }, 2 };
+	CHECK(freeRemote(&remoteFree));
+
+	void *first = vgc_malloc(96);
+	void *second = vgc_malloc(96);
+	CHECK(first == slot && second != 0 && second != slot);
+	vgc_free(first);
+	vgc_free(second);
+	return true;
+}
+
+
+// The remote frees left at exit are given back before the leak report, printed by the program run again
+//
+static bool testExit(void)
+{
+	char program[200];
+	ssize_t length = readlink("/proc/self/exe", program, sizeof(program) - 1);
+	CHECK(length > 0);
+	program[length] = 0;
+
+	char command[256];
+	snprintf(command, sizeof(command), "%s exit 2>&1", program);
+
+	FILE *output = popen(command, "r");
+	CHECK(output != 0);
+
+	char line[1024];
+	bool isLeak = false, isStopped = false;
+	while (fgets(line, sizeof(line), output) != 0) {
+		if (strstr(line, "memory leak") != 0) isLeak = true;
+		if (strstr(line, "Stopping") != 0) isStopped = true;
+	}
+	CHECK(pclose(output) == 0);
+	CHECK(isStopped && !isLeak);
+	return true;
+}
+
+
+static bool runExit(void)
+{
+	RemoteFree remoteFree = { { vgc_malloc(80), vgc_malloc(20000) }, 2 };
+	CHECK(remoteFree.ptrs[0] != 0 && remoteFree.ptrs[1] != 0);
+	return freeRemote(&remoteFree);
+}
+
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1 && strcmp(argv[1], "exit") == 0) return runExit() ? 0 : 1;
+
+	printf("Start\n");
+
+	bool isMprotect;
+	bool isOk = vgc_mallctl("opt.mprotect", &isMprotect, 0) == 0;
+	if (isOk && isMprotect) {
+		printf("remote frees are off with mprotect\n");
+	}
+	else {
+		unsigned int arenas = 0;
+		bool isRemoteFree = true;
+		isOk = isOk
+			&& vgc_mallctl("stats.arenas", &arenas, 0) == 0 && arenas == 2
+			&& vgc_mallctl("opt.remote_free", 0, &isRemoteFree) == 0
+			&& testDrain()
+			&& testDoubleFree()
+			&& testExit();
+	}
+
+	printf("%s\n", isOk ? "End" : "FAILED");
+	return isOk ? 0 : 1;
+}
@@ -0,0 +1,179 @@
+// Test the futex mutexes (setting lock:futex): threads contending for a mutex and for the arenas,
+// the errors reported as PTHREAD_MUTEX_ERRORCHECK does, and fork with the private memory (shared:false)
+// where the child initialises again the mutexes copied while the threads of the parent were using them.
+// The tests run in the program started again with lock:futex and shared:false added to VGC_MALLOC_CONF
+// Prints FAILED and returns 1 at the first failure
+//
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "vgc_malloc.h"
+#include "vgc_pthread.h"
+
+
+#define CHECK(condition)	do { if (!(condition)) { printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #condition); return false; } } while (0)
+
+#define THREADS 4
+#define LOOPS   100000
+
+static VGC_mutex mutex;
+static long int  counter = 0;
+static bool      isStopping = false;
+
+
+static void *contentionMain(void *arg)
+{
+	for (int i = 0; i < LOOPS; i++) {
+		if (!PTHREAD_mutexLock(&mutex)) return (void*)1;
+		counter++;
+		if (!PTHREAD_mutexUnlock(&mutex)) return (void*)1;
+
+		void *ptr = vgc_malloc(16 + i % 5000);
+		if (ptr == 0) return (void*)1;
+		vgc_free(ptr);
+	}
+	return 0;
+}
+
+
+// No increment of the counter is lost and the mutex is unlocked at the end
+//
+static bool testContention(void)
+{
+	CHECK(PTHREAD_mutexGetType() == VGC_MUTEX_FUTEX);
+	CHECK(PTHREAD_mutexInit(&mutex, 0));
+	CHECK(mutex.type == VGC_MUTEX_FUTEX);
+
+	pthread_t threads[THREADS];
+	for (int i = 0; i < THREADS; i++) CHECK(pthread_create(&threads[i], 0, contentionMain, 0) == 0);
+	for (int i = 0; i < THREADS; i++) {
+		void *result;
+		CHECK(pthread_join(threads[i], &result) == 0 && result == 0);
+	}
+
+	CHECK(counter == (long int)THREADS * LOOPS);
+	CHECK(mutex.futex.state == 0 && mutex.futex.owner == 0);
+	CHECK(PTHREAD_mutexDestroy(&mutex));
+	return true;
+}
+
+
+static void *unlockMain(void *arg)
+{
+	return PTHREAD_mutexUnlock(&mutex) ? (void*)1 : 0;
+}
+
+
+// A relock by the owner fails (EDEADLK) instead of waiting forever, an unlock by another thread fails (EPERM)
+//
+static bool testErrorCheck(void)
+{
+	CHECK(PTHREAD_mutexInit(&mutex, 0));
+	CHECK(!PTHREAD_mutexUnlock(&mutex));
+
+	CHECK(PTHREAD_mutexLock(&mutex));
+	CHECK(!PTHREAD_mutexLock(&mutex));
+
+	pthread_t thread;
+	void *result;
+	CHECK(pthread_create(&thread, 0, unlockMain, 0) == 0);
+	CHECK(pthread_join(thread, &result) == 0 && result == 0);
+	CHECK(mutex.futex.state != 0);
+
+	CHECK(!PTHREAD_mutexDestroy(&mutex));
+	CHECK(PTHREAD_mutexUnlock(&mutex));
+	CHECK(PTHREAD_mutexDestroy(&mutex));
+	return true;
+}
+
+
+static void *forkMain(void *arg)
+{
+	for (int i = 0; !__atomic_load_n(&isStopping, __ATOMIC_RELAXED); i++) {
+		void *ptr = vgc_malloc(16 + i % 100000);
+		if (ptr == 0) return (void*)1;
+		vgc_free(ptr);
+	}
+	return 0;
+}
+
+
+// The threads of the parent allocate while it forks, the mutexes are copied as taken by the fork handlers.
+// The child finds them initialised again, it allocates in its own copy of the blocks
+//
+static bool testFork(void)
+{
+	bool isShared = true;
+	CHECK(vgc_mallctl("opt.shared", &isShared, 0) == 0 && !isShared);
+
+	unsigned char *ptr = vgc_malloc(1000);
+	CHECK(ptr != 0);
+	memset(ptr, 0x11, 1000);
+
+	pthread_t threads[THREADS];
+	for (int i = 0; i < THREADS; i++) CHECK(pthread_create(&threads[i], 0, forkMain, 0) == 0);
+
+	bool isOk = true;
+	for (int i = 0; i < 20 && isOk; i++) {
+		pid_t pid = fork();
+		if (pid == -1) {
+			isOk = false;
+			break;
+		}
+		if (pid == 0) {
+			alarm(10);
+			for (int j = 0; j < 10000; j++) {
+				void *child = vgc_malloc(16 + j % 100000);
+				if (child == 0) _exit(1);
+				vgc_free(child);
+			}
+			memset(ptr, 0x22, 1000);
+			vgc_free(ptr);
+			_exit(0);
+		}
+
+		int status;
+		isOk = waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	}
+
+	__atomic_store_n(&isStopping, true, __ATOMIC_RELAXED);
+	for (int i = 0; i < THREADS; i++) {
+		void *result;
+		CHECK(pthread_join(threads[i], &result) == 0 && result == 0);
+	}
+	CHECK(isOk);
+
+	for (int i = 0; i < 1000; i++) CHECK(ptr[i] == 0x11);
+	vgc_free(ptr);
+	return true;
+}
+
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1 && strcmp(argv[1], "futex") == 0) return testContention() && testErrorCheck() && testFork() ? 0 : 1;
+
+	printf("Start\n");
+
+	bool isOk = true;
+	pid_t pid = fork();
+	if (pid == 0) {
+		char conf[256];
+		const char *env = getenv("VGC_MALLOC_CONF");
+		snprintf(conf, sizeof(conf), "%s%slock:futex,shared:false", env != 0 ? env : "", env != 0 && env[0] != 0 ? "," : "");
+		setenv("VGC_MALLOC_CONF", conf, 1);
+		execl("/proc/self/exe", "/proc/self/exe", "futex", (char*)0);
+		_exit(2);
+	}
+
+	int status;
+	isOk = pid != -1 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+	printf("%s\n", isOk ? "End" : "FAILED");
+	return isOk ? 0 : 1;
+}
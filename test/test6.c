@@ -0,0 +1,123 @@
+// Test vgc_calloc() with each engine, and the requests too big to be served by vgc_malloc() and vgc_calloc()
+// Prints FAILED and returns 1 at the first failure
+//
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include "vgc_malloc.h"
+
+
+#define CHECK(condition)	do { if (!(condition)) { printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #condition); return false; } } while (0)
+
+static const char *const engines[] = { "fit", "class", "buddy" };
+
+
+static bool isFilled(const unsigned char *ptr, size_t size, unsigned char value)
+{
+	for (size_t i = 0; i < size; i++) {
+		if (ptr[i] != value) return false;
+	}
+	return true;
+}
+
+
+// The blocks freed and purged are given back zero by the kernel, calloc can skip them only if they stay zero
+// once merged with their neighbours that were used
+//
+static bool testCalloc(void)
+{
+	char *ptrs[60];
+
+	for (int round = 0; round < 10; round++) {
+		for (int i = 0; i < 60; i++) {
+			ptrs[i] = vgc_malloc(100000);
+			CHECK(ptrs[i] != 0);
+			memset(ptrs[i], 0xAB, 100000);
+		}
+		for (int i = 0; i < 12; i++) vgc_free(ptrs[i]);
+		vgc_malloc_trim(0);
+
+		for (int i = 0; i < 5; i++) {
+			unsigned char *c = vgc_calloc(1, 250000);
+			CHECK(c != 0);
+			CHECK(isFilled(c, 250000, 0));
+			memset(c, 0xCD, 250000);
+			vgc_free(c);
+		}
+		for (int i = 12; i < 60; i++) vgc_free(ptrs[i]);
+	}
+
+	// A slot of a slab and a large block
+	//
+	unsigned char *small = vgc_malloc(48);
+	memset(small, 0xAB, 48);
+	vgc_free(small);
+	small = vgc_calloc(6, 8);
+	CHECK(small != 0 && isFilled(small, 48, 0));
+	vgc_free(small);
+
+	unsigned char *large = vgc_calloc(8, 1 << 20);
+	CHECK(large != 0 && isFilled(large, 8 << 20, 0));
+	vgc_free(large);
+
+	CHECK(vgc_calloc(0, 10) == 0);
+	return true;
+}
+
+
+// The engine can't change once the arenas have blocks, each engine is tested in a new process
+//
+static bool testCallocEngines(const char *program)
+{
+	for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+		char conf[64];
+		snprintf(conf, sizeof(conf), "engine:%s", engines[i]);
+
+		pid_t pid = fork();
+		CHECK(pid != -1);
+		if (pid == 0) {
+			setenv("VGC_MALLOC_CONF", conf, 1);
+			execl(program, program, "calloc", (char*)0);
+			_exit(2);
+		}
+
+		int status;
+		CHECK(waitpid(pid, &status, 0) == pid);
+		printf("calloc with engine %s: %s\n", engines[i], WIFEXITED(status) && WEXITSTATUS(status) == 0 ? "ok" : "failed");
+		CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	}
+	return true;
+}
+
+
+// The sizes that would wrap when rounded up, or when nmemb * size is computed by vgc_calloc(), are rejected
+//
+static bool testTooBig(void)
+{
+	CHECK(vgc_malloc(SIZE_MAX) == 0);
+	CHECK(vgc_malloc(SIZE_MAX - 8) == 0);
+	CHECK(vgc_malloc(SIZE_MAX / 2 + 1) == 0);
+	CHECK(vgc_calloc(SIZE_MAX, 1) == 0);
+	CHECK(vgc_calloc(((size_t)1 << 60) + 1, 16) == 0);
+	CHECK(vgc_calloc(16, SIZE_MAX / 8) == 0);
+	return true;
+}
+
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1 && strcmp(argv[1], "calloc") == 0) return testCalloc() ? 0 : 1;
+
+	printf("Start\n");
+
+	bool isOk = testCallocEngines("/proc/self/exe")
+		&& testTooBig();
+
+	printf("%s\n", isOk ? "End" : "FAILED");
+	return isOk ? 0 : 1;
+}
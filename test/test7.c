@@ -0,0 +1,126 @@
+// Test vgc_realloc(): blocks resized in place, slots kept in their slab class, large blocks remapped,
+// and the sizes too big to be rounded up, that must leave the block untouched
+// Prints FAILED and returns 1 at the first failure
+//
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "vgc_malloc.h"
+
+
+#define CHECK(condition)	do { if (!(condition)) { printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #condition); return false; } } while (0)
+
+
+static bool isFilled(const unsigned char *ptr, size_t size, unsigned char value)
+{
+	for (size_t i = 0; i < size; i++) {
+		if (ptr[i] != value) return false;
+	}
+	return true;
+}
+
+
+static bool testInPlace(void)
+{
+	bool isMprotect;
+	CHECK(vgc_mallctl("opt.mprotect", &isMprotect, 0) == 0);
+
+	// Without mprotect a block that shrinks, or grows into the FREE space after it, stays where it is
+	//
+	unsigned char *ptr = vgc_malloc(10000);
+	CHECK(ptr != 0);
+	memset(ptr, 0x11, 10000);
+	unsigned char *new = vgc_realloc(ptr, 5000);
+	CHECK(new != 0 && isFilled(new, 5000, 0x11));
+	if (!isMprotect) CHECK(new == ptr);
+	ptr = vgc_realloc(new, 9000);
+	CHECK(ptr != 0 && isFilled(ptr, 5000, 0x11));
+	if (!isMprotect) CHECK(ptr == new);
+	vgc_free(ptr);
+
+	// A slot keeps its place in its slab class
+	//
+	ptr = vgc_malloc(40);
+	memset(ptr, 0x22, 40);
+	new = vgc_realloc(ptr, 44);
+	CHECK(new != 0 && isFilled(new, 40, 0x22));
+	ptr = vgc_realloc(new, 3000);
+	CHECK(ptr != 0 && isFilled(ptr, 40, 0x22));
+	vgc_free(ptr);
+
+	CHECK(vgc_realloc(0, 0) == 0);
+	ptr = vgc_realloc(0, 100);
+	CHECK(ptr != 0);
+	CHECK(vgc_realloc(ptr, 0) == 0);
+	return true;
+}
+
+
+// A large block is remapped, in private memory it grows and shrinks without copying,
+// in shared memory it only shrinks. It stays one large block and keeps no file descriptor
+//
+static bool testLarge(void)
+{
+	int largeBlocks;
+	CHECK(vgc_mallctl("stats.large_blocks", &largeBlocks, 0) == 0);
+	int fd = dup(0);
+	CHECK(fd != -1);
+	close(fd);
+
+	unsigned char *ptr = vgc_malloc(64 << 20);
+	CHECK(ptr != 0);
+	memset(ptr, 0x33, 64 << 20);
+	unsigned char *new = vgc_realloc(ptr, 256 << 20);
+	CHECK(new != 0 && isFilled(new, 64 << 20, 0x33));
+	memset(new, 0x44, 256 << 20);
+	ptr = vgc_realloc(new, 32 << 20);
+	CHECK(ptr != 0 && isFilled(ptr, 32 << 20, 0x44));
+
+	// The lowest free descriptor is the same as before the allocations
+	//
+	int fdAfter = dup(0);
+	CHECK(fdAfter == fd);
+	close(fdAfter);
+
+	int largeBlocksAfter;
+	CHECK(vgc_mallctl("stats.large_blocks", &largeBlocksAfter, 0) == 0);
+	CHECK(largeBlocksAfter == largeBlocks + 1);
+	vgc_free(ptr);
+	return true;
+}
+
+
+static bool testTooBig(void)
+{
+	const size_t sizes[] = { 100, 20000, 64 << 20 };
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		unsigned char *ptr = vgc_malloc(sizes[s]);
+		CHECK(ptr != 0);
+		memset(ptr, 0x55, sizes[s]);
+		size_t usable = vgc_malloc_usable_size(ptr);
+
+		CHECK(vgc_realloc(ptr, SIZE_MAX) == 0);
+		CHECK(vgc_realloc(ptr, SIZE_MAX - 8) == 0);
+		CHECK(vgc_malloc_usable_size(ptr) == usable && isFilled(ptr, sizes[s], 0x55));
+		vgc_free(ptr);
+	}
+	return true;
+}
+
+
+int main(void)
+{
+	printf("Start\n");
+
+	bool isOk = testInPlace()
+		&& testLarge()
+		&& testTooBig();
+
+	printf("%s\n", isOk ? "End" : "FAILED");
+	return isOk ? 0 : 1;
+}
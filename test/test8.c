@@ -0,0 +1,82 @@
+// Test vgc_mallctl(): reading the settings and the statistics, the errors for wrong names and values,
+// the settings that can't change once the memory is used and the path changed at run time
+// Prints FAILED and returns 1 at the first failure
+//
+#include <unistd.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "vgc_malloc.h"
+
+
+#define CHECK(condition)	do { if (!(condition)) { printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #condition); return false; } } while (0)
+
+
+static bool testMallctl(void)
+{
+	size_t z;
+	bool b;
+	int i;
+
+	CHECK(vgc_mallctl("opt.mmap_pages", &z, 0) == 0 && z != 0);
+	CHECK(vgc_mallctl("opt.stacktrace_size", &i, 0) == 0);
+	CHECK(vgc_mallctl("opt.path", &i, 0) == 0);
+	CHECK(vgc_mallctl("stats.page_size", &z, 0) == 0 && z == (size_t)sysconf(_SC_PAGESIZE));
+	CHECK(vgc_mallctl("stats.mapped", &z, 0) == 0 && z != 0);
+	CHECK(vgc_mallctl("stats.mmap_blocks", &i, 0) == 0 && i > 0);
+
+	CHECK(vgc_mallctl("opt.none", &i, 0) == ENOENT);
+	CHECK(vgc_mallctl("stats.mapped", 0, &z) == EPERM);
+	i = 0;
+	CHECK(vgc_mallctl("opt.stacktrace_size", 0, &i) == EINVAL);
+
+	// Settings that change the layout of the memory can't change once it is used
+	//
+	CHECK(vgc_mallctl("opt.mprotect", &b, 0) == 0);
+	b = !b;
+	i = vgc_mallctl("opt.mprotect", 0, &b);
+	CHECK(i == EBUSY || i == ENOTSUP);
+
+	CHECK(vgc_mallctl("opt.check_interval", &i, 0) == 0);
+	CHECK(vgc_mallctl("opt.check_interval", 0, &i) == 0);
+	return true;
+}
+
+
+// The path changes at run time, the blocks allocated by the lean path are reported as leaks at exit
+// by the leak path without the stack traces they don't have (the headers are over memory filled before)
+//
+static bool testPath(void)
+{
+	int lean = 0;
+	CHECK(vgc_mallctl("opt.path", 0, &lean) == 0);
+	for (int i = 0; i < 100; i++) {
+		unsigned char *ptr = vgc_malloc(20000);
+		CHECK(ptr != 0);
+		memset(ptr, 0xFF, 20000);
+		vgc_free(ptr);
+	}
+	for (int i = 0; i < 100; i++) CHECK(vgc_malloc(2000 + i * 16) != 0);
+
+	int leak = 1;
+	CHECK(vgc_mallctl("opt.path", 0, &leak) == 0);
+	int wrong = 3;
+	CHECK(vgc_mallctl("opt.path", 0, &wrong) == EINVAL);
+	return true;
+}
+
+
+int main(void)
+{
+	printf("Start\n");
+
+	void *ptr = vgc_malloc(20000);
+	bool isOk = testMallctl();
+	vgc_free(ptr);
+	isOk = isOk && testPath();
+
+	printf("%s\n", isOk ? "End" : "FAILED");
+	return isOk ? 0 : 1;
+}
@@ -0,0 +1,103 @@
+// Test the aligned allocations with each engine: vgc_aligned_alloc(), vgc_posix_memalign() and vgc_memalign()
+// Prints FAILED and returns 1 at the first failure
+//
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/wait.h>
+
+#include "vgc_malloc.h"
+
+
+#define CHECK(condition)	do { if (!(condition)) { printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #condition); return false; } } while (0)
+
+static const char *const engines[] = { "fit", "class", "buddy" };
+
+
+// The alignments up to a page are served by the MMAP blocks of the arenas with every engine, not by large blocks
+//
+static bool testAligned(void)
+{
+	for (size_t alignment = 16; alignment <= 1 << 20; alignment <<= 1) {
+		int largeBlocks, largeBlocksAfter;
+		CHECK(vgc_mallctl("stats.large_blocks", &largeBlocks, 0) == 0);
+		void *small = vgc_aligned_alloc(alignment, 64);
+		CHECK(small != 0 && (uintptr_t)small % alignment == 0);
+		CHECK(vgc_mallctl("stats.large_blocks", &largeBlocksAfter, 0) == 0);
+		CHECK(alignment > 4096 || largeBlocksAfter == largeBlocks);
+		memset(small, 1, 64);
+
+		char *ptr = vgc_aligned_alloc(alignment, 3 * alignment);
+		CHECK(ptr != 0 && (uintptr_t)ptr % alignment == 0);
+		memset(ptr, 1, 3 * alignment);
+		vgc_free(ptr);
+
+		void *memptr = 0;
+		CHECK(vgc_posix_memalign(&memptr, alignment, 100) == 0);
+		CHECK(memptr != 0 && (uintptr_t)memptr % alignment == 0);
+		memset(memptr, 1, 100);
+		vgc_free(memptr);
+
+		ptr = vgc_memalign(alignment, 20000);
+		CHECK(ptr != 0 && (uintptr_t)ptr % alignment == 0);
+		memset(ptr, 1, 20000);
+		vgc_free(ptr);
+		vgc_free(small);
+	}
+
+	void *memptr = (void*)1;
+	CHECK(vgc_posix_memalign(&memptr, 24, 100) == EINVAL && memptr == (void*)1);
+	CHECK(vgc_posix_memalign(&memptr, 4, 100) == EINVAL);
+	errno = 0;
+	CHECK(vgc_aligned_alloc(100, 200) == 0 && errno == EINVAL);
+
+	// The sizes too big to be served
+	//
+	errno = 0;
+	CHECK(vgc_aligned_alloc(64, SIZE_MAX) == 0 && errno == ENOMEM);
+	memptr = 0;
+	CHECK(vgc_posix_memalign(&memptr, 64, SIZE_MAX - 8) == ENOMEM && memptr == 0);
+	return true;
+}
+
+
+// The engine can't change once the arenas have blocks, each engine is tested in a new process
+//
+static bool testAlignedEngines(const char *program)
+{
+	for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+		char conf[64];
+		snprintf(conf, sizeof(conf), "engine:%s", engines[i]);
+
+		pid_t pid = fork();
+		CHECK(pid != -1);
+		if (pid == 0) {
+			setenv("VGC_MALLOC_CONF", conf, 1);
+			execl(program, program, "aligned", (char*)0);
+			_exit(2);
+		}
+
+		int status;
+		CHECK(waitpid(pid, &status, 0) == pid);
+		printf("aligned with engine %s: %s\n", engines[i], WIFEXITED(status) && WEXITSTATUS(status) == 0 ? "ok" : "failed");
+		CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	}
+	return true;
+}
+
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1 && strcmp(argv[1], "aligned") == 0) return testAligned() ? 0 : 1;
+
+	printf("Start\n");
+
+	bool isOk = testAlignedEngines("/proc/self/exe");
+
+	printf("%s\n", isOk ? "End" : "FAILED");
+	return isOk ? 0 : 1;
+}